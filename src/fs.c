@@ -1,39 +1,81 @@
+#include "util.h"
+
+#include <dirent.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
 #include <stdio.h>
 #include <string.h>
 #include <sys/sysinfo.h>
 #include <time.h>
 #include <unistd.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #include "fs.h"
+#include "fs_dcache.h"
+#include "fs_dircache.h"
+#include "fs_epoch.h"
 #include "fs_fh.h"
+#include "fs_flush.h"
+#include "fs_ioctl.h"
+#include "fs_journal.h"
+#include "fs_lower.h"
+#include "fs_memfd.h"
+#include "fs_notify.h"
+#include "fs_reclaim.h"
+#include "fs_ttl.h"
 
 #define DEF_DIR_MODE S_IFDIR | 0755
 #define DEF_FILE_MODE S_IFREG | 0644
 
 // root is directory type item
 static fs_item root_dir;
+// protects the whole tree. Requests that modify the tree take it for writing
+static pthread_rwlock_t fs_lock = PTHREAD_RWLOCK_INITIALIZER;
+// seqcount for changes that the lock-free walk can't see from the directory
+// it's in: moving an item or removing a directory that still has items
+static uint32_t tree_seq = 0;
+// bumped inside tree_seq when a directory moves or one that still has items
+// is removed, the paths cached in fs_dircache stay valid until then
+static uint32_t tree_gen = 0;
+// the last inode number given out, see init_fs_item
+static uint64_t last_ino = 0;
 
-static void free_fs_item(fs_item* item) __nonnull((1));
 static int fs_get_dir_item(const path_string* p_string, fs_item** buf, int offset) __nonnull((1));
 static void init_fs_file(fs_item* file_item, mode_t mode) __nonnull((1));
-static void free_fs_file(const fs_file* file) __nonnull((1));
 static void init_fs_dir(fs_item* dir_item, mode_t mode) __nonnull((1));
-static void free_fs_dir(fs_dir* dir) __nonnull((1));
-static void init_fs_item(fs_item* item, const char* name, fs_item* parent, FS_ITEM_TYPE type, mode_t mode) __nonnull((1, 2));
-static void free_fs_item(fs_item* item) __nonnull((1));
-static int split_file_path(char* path, int* idx_buff);
+static void init_fs_item(fs_item* item, const char* name, size_t name_len, fs_item* parent, FS_ITEM_TYPE type, mode_t mode) __nonnull((1, 2));
+static size_t find_separator(const char* path, size_t pos) __nonnull((1));
 static int add_item(const path_string* p_string, FS_ITEM_TYPE type, mode_t mode);
-
-// Get a file from index
-const char* ps_file(const path_string* p_string, int idx) {
-    return &p_string->path_copy[p_string->idx_buff[idx]];
-}
-
-// Get name of the last file
-const char* ps_last_file(const path_string* p_string) {
-    return &p_string->path_copy[p_string->idx_buff[p_string->files - 1]];
-}
+static void remove_item(fs_item* item) __nonnull((1));
+static void touch_item(fs_item* item) __nonnull((1));
+static bool is_attached(const fs_item* item) __nonnull((1));
+static void journal_change(uint32_t op, const fs_item* item) __nonnull((2));
+static void item_write_begin(fs_item* item) __nonnull((1));
+static void item_write_lock(fs_item* item) __nonnull((1));
+static void item_write_end(fs_item* item) __nonnull((1));
+static bool item_at_path(const fs_item* item, const path_string* p_string) __nonnull((1, 2));
+static void tree_write_begin();
+static void tree_write_end();
+static bool cached_parent(const path_string* p_string, fs_item** buf) __nonnull((1, 2));
+static void cache_parent(const path_string* p_string, fs_item* dir) __nonnull((1, 2));
+static bool memfd_open(fs_file* file) __nonnull((1));
+static int memfd_write(fs_file* file, const char* buffer, size_t size, off_t offset) __nonnull((1, 2));
+static int memfd_truncate(fs_file* file, off_t size) __nonnull((1));
+static int file_write(fs_file* file, const char* buffer, size_t size, off_t offset) __nonnull((1, 2));
+static int file_read(const fs_file* file, char* buffer, size_t size, off_t offset) __nonnull((1, 2));
+static int attach_item(fs_item* dir, const char* name, size_t len, uint32_t hash, FS_ITEM_TYPE type, mode_t mode, const char* path, const struct stat* lower_st, fs_item** buf) __nonnull((1, 2, 7, 9));
+static int add_child(fs_item* dir, const char* name, size_t len, mode_t mode, const struct stat* lower_st, fs_item** buf) __nonnull((1, 2, 6));
+static void lower_attach(fs_item* item, const struct stat* st) __nonnull((1, 2));
+static void set_ttl(fs_item* item, uint32_t ttl) __nonnull((1));
+static void notify_removed(const fs_item* item) __nonnull((1));
+static int lower_fill(fs_item* dir) __nonnull((1));
+static int lower_load(fs_file* file) __nonnull((1));
+static int lower_keep(fs_file* file) __nonnull((1));
+static int lower_detach(fs_item* item) __nonnull((1));
 
 bool fs_item_is_dir(const fs_item* item) {
     return item->st.st_mode & S_IFDIR;
@@ -46,6 +88,13 @@ bool fs_item_is_file(const fs_item* item) {
 static void init_fs_file(fs_item* file_item, mode_t mode) {
     fs_file* file = &fs_item_file(file_item);
     file->data = NULL;
+    file->cap = 0;
+    file->fd = -1;
+    file->lower = FS_LOWER_NONE;
+    file->lower_path = NULL;
+    file->lower_prev = NULL;
+    file->lower_next = NULL;
+    file->flush = NULL;
     file->item = file_item;
     struct stat* st = &file_item->st;
     st->st_uid = getuid(); // The owner of the file/directory is the user who mounted the filesystem
@@ -57,26 +106,17 @@ static void init_fs_file(fs_item* file_item, mode_t mode) {
     st->st_blksize = 0; // blksize is ignored by fuse
     st->st_mode = mode;
     st->st_nlink = 1;
-    st->st_ino = 0; // Inodes are automatically handled by fuse
+    st->st_ino = 0; // Set by init_fs_item, fuse numbers the inodes it shows itself
     st->st_dev = 0; // Set by fuse so it can be anything fuse decides it to be
     st->st_blocks = 0; // Ignore this until we find a use for it
 }
 
-static void free_fs_file(const fs_file* file) {
-    if (file->data != NULL) {
-        free(file->data);
-    }
-}
-
 static void init_fs_dir(fs_item* dir_item, mode_t mode) {
     fs_dir* dir = &fs_item_dir(dir_item);
     dir->item = dir_item;
-    // load_factory arg is the percentage of how full the map can be until realloc
-    // default (0) sets the value to 75 so map can be 75% before realloc.
-    // this should be fine
-    // cap is initial capacity. 0 is accepted so use it
-    // TODO: should we prealloc?
-    sc_map_init_sv(&dir->items, 0, 0);
+    dir->lower = FS_LOWER_NONE;
+    // starts with the shared empty table, see fs_reserve for preallocating
+    fs_dirmap_init(&dir->items);
     struct stat* st = &dir_item->st;
     st->st_uid = getuid(); // The owner of the file/directory is the user who mounted the filesystem
     st->st_gid = getgid(); // The group of the file/directory is the same as the group of the user who mounted the filesystem
@@ -87,123 +127,514 @@ static void init_fs_dir(fs_item* dir_item, mode_t mode) {
     st->st_blksize = 0; // blksize is ignored by fuse
     st->st_mode = mode;
     st->st_nlink = 2; // Why "two" hardlinks instead of "one"? The answer is here: http://unix.stackexchange.com/a/101536
-    st->st_ino = 0; // Inodes are automatically handled by fuse
+    st->st_ino = 0; // Set by init_fs_item, fuse numbers the inodes it shows itself
     st->st_dev = 0; // Set by fuse so it can be anything fuse decides it to be
     st->st_blocks = 0; // Ignore this until we find a use for it
 }
 
-static void free_fs_dir(fs_dir* dir) {
-    fs_item* item;
-    fs_foreach_val(&dir->items, item) {
-        free_fs_item(item);
-        free(item);
-    }
-    sc_map_term_sv(&dir->items);
-}
-
-static void init_fs_item(fs_item* item, const char* name, fs_item* parent, FS_ITEM_TYPE type, mode_t mode) {
+static void init_fs_item(fs_item* item, const char* name, size_t name_len, fs_item* parent, FS_ITEM_TYPE type, mode_t mode) {
     item->parent = parent;
-    item->name_len = strlen(name);
-    strcpy((char*)item->name, name);
+    item->seq = 0;
+    // the reference of the parent
+    item->refs = 1;
+    item->dcache_slot = FS_DCACHE_NONE;
+    item->gen = 0;
+    item->timer.next = NULL;
+    item->timer.prev = NULL;
+    item->timer.ttl = 0;
+    item->name_len = name_len;
+    memcpy((char*)item->name, name, name_len);
+    ((char*)item->name)[name_len] = '\0';
     if (type == FS_DIR) {
         init_fs_dir(item, mode);
     } else {
         init_fs_file(item, mode);
     }
+    // names the item in the change journal, items are created under the
+    // read lock too
+    item->st.st_ino = __atomic_add_fetch(&last_ino, 1, __ATOMIC_RELAXED);
 }
 
-static void free_fs_item(fs_item* item) {
+/**
+ * Index of the next '/' or the terminator from pos onwards.
+ */
+#ifdef __SSE2__
+// aligned loads never cross a page so reading past the terminator is safe,
+// but the sanitizer doesn't know that
+__attribute__((no_sanitize_address))
+static size_t find_separator(const char* path, size_t pos) {
+    const __m128i slash = _mm_set1_epi8('/');
+    const __m128i zero = _mm_setzero_si128();
+    const char* start = path + pos;
+    size_t skip = (uintptr_t)start & 15;
+    const char* block = start - skip;
+    // ignore the bytes before the start in the first block
+    unsigned mask = 0xffffu << skip;
+    while (true) {
+        __m128i chars = _mm_load_si128((const __m128i*)block);
+        mask &= _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(chars, slash), _mm_cmpeq_epi8(chars, zero)));
+        if (mask != 0)
+            return block - path + __builtin_ctz(mask);
+        block += 16;
+        mask = 0xffffu;
+    }
+}
+#else
+static size_t find_separator(const char* path, size_t pos) {
+    while (path[pos] != '/' && path[pos] != '\0')
+        pos++;
+    return pos;
+}
+#endif
+
+static int add_item(const path_string* p_string, FS_ITEM_TYPE type, mode_t mode) {
+    fs_item* cdir;
+    int ret = fs_get_dir_item(p_string, &cdir, 1);
+    if (ret != 0)
+        return ret;
+
+    const path_component* last = ps_last(p_string);
+    fs_item* item;
+    ret = attach_item(cdir, &p_string->path[last->offset], last->len, last->hash, type, mode, p_string->path, NULL, &item);
+    if (ret != 0)
+        return ret;
+    fs_journal_add(FS_JOURNAL_CREATE, item);
+    fs_flush_create(p_string->path, mode);
+    return 0;
+}
+
+/**
+ * Create the item in the directory. path is the whole path of the new item
+ * for the ttl rules. lower_st is the metadata of an item read in from the
+ * lower directory, NULL for new items. If another thread added the name
+ * first, -EEXIST is returned with its item in buf
+ */
+static int attach_item(fs_item* dir, const char* name, size_t len, uint32_t hash, FS_ITEM_TYPE type, mode_t mode, const char* path, const struct stat* lower_st, fs_item** buf) {
+    fs_item* new_item = malloc(sizeof(fs_item));
+    if (new_item == NULL)
+        return -ENOMEM;
+    init_fs_item(new_item, name, len, dir, type, mode);
+    // lookups can find the item as soon as it's in the directory
+    if (lower_st != NULL)
+        lower_attach(new_item, lower_st);
+    if (!fs_dirmap_put(&fs_item_dir(dir).items, new_item, hash)) {
+        // nobody has seen the item, and the one that won stays while the
+        // lock is held
+        if (type == FS_DIR)
+            fs_dirmap_term(&fs_item_dir(new_item).items);
+        free(new_item);
+        fs_dirmap_get(&fs_item_dir(dir).items, name, len, hash, buf);
+        return -EEXIST;
+    }
+    touch_item(dir);
+
+    // items inherit the ttl from the directory they are created in. Below a
+    // rule path, the ones in a directory without one, like a directory
+    // moved there, get the rule's
+    bool at_rule;
+    uint32_t rule_ttl = fs_ttl_rule(path, &at_rule);
+    uint32_t ttl = at_rule || dir->timer.ttl == 0 ? rule_ttl : dir->timer.ttl;
+    if (ttl != 0) {
+        new_item->timer.ttl = ttl;
+        // the directory at the rule path keeps living but passes the ttl on
+        if (!at_rule || type != FS_DIR)
+            fs_ttl_arm(new_item, new_item->st.st_mtime + ttl);
+    }
+
+    *buf = new_item;
+    return 0;
+}
+
+/**
+ * Create an item in the directory by name instead of path, for filling the
+ * tree from images and archives. If the name is taken, -EEXIST is returned
+ * with the existing item in buf. Needs at least the fs read lock
+ */
+int fs_add_child(fs_item* dir, const char* name, size_t len, mode_t mode, fs_item** buf) {
+    int ret = add_child(dir, name, len, mode, NULL, buf);
+    if (ret == 0)
+        fs_journal_add(FS_JOURNAL_CREATE, *buf);
+    return ret;
+}
+
+/**
+ * Remove the item to put another one in its place, like tar x does when it
+ * extracts a name again. Directories have to be empty. Needs the fs write
+ * lock
+ */
+int fs_remove_child(fs_item* item) {
+    if (item->parent == NULL)
+        return -EPERM;
     if (fs_item_is_dir(item)) {
-        free_fs_dir(&fs_item_dir(item));
-    } else {
-        free_fs_file(&fs_item_file(item));
+        int ret = lower_fill(item);
+        if (ret != 0)
+            return ret;
+        if (fs_dirmap_size(&fs_item_dir(item).items) != 0)
+            return -ENOTEMPTY;
     }
+
+    notify_removed(item);
+    remove_item(item);
+    return 0;
+}
+
+static int add_child(fs_item* dir, const char* name, size_t len, mode_t mode, const struct stat* lower_st, fs_item** buf) {
+    if (!fs_item_is_dir(dir))
+        return -ENOTDIR;
+    if (len == 0 || (len <= 2 && strncmp(name, "..", len) == 0) || memchr(name, '/', len) != NULL)
+        return -EINVAL;
+    if (len > FILE_NAME_MAX)
+        return -ENAMETOOLONG;
+
+    uint32_t hash = fs_dirmap_hash(name, len);
+    if (fs_dirmap_get(&fs_item_dir(dir).items, name, len, hash, buf))
+        return -EEXIST;
+
+    char path[PATH_LEN_MAX + 1];
+    int path_len = fs_item_path(dir, path);
+    if (path_len < 0)
+        return path_len;
+    // the root is just "/"
+    if (path_len == 1)
+        path_len = 0;
+    if (path_len + 1 + len > PATH_LEN_MAX)
+        return -ENAMETOOLONG;
+    path[path_len] = '/';
+    memcpy(&path[path_len + 1], name, len);
+    path[path_len + 1 + len] = '\0';
+
+    return attach_item(dir, name, len, hash, S_ISDIR(mode) ? FS_DIR : FS_FILE, mode, path, lower_st, buf);
 }
 
 /**
- * Split file path into indexes and set the indexes to the buffer.
- * path string is modified as a side effect
- * return the amount of indexes found.
- * Will return 0 on root dir "/", >= on any other path
- *
- * Usage:
- *
- * char path_copy[PATH_LEN_MAX];
- * strcpy(path_copy, path);
- * int idx_buff[256];
- * int files = split_file_path(path_copy, idx_buff);
- * for (int ii = 0; ii < files; ii++) {
- *     printf("splitted: %s\n", &path_copy[idx_buff[ii]]);
- * }
- */
-static int split_file_path(char* path, int* idx_buff) {
-    int idx_count = 1;
-    size_t idx = 0;
-    size_t path_len = strlen(path);
-
-    // If checking root
-    if (path_len == 1 && path[0] == '/') {
-        return 0;
+ * Detach the item from its parent. The item is freed in the background once
+ * it's not open anymore
+ */
+static void remove_item(fs_item* item) {
+    fs_journal_add(FS_JOURNAL_REMOVE, item);
+    fs_flush_remove(item);
+    // lookups that already got into the directory would still see its items
+    bool detach_tree = fs_item_is_dir(item) && fs_dirmap_size(&fs_item_dir(item).items) != 0;
+    if (detach_tree) {
+        tree_write_begin();
+        __atomic_store_n(&tree_gen, tree_gen + 1, __ATOMIC_RELAXED);
     }
 
-    if (path[0] == '/') {
-        idx = 1;
-        idx_buff[0] = 1;
-    } else {
-        idx_buff[0] = 0;
+    fs_ttl_disarm(item);
+    // TODO: can we just assume that this always works?
+    fs_dirmap_del(&fs_item_dir(item->parent).items, item);
+    touch_item(item->parent);
+    __atomic_store_n(&item->parent, NULL, __ATOMIC_RELAXED);
+    // after the parent so a reader that sees the old gen sees it attached
+    if (fs_item_is_dir(item))
+        __atomic_store_n(&item->gen, item->gen + 1, __ATOMIC_RELEASE);
+    if (detach_tree)
+        tree_write_end();
+    fs_item_unref(item);
+}
+
+/**
+ * Path of the item from the root into buf of PATH_LEN_MAX + 1 bytes.
+ * Returns the length or -ENAMETOOLONG.
+ */
+int fs_item_path(const fs_item* item, char* buf) {
+    // walking up gives the names from the end
+    size_t pos = PATH_LEN_MAX;
+    buf[pos] = '\0';
+    for (; item->parent != NULL; item = item->parent) {
+        if (pos < item->name_len + 1u)
+            return -ENAMETOOLONG;
+        pos -= item->name_len;
+        memcpy(&buf[pos], item->name, item->name_len);
+        buf[--pos] = '/';
     }
+    if (pos == PATH_LEN_MAX)
+        buf[--pos] = '/';
+
+    memmove(buf, &buf[pos], PATH_LEN_MAX + 1 - pos);
+    return PATH_LEN_MAX - pos;
+}
+
+/**
+ * Tell the kernel about an item that is removed without it asking, so it
+ * doesn't keep serving the item from its cache. Called before the removal
+ */
+static void notify_removed(const fs_item* item) {
+    char path[PATH_LEN_MAX + 1];
+    if (fs_item_path(item, path) >= 0)
+        fs_notify_inval(path);
+}
+
+/**
+ * Check that the item is still part of the tree and not waiting for the
+ * reclaimer as part of a removed directory.
+ */
+static bool is_attached(const fs_item* item) {
+    while (item->parent != NULL)
+        item = item->parent;
+    return item == &root_dir;
+}
+
+/**
+ * Record the change of an item in the journal unless it was removed while
+ * open
+ */
+static void journal_change(uint32_t op, const fs_item* item) {
+    if (fs_journal_enabled() && is_attached(item))
+        fs_journal_add(op, item);
+}
+
+/**
+ * Update the modification and status change times to now. Creates only
+ * hold the fs read lock so this can run for a directory in many threads at
+ * once.
+ */
+static void touch_item(fs_item* item) {
+    time_t now = time(NULL);
+    // the other creates in the directory already did it for us
+    if (__atomic_load_n(&item->st.st_mtime, __ATOMIC_RELAXED) == now
+        && __atomic_load_n(&item->st.st_ctime, __ATOMIC_RELAXED) == now)
+        return;
+
+    item_write_lock(item);
+    __atomic_store_n(&item->st.st_mtime, now, __ATOMIC_RELAXED);
+    __atomic_store_n(&item->st.st_ctime, now, __ATOMIC_RELAXED);
+    item_write_end(item);
+}
+
+/**
+ * Seqcount for the lock-free readers. Writers hold the fs write lock and
+ * wrap changes to the stat and file data in item_write_begin/end. Readers
+ * retry if the item was modified while they were reading it.
+ */
+static void item_write_begin(fs_item* item) {
+    __atomic_store_n(&item->seq, item->seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+/**
+ * item_write_begin for writers that only hold the fs read lock. Waits for
+ * the other writers of the item to finish.
+ */
+static void item_write_lock(fs_item* item) {
+    uint32_t seq;
+    do {
+        while ((seq = __atomic_load_n(&item->seq, __ATOMIC_RELAXED)) & 1)
+            sched_yield();
+    } while (!__atomic_compare_exchange_n(&item->seq, &seq, seq + 1, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED));
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
 
-    for (; idx < path_len; idx++) {
-        if (path[idx] == '/') {
-            // Set the splitting point
-            path[idx] = '\0';
-            // The start of next path is the next char after null
-            idx_buff[idx_count++] = idx + 1;
+static void item_write_end(fs_item* item) {
+    __atomic_store_n(&item->seq, item->seq + 1, __ATOMIC_RELEASE);
+}
+
+static uint32_t item_read_begin(const fs_item* item) {
+    uint32_t seq;
+    while ((seq = __atomic_load_n(&item->seq, __ATOMIC_ACQUIRE)) & 1)
+        sched_yield();
+    return seq;
+}
+
+static bool item_read_retry(const fs_item* item, uint32_t seq) {
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&item->seq, __ATOMIC_RELAXED) != seq;
+}
+
+static void tree_write_begin() {
+    __atomic_store_n(&tree_seq, tree_seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void tree_write_end() {
+    __atomic_store_n(&tree_seq, tree_seq + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * fs_get_item without the fs lock. Every step is validated by the directory
+ * map and the whole walk by the tree seq so readers never write to
+ * shared memory. Returns -EAGAIN on a conflict with a writer.
+ */
+static int get_item_rcu(const path_string* p_string, fs_item** buf) {
+    uint32_t seq = __atomic_load_n(&tree_seq, __ATOMIC_ACQUIRE);
+    if (seq & 1)
+        return -EAGAIN;
+
+    // read before anything is found so directories freed after this can't
+    // end up in the thread's cache
+    uint32_t gen = __atomic_load_n(&tree_gen, __ATOMIC_RELAXED);
+    fs_dircache_entry entry = { .flush_gen = fs_dircache_generation(), .tree_gen = gen };
+    int ret = 0;
+    int start = 0;
+    int parent_idx = p_string->files - 2;
+    fs_item* found = &root_dir;
+    fs_item* parent = NULL;
+    fs_dircache_entry cached;
+    if (fs_dircache_get(p_string, &cached) && cached.tree_gen == gen
+        && __atomic_load_n(&cached.dir->gen, __ATOMIC_ACQUIRE) == cached.gen) {
+        found = cached.dir;
+        start = parent_idx + 1;
+    }
+
+    for (int ii = start; ii < p_string->files && ret == 0; ii++) {
+        const path_component* comp = &p_string->comps[ii];
+        // type of an item never changes so this needs no validation
+        if (!fs_item_is_dir(found)) {
+            ret = -ENOTDIR;
+        } else {
+            const fs_dir* dir = &fs_item_dir(found);
+            ret = fs_dirmap_get_rcu(&dir->items, ps_name(p_string, ii), comp->len, comp->hash, &found) ? 0 : -ENOENT;
+            // the items of a --lower directory are read in under the lock
+            uint32_t lower = __atomic_load_n(&dir->lower, __ATOMIC_ACQUIRE);
+            if (ret == -ENOENT && (lower == FS_LOWER_PENDING || lower == FS_LOWER_LOADING))
+                ret = -EAGAIN;
+        }
+        if (ret == 0 && ii == parent_idx) {
+            entry.gen = __atomic_load_n(&found->gen, __ATOMIC_ACQUIRE);
+            if (__atomic_load_n(&found->parent, __ATOMIC_RELAXED) != NULL)
+                parent = found;
         }
     }
 
-    return idx_count;
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&tree_seq, __ATOMIC_RELAXED) != seq || ret == -EAGAIN)
+        return -EAGAIN;
+
+    if (ret == 0 && parent != NULL) {
+        entry.dir = parent;
+        fs_dircache_put(p_string, &entry);
+    }
+    if (ret == 0)
+        *buf = found;
+    return ret;
 }
 
-static int add_item(const path_string* p_string, FS_ITEM_TYPE type, mode_t mode) {
-    fs_item* cdir;
-    int ret = fs_get_dir_item(p_string, &cdir, 1);
+/**
+ * Check that the item is at the path by walking its parents back to the
+ * root. Only compares the names so it's a lot cheaper than a lookup.
+ */
+static bool item_at_path(const fs_item* item, const path_string* p_string) {
+    for (int ii = p_string->files - 1; ii >= 0; ii--) {
+        size_t len = p_string->comps[ii].len;
+        if (item == NULL || item->name_len != len
+            || strncmp(item->name, ps_name(p_string, ii), len) != 0 || item->name[len] != '\0')
+            return false;
+        item = __atomic_load_n(&item->parent, __ATOMIC_RELAXED);
+    }
+
+    return item == &root_dir;
+}
+
+/**
+ * Lock-free version of a lookup cache hit. Renaming the item or any of its
+ * parents is caught by the seqs.
+ */
+static bool cached_item_rcu(const fs_item* item, const path_string* p_string) {
+    uint32_t seq = __atomic_load_n(&tree_seq, __ATOMIC_ACQUIRE);
+    uint32_t item_seq = __atomic_load_n(&item->seq, __ATOMIC_ACQUIRE);
+    if ((seq | item_seq) & 1)
+        return false;
+
+    bool found = item_at_path(item, p_string);
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return found
+        && __atomic_load_n(&tree_seq, __ATOMIC_RELAXED) == seq
+        && __atomic_load_n(&item->seq, __ATOMIC_RELAXED) == item_seq;
+}
+
+/**
+ * Find the item without taking the fs lock if possible. Has to be called
+ * inside an epoch, the item stays valid until the epoch is left.
+ */
+int fs_lookup(const path_string* p_string, fs_item** buf) {
+    bool cacheable = p_string->files > 1;
+    fs_item* cached;
+    if (cacheable && fs_dcache_get(p_string->hash, &cached) && cached_item_rcu(cached, p_string)) {
+        *buf = cached;
+        return 0;
+    }
+
+    int ret = get_item_rcu(p_string, buf);
+    if (ret == 0 && cacheable)
+        fs_dcache_put(p_string->hash, *buf);
+    if (ret != -EAGAIN)
+        return ret;
+
+    // there was a writer in the way, wait for it
+    fs_rdlock();
+    ret = fs_get_item(p_string, buf, 0);
+    fs_unlock();
+    return ret;
+}
+
+/**
+ * Stat of the item in the path. Has to be called inside an epoch
+ */
+int fs_stat(const path_string* p_string, struct stat* buf) {
+    fs_item* item;
+    int ret = fs_lookup(p_string, &item);
     if (ret != 0)
         return ret;
 
-    const char* last_file = ps_last_file(p_string);
-    fs_item* new_item = malloc(sizeof(fs_item));
-    init_fs_item(new_item, last_file, cdir, type, mode);
-    sc_map_put_sv(&fs_item_dir(cdir).items, new_item->name, (void*)new_item);
+    fs_item_stat(item, buf);
     return 0;
 }
 
+/**
+ * Consistent copy of the item's stat while it might be modified
+ */
+void fs_item_stat(const fs_item* item, struct stat* buf) {
+    uint32_t seq;
+    do {
+        seq = item_read_begin(item);
+        memcpy(buf, &item->st, sizeof(struct stat));
+    } while (item_read_retry(item, seq));
+}
+
+/**
+ * Split the path into components in a single pass over it. The names are
+ * hashed right after their end is found so the lookups don't need to touch
+ * the path again. "/" has no components.
+ */
 int parse_path_string(path_string* p_string, const char* path) {
-    // fuse take care of length of the path so we don't need to check it here
     p_string->path = path;
-    strcpy(p_string->path_copy, path);
-    p_string->files = split_file_path(p_string->path_copy, p_string->idx_buff);
-    if (strlen(ps_last_file(p_string)) > FILE_NAME_MAX)
-        return -ENAMETOOLONG;
+    p_string->hash = 0;
+    p_string->files = 0;
+    if (path[0] == '/' && path[1] == '\0')
+        return 0;
 
-    return 0;
+    size_t start = path[0] == '/' ? 1 : 0;
+    while (true) {
+        size_t end = find_separator(path, start);
+        size_t len = end - start;
+        if (len > FILE_NAME_MAX || end > PATH_LEN_MAX || p_string->files == PATH_COMPONENTS_MAX)
+            return -ENAMETOOLONG;
+
+        path_component* comp = &p_string->comps[p_string->files++];
+        comp->offset = start;
+        comp->len = len;
+        comp->hash = fs_dirmap_hash(&path[start], len);
+        p_string->hash = (p_string->hash ^ comp->hash) * 0x9e3779b1u;
+        if (path[end] == '\0')
+            return 0;
+        start = end + 1;
+    }
 }
 
 int fs_dir_delete(const path_string* p_string) {
     fs_item* item;
     int ret = fs_get_dir_item(p_string, &item, 0);
+    if (ret == 0)
+        ret = lower_fill(item);
     if (ret != 0) {
         return ret;
     }
 
-    if (fs_item_dir(item).items.size != 0) {
+    if (fs_dirmap_size(&fs_item_dir(item).items) != 0) {
         return -ENOTEMPTY;
     }
 
-    // TODO: can we just assume that this always works?
-    sc_map_del_sv(&fs_item_dir(item->parent).items, item->name);
-    free_fs_item(item);
-    free(item);
+    remove_item(item);
     return 0;
 }
 
@@ -212,29 +643,92 @@ int fs_get_item(const path_string* p_string, fs_item** buf, int offset) {
         offset = 0;
     }
 
-    fs_dir* cdir = &fs_item_dir(&root_dir);
+    // a stale entry can point to an item that was removed before we took
+    // the lock and is being freed. Once it's found at the path it's in the
+    // tree and stays there while we hold the lock
+    bool cacheable = offset == 0 && p_string->files > 1;
+    fs_item* cached;
+    fs_epoch_enter();
+    bool hit = cacheable && fs_dcache_get(p_string->hash, &cached) && item_at_path(cached, p_string);
+    fs_epoch_exit();
+    if (hit) {
+        if (buf != NULL)
+            *buf = cached;
+        return 0;
+    }
+
     fs_item* found = &root_dir;
+    fs_item* parent = NULL;
     int loop_count = p_string->files - offset;
-    for (int ii = 0; ii < loop_count; ii++) {
-        const char* p = ps_file(p_string, ii);
-        fs_item* next = sc_map_get_sv(&cdir->items, p);
-        if (!sc_map_found(&cdir->items)) {
-            return -ENOENT;
-        } else if (ii < loop_count - 1 && !fs_item_is_dir(next)) {
+    // only the walks that go through the directory of the last component
+    // can use the thread's cache
+    int parent_idx = offset <= 1 ? p_string->files - 2 : -1;
+    int start = 0;
+    if (parent_idx >= 0 && cached_parent(p_string, &found))
+        start = parent_idx + 1;
+
+    for (int ii = start; ii < loop_count; ii++) {
+        const path_component* comp = &p_string->comps[ii];
+        fs_item* next;
+        // lookups run in parallel under the read lock
+        if (!fs_dirmap_get(&fs_item_dir(found).items, ps_name(p_string, ii), comp->len, comp->hash, &next)) {
+            int ret = lower_fill(found);
+            if (ret != 0)
+                return ret;
+            if (!fs_dirmap_get(&fs_item_dir(found).items, ps_name(p_string, ii), comp->len, comp->hash, &next))
+                return -ENOENT;
+        }
+
+        if (ii < loop_count - 1 && !fs_item_is_dir(next)) {
             // Files one before the lastone always need to be directories
             return -ENOTDIR;
         }
 
-        cdir = &fs_item_dir(next);
+        if (ii == parent_idx)
+            parent = next;
         found = next;
     }
 
+    if (parent != NULL && fs_item_is_dir(parent))
+        cache_parent(p_string, parent);
+    if (cacheable)
+        fs_dcache_put(p_string->hash, found);
     if (buf != NULL)
         *buf = found;
 
     return 0;
 }
 
+/**
+ * Directory of the last component from the thread's cache. Caller holds the
+ * fs lock so only removals that happened before need to be checked.
+ */
+static bool cached_parent(const path_string* p_string, fs_item** buf) {
+    fs_dircache_entry entry;
+    bool found = false;
+    // a stale entry can point to a directory that is being freed
+    fs_epoch_enter();
+    if (fs_dircache_get(p_string, &entry) && entry.tree_gen == tree_gen && entry.dir->gen == entry.gen) {
+        *buf = entry.dir;
+        found = true;
+    }
+    fs_epoch_exit();
+    return found;
+}
+
+/**
+ * Remember the directory of the last component. Caller holds the fs lock
+ */
+static void cache_parent(const path_string* p_string, fs_item* dir) {
+    fs_dircache_entry entry = {
+        .dir = dir,
+        .tree_gen = tree_gen,
+        .gen = dir->gen,
+        .flush_gen = fs_dircache_generation(),
+    };
+    fs_dircache_put(p_string, &entry);
+}
+
 /**
  * Get fs_item that is always a directory type.
  */
@@ -303,14 +797,51 @@ int fs_get_file(const path_string* p_string, fs_file** buf) {
     return 0;
 }
 
+void fs_rdlock() {
+    pthread_rwlock_rdlock(&fs_lock);
+}
+
+void fs_wrlock() {
+    pthread_rwlock_wrlock(&fs_lock);
+}
+
+void fs_unlock() {
+    pthread_rwlock_unlock(&fs_lock);
+}
+
 void init_fs() {
+    init_fs_epoch();
+    init_fs_dircache();
     init_fs_fh();
-    init_fs_item(&root_dir, "/", NULL, FS_DIR, DEF_DIR_MODE);
+    init_fs_reclaim();
+    init_fs_notify();
+    init_fs_item(&root_dir, "/", 1, NULL, FS_DIR, DEF_DIR_MODE);
+    if (fs_lower_enabled())
+        fs_item_dir(&root_dir).lower = FS_LOWER_PENDING;
+    bool at_rule;
+    root_dir.timer.ttl = fs_ttl_rule("/", &at_rule);
+    init_fs_ttl();
+    init_fs_lower();
+    init_fs_flush();
+    init_fs_journal();
 }
 
 void free_fs() {
+    // the flusher still reads the tree
+    free_fs_flush();
+    free_fs_lower();
+    free_fs_ttl();
+    free_fs_notify();
     free_fs_fh();
-    free_fs_item(&root_dir);
+    // nothing changes the tree anymore
+    free_fs_journal();
+    // the whole tree is freed by the reclaimers in parallel
+    fs_wrlock();
+    fs_reclaim_children(&root_dir);
+    fs_unlock();
+    free_fs_reclaim();
+    free_fs_dircache();
+    free_fs_epoch();
 }
 
 int fs_file_read(path_string* p_string, char* buffer, size_t size, off_t offset) {
@@ -349,9 +880,11 @@ int fs_file_write(path_string* p_string, const char* buffer, size_t size, off_t
     off_t new_size = size;
     if (file->data == NULL) {
         file->data = malloc(size);
+        file->cap = size;
     } else if (offset + (off_t)size > file_size) {
         new_size = offset + size;
         file->data = realloc(file->data, new_size);
+        file->cap = new_size;
     }
 
     fs_item_size(file) = new_size;
@@ -392,10 +925,7 @@ int fs_file_delete(const path_string* p_string) {
         return ret;
     }
 
-    // TODO: can we just assume that this always works?
-    sc_map_del_sv(&fs_item_dir(file->parent).items, file->name);
-    free_fs_item(file);
-    free(file);
+    remove_item(file);
     return 0;
 }
 
@@ -418,8 +948,8 @@ int fs_file_delete(const path_string* p_string) {
  * If oldpath refers to a symbolic link, the link is renamed; if newpath refers to a symbolic link, the link will be overwritten.
  */
 int fs_rename(const path_string* oldpath, const path_string* newpath) {
-    // we cannot move the root file
-    if (oldpath->files == 0) {
+    // we cannot move the root file or replace it
+    if (oldpath->files == 0 || newpath->files == 0) {
         return -EPERM;
     }
 
@@ -439,51 +969,68 @@ int fs_rename(const path_string* oldpath, const path_string* newpath) {
 
     fs_dir* new_parent = &fs_item_dir(new_parent_item);
 
-    bool new_found = false;
-    fs_item* new_item = sc_map_get_sv(&new_parent->items, ps_last_file(newpath));
-    if (sc_map_found(&new_parent->items)) {
-        new_found = true;
-    }
-
-    fs_dir* new_dir = &fs_item_dir(new_item);
-    fs_file* new_file = &fs_item_file(new_item);
-    bool is_new_dir = new_found && fs_item_is_dir(new_item);
-
-    // if the new path doesn't exist, we can just move the old path to it
-    if (!new_found) {
-        sc_map_del_sv(&old_parent->items, old_item->name);
-        size_t nlen = strlen(ps_last_file(newpath));
-        old_item->name_len = nlen;
-        old_item->parent = new_parent_item;
-        strcpy((char*)old_item->name, ps_last_file(newpath));
-        sc_map_put_sv(&new_parent->items, old_item->name, old_item);
-    } else { // new is found
+    // the lower directory has the items under the old path
+    ret = lower_detach(old_item);
+    if (ret != 0)
+        return ret;
+
+    const path_component* new_name = ps_last(newpath);
+    fs_item* new_item;
+    bool replace = fs_dirmap_get(&new_parent->items, &newpath->path[new_name->offset], new_name->len, new_name->hash, &new_item);
+    if (replace) {
+        // renaming the item to itself is a no-op
+        if (new_item == old_item)
+            return 0;
+
         if (is_old_dir) {
             // cannot overwrite non-directory with directory
-            if (!is_new_dir)
+            if (!fs_item_is_dir(new_item))
                 return -EPERM;
             // We cannot override non-empty dirs
-            if (new_dir->items.size != 0)
+            ret = lower_fill(new_item);
+            if (ret != 0)
+                return ret;
+            if (fs_dirmap_size(&fs_item_dir(new_item).items) != 0)
                 return -ENOTEMPTY;
-
-            old_item->parent = new_parent_item;
-            sc_map_del_sv(&old_parent->items, old_item->name);
-            sc_map_put_sv(&new_dir->items, new_item->name, old_item);
-            free_fs_dir(new_dir);
-            free(new_dir);
-        } else { // old is file
-            old_item->parent = new_parent_item;
-            sc_map_del_sv(&old_parent->items, old_item->name);
-            if (is_new_dir) { // move the old file to new directory
-                sc_map_put_sv(&new_dir->items, old_item->name, old_item);
-            } else { // new is also a file so we override it
-                sc_map_put_sv(&new_parent->items, old_item->name, old_item);
-                free_fs_file(new_file);
-                free(new_file);
-            }
+        } else if (fs_item_is_dir(new_item)) {
+            // cannot overwrite directory with non-directory
+            return -EISDIR;
         }
     }
 
+    // lookups without the lock would miss the item while it's in neither
+    // directory, and the ones that are already inside a moved directory
+    // would find its items from the old path. The replaced item is a file
+    // or an empty directory so removing it doesn't take the seq again.
+    // Only moving a directory changes the paths the threads have cached
+    tree_write_begin();
+    if (is_old_dir)
+        __atomic_store_n(&tree_gen, tree_gen + 1, __ATOMIC_RELAXED);
+    if (replace)
+        remove_item(new_item);
+
+    fs_journal_add(FS_JOURNAL_RENAME_FROM, old_item);
+
+    fs_item* old_parent_item = old_item->parent;
+    // cached lookups compare the name of the item itself
+    item_write_begin(old_item);
+    if (is_old_dir)
+        __atomic_store_n(&old_item->gen, old_item->gen + 1, __ATOMIC_RELEASE);
+
+    fs_dirmap_del(&old_parent->items, old_item);
+    old_item->name_len = new_name->len;
+    old_item->parent = new_parent_item;
+    memcpy((char*)old_item->name, &newpath->path[new_name->offset], new_name->len);
+    ((char*)old_item->name)[new_name->len] = '\0';
+    fs_dirmap_put(&new_parent->items, old_item, new_name->hash);
+
+    item_write_end(old_item);
+    tree_write_end();
+
+    touch_item(old_parent_item);
+    touch_item(new_parent_item);
+    fs_journal_add(FS_JOURNAL_RENAME_TO, old_item);
+    fs_flush_rename(oldpath->path, newpath->path);
     return 0;
 }
 
@@ -558,8 +1105,11 @@ int fs_mkdir(const path_string* path, mode_t mode) {
 
 static int _fs_chown(fs_item* item, uid_t uid, gid_t gid) {
     // TODO: make sure that the user can actually set the perms
+    item_write_begin(item);
     item->st.st_uid = uid;
     item->st.st_gid = gid;
+    item_write_end(item);
+    journal_change(FS_JOURNAL_ATTR, item);
     return 0;
 }
 
@@ -585,7 +1135,10 @@ int fs_chown(const path_string* path, uid_t uid, gid_t gid) {
 
 static int _fs_chmod(fs_item* item, mode_t mode) {
     // TODO: make sure mode is valid
+    item_write_begin(item);
     item->st.st_mode = mode;
+    item_write_end(item);
+    journal_change(FS_JOURNAL_ATTR, item);
     return 0;
 }
 
@@ -608,6 +1161,42 @@ int fs_chmod(const path_string* path, mode_t mode) {
     return _fs_chmod(item, mode);
 }
 
+static int _fs_utimens(fs_item* item, const struct timespec tv[2]) {
+    time_t now = time(NULL);
+    item_write_begin(item);
+    if (tv[0].tv_nsec != UTIME_OMIT)
+        item->st.st_atime = tv[0].tv_nsec == UTIME_NOW ? now : tv[0].tv_sec;
+    if (tv[1].tv_nsec != UTIME_OMIT)
+        __atomic_store_n(&item->st.st_mtime, tv[1].tv_nsec == UTIME_NOW ? now : tv[1].tv_sec, __ATOMIC_RELAXED);
+    __atomic_store_n(&item->st.st_ctime, now, __ATOMIC_RELAXED);
+    item_write_end(item);
+    journal_change(FS_JOURNAL_ATTR, item);
+    return 0;
+}
+
+/**
+ * Set the access and modification times, UTIME_NOW and UTIME_OMIT work
+ * like in utimensat. With the writeback cache the kernel keeps the mtime
+ * of written files and sends it here when it flushes them
+ */
+int fs_futimens(file_handle fh, const struct timespec tv[2]) {
+    fs_item* item;
+    int ret = fs_fh_get_item(fh, &item);
+    if (ret != 0)
+        return ret;
+
+    return _fs_utimens(item, tv);
+}
+
+int fs_utimens(const path_string* path, const struct timespec tv[2]) {
+    fs_item* item;
+    int ret = fs_get_item(path, &item, 0);
+    if (ret != 0)
+        return ret;
+
+    return _fs_utimens(item, tv);
+}
+
 int fs_access(const path_string* path, mode_t mode, fs_item** buf) {
     // TODO: check that the mode is valid
     // TODO use S_IRUSR etc macros
@@ -631,6 +1220,76 @@ int fs_access(const path_string* path, mode_t mode, fs_item** buf) {
     return 0;
 }
 
+/**
+ * Give the file a memfd on its first write. Returns false if the file
+ * keeps its data in a buffer, because memfds are not used, the file
+ * already has one or there are no fds left
+ */
+static bool memfd_open(fs_file* file) {
+    if (file->fd >= 0)
+        return true;
+    if (!fs_memfd_enabled() || file->data != NULL)
+        return false;
+
+    int fd = fs_memfd_create();
+    if (fd < 0)
+        return false;
+
+    item_write_begin(file->item);
+    __atomic_store_n(&file->fd, fd, __ATOMIC_RELAXED);
+    item_write_end(file->item);
+    return true;
+}
+
+/**
+ * fs_write for files kept in a memfd. The memfd fills holes itself
+ */
+static int memfd_write(fs_file* file, const char* buffer, size_t size, off_t offset) {
+    ssize_t written = pwrite(file->fd, buffer, size, offset);
+    if (written < 0)
+        return -errno;
+
+    if (offset + written > fs_item_size(file)) {
+        item_write_begin(file->item);
+        __atomic_store_n(&fs_item_size(file), offset + written, __ATOMIC_RELAXED);
+        item_write_end(file->item);
+    }
+    touch_item(file->item);
+    return written;
+}
+
+/**
+ * _fs_truncate for files kept in a memfd
+ */
+static int memfd_truncate(fs_file* file, off_t size) {
+    if (ftruncate(file->fd, size) != 0)
+        return -errno;
+
+    item_write_begin(file->item);
+    __atomic_store_n(&fs_item_size(file), size, __ATOMIC_RELAXED);
+    item_write_end(file->item);
+    touch_item(file->item);
+    return 0;
+}
+
+/**
+ * New buffer of at least size bytes with the file data copied into it.
+ * Readers might be copying the old data without the lock so it can't be
+ * realloc'd. Grows geometrically so appends stay O(1) amortized
+ */
+static uint8_t* copy_data(const fs_file* file, size_t size, size_t* cap) {
+    size_t new_cap = file->cap * 2 > size ? file->cap * 2 : size;
+    uint8_t* data = malloc(new_cap);
+    if (data == NULL)
+        return NULL;
+
+    off_t file_size = fs_item_size(file);
+    if (file_size != 0)
+        memcpy(data, file->data, file_size);
+    *cap = new_cap;
+    return data;
+}
+
 int fs_write(file_handle fh, const char* buffer, size_t size, off_t offset) {
     fs_file* file;
     int ret = fs_fh_get_file(fh, &file);
@@ -638,27 +1297,102 @@ int fs_write(file_handle fh, const char* buffer, size_t size, off_t offset) {
         return ret;
     }
 
+    ret = file_write(file, buffer, size, offset);
+    if (ret > 0)
+        journal_change(FS_JOURNAL_WRITE, file->item);
+    // writes to files that were unlinked while open aren't written behind
+    if (ret > 0 && fs_flush_enabled() && is_attached(file->item))
+        fs_flush_write(file, offset, ret);
+    return ret;
+}
+
+/**
+ * fs_write for an item that isn't open, like when filling the tree from
+ * an image. Needs the fs write lock
+ */
+int fs_item_write(fs_item* item, const char* buffer, size_t size, off_t offset) {
+    if (!fs_item_is_file(item))
+        return -EISDIR;
+
+    return file_write(&fs_item_file(item), buffer, size, offset);
+}
+
+/**
+ * Hand a buffer of size bytes from malloc over to a file that was just
+ * added, as its data. Saves copying archives in. Needs the fs lock
+ */
+void fs_file_adopt(fs_file* file, uint8_t* data, size_t size) {
+    item_write_lock(file->item);
+    __atomic_store_n(&file->data, data, __ATOMIC_RELAXED);
+    file->cap = size;
+    __atomic_store_n(&fs_item_size(file), size, __ATOMIC_RELAXED);
+    item_write_end(file->item);
+}
+
+static int file_write(fs_file* file, const char* buffer, size_t size, off_t offset) {
+    // the changed data can't be dropped anymore
+    int ret = lower_keep(file);
+    if (ret != 0)
+        return ret;
+
     off_t file_size = fs_item_size(file);
 
-    // if offset is not part of the file, the file will end up containing garbage
     // TODO: what does offset < 0 officially mean?
-    if (offset < 0 || file_size < offset) {
+    if (offset < 0) {
         return -ESPIPE;
+    } else if (size == 0) {
+        return 0;
+    } else if (memfd_open(file)) {
+        return memfd_write(file, buffer, size, offset);
     }
 
-    off_t new_size = size;
-    if (file->data == NULL) {
-        file->data = malloc(size);
-    } else if (offset + (off_t)size > file_size) {
-        new_size = offset + size;
-        file->data = realloc(file->data, new_size);
+    // writes past the end leave a hole of zeros like on other file systems.
+    // with the writeback cache the kernel can also flush pages in any order
+    off_t hole = offset > file_size ? offset - file_size : 0;
+    off_t new_size = offset + (off_t)size > file_size ? offset + (off_t)size : file_size;
+    uint8_t* old_data = NULL;
+    if ((size_t)new_size > file->cap) {
+        size_t new_cap;
+        uint8_t* data = copy_data(file, new_size, &new_cap);
+        if (data == NULL)
+            return -ENOMEM;
+        memset(data + file_size, 0, hole);
+        memcpy(data + offset, buffer, size);
+
+        item_write_begin(file->item);
+        old_data = file->data;
+        __atomic_store_n(&file->data, data, __ATOMIC_RELAXED);
+        file->cap = new_cap;
+    } else {
+        item_write_begin(file->item);
+        memset(file->data + file_size, 0, hole);
+        memcpy(file->data + offset, buffer, size);
     }
 
-    fs_item_size(file) = new_size;
-    memcpy(file->data + offset, buffer, size);
+    __atomic_store_n(&fs_item_size(file), new_size, __ATOMIC_RELAXED);
+    item_write_end(file->item);
+    fs_epoch_free(old_data);
+    touch_item(file->item);
     return size;
 }
 
+/**
+ * Stat of an open item. Doesn't need the fs lock
+ */
+int fs_fstat(file_handle fh, struct stat* buf) {
+    fs_item* item;
+    int ret = fs_fh_get_item(fh, &item);
+    if (ret != 0)
+        return ret;
+
+    fs_item_stat(item, buf);
+    return 0;
+}
+
+/**
+ * Doesn't need the fs lock but has to be called inside an epoch since
+ * writers can replace the data at any time.
+ */
 int fs_read(file_handle fh, char* buffer, size_t size, off_t offset) {
     fs_file* file;
     int ret = fs_fh_get_file(fh, &file);
@@ -666,18 +1400,107 @@ int fs_read(file_handle fh, char* buffer, size_t size, off_t offset) {
         return ret;
     }
 
-    uint64_t file_size = fs_item_size(file);
-    if (file->data == NULL && file_size == 0) {
-        return 0;
-    } else if (size > file_size - offset) {
-        size = file_size - offset;
+    // open files are never dropped so this is only done on the first read
+    uint32_t lower = __atomic_load_n(&file->lower, __ATOMIC_ACQUIRE);
+    if (lower == FS_LOWER_PENDING || lower == FS_LOWER_LOADING) {
+        fs_rdlock();
+        ret = lower_load(file);
+        fs_unlock();
+        if (ret != 0)
+            return ret;
     }
 
-    memcpy(buffer, file->data + offset, size);
-    return size;
+    return file_read(file, buffer, size, offset);
+}
+
+/**
+ * fs_read for an item that isn't open. Needs the fs lock
+ */
+int fs_item_read(fs_item* item, char* buffer, size_t size, off_t offset) {
+    if (!fs_item_is_file(item))
+        return -EISDIR;
+
+    int ret = lower_load(&fs_item_file(item));
+    if (ret != 0)
+        return ret;
+
+    return file_read(&fs_item_file(item), buffer, size, offset);
+}
+
+/**
+ * Writes change the data in place while holding the item seq, so the copy
+ * is retried if one got in between
+ */
+static int file_read(const fs_file* file, char* buffer, size_t size, off_t offset) {
+    uint8_t* data;
+    int fd;
+    off_t file_size;
+    size_t len;
+    uint32_t seq;
+    do {
+        seq = item_read_begin(file->item);
+        data = __atomic_load_n(&file->data, __ATOMIC_RELAXED);
+        fd = __atomic_load_n(&file->fd, __ATOMIC_RELAXED);
+        file_size = __atomic_load_n(&fs_item_size(file), __ATOMIC_RELAXED);
+        if (offset < 0 || offset >= file_size) {
+            len = 0;
+        } else {
+            len = (off_t)size > file_size - offset ? (size_t)(file_size - offset) : size;
+        }
+        // memfds are read like any other file, fuse reads them directly too
+        if (fd < 0 && len != 0)
+            memcpy(buffer, data + offset, len);
+    } while (item_read_retry(file->item, seq));
+
+    if (fd >= 0 && len != 0) {
+        ssize_t ret = pread(fd, buffer, len, offset);
+        return ret < 0 ? -errno : ret;
+    }
+    return len;
+}
+
+/**
+ * Data of the file for writing it out without copying, valid until the
+ * epoch is left. NULL if the data is in a memfd or wasn't read in from
+ * --lower. Writes can change the data in place, so what was written out
+ * is only consistent if fs_file_data_retry with seq is false after it.
+ * Has to be called inside an epoch
+ */
+const uint8_t* fs_file_data(const fs_file* file, off_t* size, uint32_t* seq) {
+    const uint8_t* data;
+    int fd;
+    do {
+        *seq = item_read_begin(file->item);
+        data = __atomic_load_n(&file->data, __ATOMIC_RELAXED);
+        fd = __atomic_load_n(&file->fd, __ATOMIC_RELAXED);
+        *size = __atomic_load_n(&fs_item_size(file), __ATOMIC_RELAXED);
+    } while (item_read_retry(file->item, *seq));
+
+    return fd >= 0 ? NULL : data;
+}
+
+bool fs_file_data_retry(const fs_file* file, uint32_t seq) {
+    return item_read_retry(file->item, seq);
+}
+
+/**
+ * memfd holding the data of an open file or -1 if it has none. Fuse can
+ * read the data from it directly, see fs_memfd.c
+ */
+int fs_read_fd(file_handle fh, int* buf) {
+    fs_file* file;
+    int ret = fs_fh_get_file(fh, &file);
+    if (ret != 0)
+        return ret;
+
+    *buf = __atomic_load_n(&file->fd, __ATOMIC_RELAXED);
+    return 0;
 }
 
 static int _fs_truncate(fs_file* file, off_t size) {
+    int ret = lower_keep(file);
+    if (ret != 0)
+        return ret;
 
     off_t file_size = fs_item_size(file);
 
@@ -687,17 +1510,50 @@ static int _fs_truncate(fs_file* file, off_t size) {
         if (file_size < size * -1)
             return -ESPIPE;
 
-        fs_item_size(file) = file_size + size;
-    } else if (file_size < size) {
-        return -ESPIPE;
+        size = file_size + size;
+    }
+
+    if (memfd_open(file))
+        return memfd_truncate(file, size);
+
+    // growing the file fills it with zeros
+    uint8_t* old_data = NULL;
+    if ((size_t)size > file->cap) {
+        size_t new_cap;
+        uint8_t* data = copy_data(file, size, &new_cap);
+        if (data == NULL)
+            return -ENOMEM;
+        memset(data + file_size, 0, size - file_size);
+
+        item_write_begin(file->item);
+        old_data = file->data;
+        __atomic_store_n(&file->data, data, __ATOMIC_RELAXED);
+        file->cap = new_cap;
     } else {
-        // else we set the size to size
-        fs_item_size(file) = size;
+        item_write_begin(file->item);
+        if (size > file_size)
+            memset(file->data + file_size, 0, size - file_size);
     }
 
+    __atomic_store_n(&fs_item_size(file), size, __ATOMIC_RELAXED);
+    item_write_end(file->item);
+    fs_epoch_free(old_data);
+    touch_item(file->item);
     return 0;
 }
 
+/**
+ * _fs_truncate that writes the new size behind
+ */
+static int truncate_file(fs_file* file, off_t size) {
+    int ret = _fs_truncate(file, size);
+    if (ret == 0)
+        journal_change(FS_JOURNAL_WRITE, file->item);
+    if (ret == 0 && fs_flush_enabled() && is_attached(file->item))
+        fs_flush_truncate(file, fs_item_size(file));
+    return ret;
+}
+
 int fs_truncate(const path_string* path, off_t size) {
     fs_file* file;
     int ret = fs_get_file(path, &file);
@@ -705,7 +1561,7 @@ int fs_truncate(const path_string* path, off_t size) {
         return ret;
     }
 
-    return _fs_truncate(file, size);
+    return truncate_file(file, size);
 }
 
 int fs_ftruncate(file_handle fh, off_t size) {
@@ -715,5 +1571,340 @@ int fs_ftruncate(file_handle fh, off_t size) {
         return ret;
     }
 
-    return _fs_truncate(file, size);
+    return truncate_file(file, size);
+}
+
+/**
+ * Remove the item and everything under it from the directory.
+ * The subtree is detached at once and freed by the reclaimer.
+ */
+int fs_rmtree(file_handle fh, const char* name) {
+    fs_dir* dir;
+    int ret = fs_fh_get_dir(fh, &dir);
+    if (ret != 0)
+        return ret;
+
+    // name comes straight from the ioctl buffer so it might not be terminated
+    if (memchr(name, '\0', FILE_NAME_MAX + 1) == NULL)
+        return -ENAMETOOLONG;
+
+    if (name[0] == '\0' || strchr(name, '/') != NULL
+        || strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+        return -EINVAL;
+
+    fs_item* item;
+    size_t len = strlen(name);
+    if (!fs_dirmap_get(&dir->items, name, len, fs_dirmap_hash(name, len), &item))
+        return -ENOENT;
+
+    notify_removed(item);
+    remove_item(item);
+    return 0;
+}
+
+/**
+ * Preallocate the directory for count items. The directory won't be shrunk
+ * below that either.
+ */
+int fs_reserve(file_handle fh, uint32_t count) {
+    fs_dir* dir;
+    int ret = fs_fh_get_dir(fh, &dir);
+    if (ret != 0)
+        return ret;
+
+    if (count > FS_IOC_RESERVE_MAX)
+        return -EINVAL;
+
+    return fs_dirmap_reserve(&dir->items, count) ? 0 : -ENOMEM;
+}
+
+int fs_set_ttl(file_handle fh, uint32_t ttl) {
+    fs_item* item;
+    int ret = fs_fh_get_item(fh, &item);
+    if (ret != 0)
+        return ret;
+
+    set_ttl(item, ttl);
+    return 0;
+}
+
+static void set_ttl(fs_item* item, uint32_t ttl) {
+    item->timer.ttl = ttl;
+    // removed items that are still open are never armed again
+    if (!is_attached(item))
+        return;
+    // directories only expire if they got the ttl from their parent
+    if (fs_item_is_dir(item) && !fs_ttl_armed(item))
+        return;
+
+    if (ttl == 0) {
+        fs_ttl_disarm(item);
+    } else {
+        fs_ttl_arm(item, item->st.st_mtime + ttl);
+    }
+}
+
+/**
+ * Set the mode, owner, times and ttl of the item from a saved copy. The
+ * ttl is counted from the restored mtime. Needs the fs lock
+ */
+void fs_item_restore(fs_item* item, const struct stat* st, uint32_t ttl) {
+    item_write_lock(item);
+    // the type was set when the item was added
+    item->st.st_mode = (item->st.st_mode & S_IFMT) | (st->st_mode & ~S_IFMT);
+    item->st.st_uid = st->st_uid;
+    item->st.st_gid = st->st_gid;
+    item->st.st_atime = st->st_atime;
+    __atomic_store_n(&item->st.st_mtime, st->st_mtime, __ATOMIC_RELAXED);
+    __atomic_store_n(&item->st.st_ctime, st->st_ctime, __ATOMIC_RELAXED);
+    item_write_end(item);
+    set_ttl(item, ttl);
+}
+
+int fs_get_ttl(file_handle fh, uint32_t* ttl) {
+    fs_item* item;
+    int ret = fs_fh_get_item(fh, &item);
+    if (ret != 0)
+        return ret;
+
+    *ttl = item->timer.ttl;
+    return 0;
+}
+
+/**
+ * Called by the timer wheel when the item's timer is due.
+ * Items are checked against their modification time so writes don't need to
+ * touch the wheel. Modified items and directories that still have items are
+ * just armed again.
+ */
+void fs_expire_item(fs_item* item, time_t now) {
+    if (item->timer.ttl == 0 || !is_attached(item))
+        return;
+
+    time_t deadline = item->st.st_mtime + item->timer.ttl;
+    if (deadline > now) {
+        fs_ttl_arm(item, deadline);
+    } else if (fs_item_is_dir(item) && fs_dirmap_size(&fs_item_dir(item).items) != 0) {
+        fs_ttl_arm(item, now + item->timer.ttl);
+    } else {
+        notify_removed(item);
+        remove_item(item);
+    }
+}
+
+/**
+ * Take the metadata of an item read in from the lower directory before it's
+ * added. The data of files and the items of directories are read in when
+ * they are needed
+ */
+static void lower_attach(fs_item* item, const struct stat* st) {
+    item->st.st_mode = st->st_mode;
+    item->st.st_uid = st->st_uid;
+    item->st.st_gid = st->st_gid;
+    item->st.st_atime = st->st_atime;
+    item->st.st_mtime = st->st_mtime;
+    item->st.st_ctime = st->st_ctime;
+    if (fs_item_is_dir(item)) {
+        fs_item_dir(item).lower = FS_LOWER_PENDING;
+    } else if (st->st_size != 0) {
+        item->st.st_size = st->st_size;
+        fs_item_file(item).lower = FS_LOWER_PENDING;
+    }
+}
+
+/**
+ * Wait for the thread reading the item in and return the state it left
+ */
+static uint32_t lower_wait(const uint32_t* state) {
+    uint32_t value;
+    while ((value = __atomic_load_n(state, __ATOMIC_ACQUIRE)) == FS_LOWER_LOADING)
+        sched_yield();
+    return value;
+}
+
+/**
+ * Take the item for reading it in. False if it's already read in or only
+ * in memory
+ */
+static bool lower_begin(uint32_t* state) {
+    uint32_t expected = FS_LOWER_PENDING;
+    while (!__atomic_compare_exchange_n(state, &expected, FS_LOWER_LOADING, false, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) {
+        // try again if the other thread failed
+        if (expected != FS_LOWER_LOADING || (expected = lower_wait(state)) != FS_LOWER_PENDING)
+            return false;
+    }
+    return true;
+}
+
+/**
+ * Read in the items of a directory from the lower directory, on the first
+ * lookup that misses in it or before it's listed. Items created in it
+ * before that are kept. Needs the fs lock
+ */
+static int lower_fill(fs_item* dir) {
+    uint32_t* state = &fs_item_dir(dir).lower;
+    if (!lower_begin(state))
+        return 0;
+
+    char path[PATH_LEN_MAX + 1];
+    int ret = fs_item_path(dir, path);
+    int fd = ret < 0 ? ret : fs_lower_open(path, O_RDONLY | O_DIRECTORY);
+    // removed from the lower directory after it was read in
+    if (fd == -ENOENT || fd == -ENOTDIR) {
+        __atomic_store_n(state, FS_LOWER_LOADED, __ATOMIC_RELEASE);
+        return 0;
+    }
+    DIR* stream = fd < 0 ? NULL : fdopendir(fd);
+    if (stream == NULL) {
+        ret = fd < 0 ? fd : -errno;
+        if (fd >= 0)
+            close(fd);
+        __atomic_store_n(state, FS_LOWER_PENDING, __ATOMIC_RELEASE);
+        return ret;
+    }
+
+    // adding the items touches the directory
+    struct stat dir_st;
+    fs_item_stat(dir, &dir_st);
+    struct dirent* entry;
+    while (ret >= 0 && (entry = readdir(stream)) != NULL) {
+        struct stat st;
+        fs_item* item;
+        // the fs only has directories and regular files
+        if (fstatat(dirfd(stream), entry->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0
+            || !(S_ISDIR(st.st_mode) || S_ISREG(st.st_mode)))
+            continue;
+
+        ret = add_child(dir, entry->d_name, strlen(entry->d_name), st.st_mode, &st, &item);
+        // names that are taken or that the fs doesn't allow are skipped
+        if (ret != -ENOMEM)
+            ret = 0;
+    }
+    closedir(stream);
+
+    item_write_lock(dir);
+    __atomic_store_n(&dir->st.st_mtime, dir_st.st_mtime, __ATOMIC_RELAXED);
+    __atomic_store_n(&dir->st.st_ctime, dir_st.st_ctime, __ATOMIC_RELAXED);
+    item_write_end(dir);
+    __atomic_store_n(state, ret == 0 ? FS_LOWER_LOADED : FS_LOWER_PENDING, __ATOMIC_RELEASE);
+    return ret;
+}
+
+/**
+ * Read in the items of a directory of --lower before it's listed. Needs the
+ * fs lock
+ */
+int fs_dir_fill(fs_dir* dir) {
+    return lower_fill(dir->item);
+}
+
+/**
+ * Read the data of a file in from the lower directory. The threads reading
+ * the same file wait for the one reading it in. Needs the fs lock
+ */
+static int lower_load(fs_file* file) {
+    if (!lower_begin(&file->lower))
+        return 0;
+
+    char buf[PATH_LEN_MAX + 1];
+    const char* path = file->lower_path;
+    int ret = 0;
+    if (path == NULL) {
+        ret = fs_item_path(file->item, buf);
+        path = buf;
+    }
+    int fd = ret < 0 ? ret : fs_lower_open(path, O_RDONLY);
+    size_t size = fs_item_size(file);
+    uint8_t* data = fd < 0 ? NULL : malloc(size);
+    // the file is cut to what is left of it if it got shorter on disk
+    size_t done = 0;
+    ssize_t got = 1;
+    while (data != NULL && done < size && (got = pread(fd, data + done, size - done, done)) > 0)
+        done += got;
+    ret = fd < 0 ? fd : data == NULL ? -ENOMEM : got < 0 ? -errno : 0;
+    if (fd >= 0)
+        close(fd);
+    if (ret != 0) {
+        free(data);
+        __atomic_store_n(&file->lower, FS_LOWER_PENDING, __ATOMIC_RELEASE);
+        return ret;
+    }
+
+    item_write_lock(file->item);
+    __atomic_store_n(&file->data, data, __ATOMIC_RELAXED);
+    file->cap = size;
+    __atomic_store_n(&fs_item_size(file), done, __ATOMIC_RELAXED);
+    item_write_end(file->item);
+    fs_lower_loaded(file);
+    return 0;
+}
+
+/**
+ * Read in the data of the file and keep it in memory from now on, before
+ * it's changed. Needs the fs write lock
+ */
+static int lower_keep(fs_file* file) {
+    if (file->lower == FS_LOWER_NONE)
+        return 0;
+
+    int ret = lower_load(file);
+    if (ret == 0) {
+        fs_lower_forget(file);
+        free(file->lower_path);
+        file->lower_path = NULL;
+    }
+    return ret;
+}
+
+/**
+ * Read in the items of the directories under the item before it's moved
+ * away from its path in the lower directory. The files under it keep the
+ * path of their data instead, so it's read in when needed and can still be
+ * dropped. Needs the fs write lock
+ */
+static int lower_detach(fs_item* item) {
+    if (fs_item_is_file(item)) {
+        fs_file* file = &fs_item_file(item);
+        if (file->lower == FS_LOWER_NONE || file->lower_path != NULL)
+            return 0;
+
+        char path[PATH_LEN_MAX + 1];
+        int ret = fs_item_path(item, path);
+        if (ret < 0)
+            return ret;
+        file->lower_path = strdup(path);
+        return file->lower_path == NULL ? -ENOMEM : 0;
+    }
+
+    fs_dir* dir = &fs_item_dir(item);
+    if (dir->lower == FS_LOWER_NONE)
+        return 0;
+
+    int ret = lower_fill(item);
+    fs_item* child;
+    fs_foreach_val(&dir->items, child) {
+        if (ret == 0)
+            ret = lower_detach(child);
+    }
+    if (ret == 0)
+        __atomic_store_n(&dir->lower, FS_LOWER_NONE, __ATOMIC_RELEASE);
+    return ret;
+}
+
+/**
+ * Drop the data of a file read in from the lower directory, it's read in
+ * again when it's needed. Open files are kept. Needs the fs write lock
+ */
+bool fs_file_drop(fs_file* file) {
+    if (__atomic_load_n(&file->item->refs, __ATOMIC_RELAXED) != 1 || !is_attached(file->item))
+        return false;
+
+    item_write_begin(file->item);
+    uint8_t* data = file->data;
+    __atomic_store_n(&file->data, NULL, __ATOMIC_RELAXED);
+    file->cap = 0;
+    item_write_end(file->item);
+    __atomic_store_n(&file->lower, FS_LOWER_PENDING, __ATOMIC_RELEASE);
+    fs_epoch_free(data);
+    return true;
 }
@@ -4,8 +4,9 @@
 #include <sys/stat.h>
 #include <sys/statvfs.h>
 #include <sys/types.h>
+#include <time.h>
 
-#include "sc_map.h"
+#include "fs_dirmap.h"
 #include "util.h"
 
 // 4096 is a good cache friendly size
@@ -16,19 +17,58 @@ typedef enum FS_ITEM_TYPE {
     FS_FILE
 } FS_ITEM_TYPE;
 
+// items read in from the --lower directory, see fs_lower.c
+typedef enum FS_LOWER_STATE {
+    // only in memory or changed after it was read in
+    FS_LOWER_NONE,
+    // the items or the file data are still only in the lower directory
+    FS_LOWER_PENDING,
+    FS_LOWER_LOADING,
+    // same as in the lower directory, file data can be dropped again
+    FS_LOWER_LOADED
+} FS_LOWER_STATE;
+
 struct fs_item;
+struct fs_flush_op;
 
 typedef struct fs_dir {
     struct fs_item* item;
-    struct sc_map_sv items;
+    fs_dirmap items;
+    // FS_LOWER_STATE of the items
+    uint32_t lower;
 } fs_dir;
 
 typedef struct fs_file {
     struct fs_item* item;
     // Data length can be found from item's stat struct (st_size)
     uint8_t* data;
+    // allocated size of data
+    size_t cap;
+    // memfd holding the data instead, -1 if not used. see fs_memfd.c
+    int fd;
+    // FS_LOWER_STATE of the data
+    uint32_t lower;
+    // path of the data in the lower directory once the file was moved away
+    // from it, NULL while it's at the path of the file
+    char* lower_path;
+    // neighbours in the list of loaded files that can be dropped
+    struct fs_file* lower_prev;
+    struct fs_file* lower_next;
+    // write waiting for the flusher that later writes are merged into, see
+    // fs_flush.c
+    struct fs_flush_op* flush;
 } fs_file;
 
+typedef struct fs_timer {
+    // neighbours in the timer wheel slot, null if the timer is not armed
+    struct fs_timer* next;
+    struct fs_timer* prev;
+    time_t deadline;
+    // lifetime in seconds since the last modification, 0 if not set.
+    // directories pass their ttl on to the items created in them
+    uint32_t ttl;
+} fs_timer;
+
 #if FILE_NAME_MAX > 255
 #error "fs_item name_len only supports values that fit into uint8_t "
 #endif
@@ -36,31 +76,51 @@ typedef struct fs_file {
 typedef struct fs_item {
     const char name[FILE_NAME_MAX + 1];
     uint8_t name_len;
-    // null if root dir
+    // null if root dir or the item is removed
     // will always point to a fs_dir item
     struct fs_item* parent;
     // TODO: stat and replace type with it
     struct stat st;
+    // odd while st or the file data is being modified, see item_read_begin
+    uint32_t seq;
+    // one from the parent and one for each open file handle.
+    // the item is reclaimed when the last one is dropped
+    uint32_t refs;
+    // slot in the lookup cache, see fs_dcache.c
+    uint32_t dcache_slot;
+    // bumped when a directory is moved or removed, see fs_dircache.c
+    uint32_t gen;
+    fs_timer timer;
     union {
         fs_dir dir;
         fs_file file;
     } as;
 } fs_item;
 
+// deeper paths are rejected with -ENAMETOOLONG
+#define PATH_COMPONENTS_MAX 256
+
+typedef struct path_component {
+    // start of the name in the path, the name is not terminated
+    uint16_t offset;
+    uint8_t len;
+    // fs_dirmap_hash of the name
+    uint32_t hash;
+} path_component;
+
 typedef struct path_string {
     // pointer to the original from fuse funtions
     const char* path;
-
-    // copy of the path containting the divided paths
-    char path_copy[PATH_LEN_MAX + 1];
-    // indexes of the paths
-    // TODO: collect the length of paths so we do faster map lookups
-    //       this requires some changes in sc_map
-    int idx_buff[256];
-    // count of the indexes, if 0. this is the root file
+    // hash of the whole path for the lookup cache
+    uint32_t hash;
+    // count of the components, if 0. this is the root file
     int files;
+    path_component comps[PATH_COMPONENTS_MAX];
 } path_string;
 
+#define ps_name(_pstring, _idx) (&(_pstring)->path[(_pstring)->comps[_idx].offset])
+#define ps_last(_pstring) (&(_pstring)->comps[(_pstring)->files - 1])
+
 #define fs_item_dir(_item) (_item)->as.dir
 #define fs_item_file(_item) (_item)->as.file
 // size of the union items
@@ -81,6 +141,8 @@ int parse_path_string(path_string* p_string, const char* path) __nonnull((1, 2))
 
 int fs_get_file(const path_string* p_string, fs_file** buf) __nonnull((1));
 int fs_get_item(const path_string* p_string, fs_item** buf, int offset) __nonnull((1));
+int fs_lookup(const path_string* p_string, fs_item** buf) __nonnull((1, 2));
+int fs_stat(const path_string* p_string, struct stat* buf) __nonnull((1, 2));
 int fs_get_directory(const path_string* p_string, fs_dir** buf, int offset) __nonnull((1));
 int fs_dir_delete(const path_string* p_string) __nonnull((1));
 int fs_file_read(path_string* p_string, char* buffer, size_t size, off_t offset) __attribute__((deprecated("Use fs_read()")));
@@ -95,18 +157,43 @@ int fs_chown(const path_string* path, uid_t uid, gid_t gid) __nonnull((1));
 int fs_fchown(file_handle fh, uid_t uid, gid_t gid) __nonzero((1));
 int fs_chmod(const path_string* path, mode_t mode) __nonnull((1));
 int fs_fchmod(file_handle fh, mode_t mode) __nonzero((1));
+int fs_utimens(const path_string* path, const struct timespec tv[2]) __nonnull((1, 2));
+int fs_futimens(file_handle fh, const struct timespec tv[2]) __nonzero((1)) __nonnull((2));
 int fs_access(const path_string* path, mode_t mode, fs_item** buf) __nonnull((1));
+int fs_fstat(file_handle fh, struct stat* buf) __nonzero((1)) __nonnull((2));
+int fs_read_fd(file_handle fh, int* buf) __nonzero((1)) __nonnull((2));
 int fs_read(file_handle fh, char* buffer, size_t size, off_t offset) __nonzero((1)) __nonnull((2));
 int fs_write(file_handle fh, const char* buffer, size_t size, off_t offset) __nonzero((1)) __nonnull((2));
 int fs_truncate(const path_string* p_string, off_t size) __nonnull((1));
 int fs_ftruncate(file_handle fh, off_t size) __nonzero((1));
+int fs_rmtree(file_handle fh, const char* name) __nonzero((1)) __nonnull((2));
+int fs_reserve(file_handle fh, uint32_t count) __nonzero((1));
+int fs_set_ttl(file_handle fh, uint32_t ttl) __nonzero((1));
+int fs_get_ttl(file_handle fh, uint32_t* ttl) __nonzero((1)) __nonnull((2));
+void fs_expire_item(fs_item* item, time_t now) __nonnull((1));
+void fs_item_stat(const fs_item* item, struct stat* buf) __nonnull((1, 2));
+int fs_item_path(const fs_item* item, char* buf) __nonnull((1, 2));
+int fs_item_read(fs_item* item, char* buffer, size_t size, off_t offset) __nonnull((1, 2));
+int fs_item_write(fs_item* item, const char* buffer, size_t size, off_t offset) __nonnull((1, 2));
+void fs_item_restore(fs_item* item, const struct stat* st, uint32_t ttl) __nonnull((1, 2));
+int fs_add_child(fs_item* dir, const char* name, size_t len, mode_t mode, fs_item** buf) __nonnull((1, 2, 5));
+int fs_remove_child(fs_item* item) __nonnull((1));
+void fs_file_adopt(fs_file* file, uint8_t* data, size_t size) __nonnull((1));
+const uint8_t* fs_file_data(const fs_file* file, off_t* size, uint32_t* seq) __nonnull((1, 2, 3));
+bool fs_file_data_retry(const fs_file* file, uint32_t seq) __nonnull((1));
+int fs_dir_fill(fs_dir* dir) __nonnull((1));
+bool fs_file_drop(fs_file* file) __nonnull((1));
 bool fs_item_is_dir(const fs_item* item) __nonnull((1));
 bool fs_item_is_file(const fs_item* item) __nonnull((1));
+void fs_rdlock();
+void fs_wrlock();
+void fs_unlock();
 void init_fs();
 void free_fs();
 
-#define fs_foreach(dir_file, key, value) sc_map_foreach(dir_file, key, value)
-#define fs_foreach_key(dir_file, key) sc_map_foreach_key(dir_file, key)
-#define fs_foreach_val(dir_file, val) sc_map_foreach_value(dir_file, val)
+// the fs write lock is needed for these, see fs_dirmap_foreach
+#define fs_foreach(dir_file, key, value) \
+    fs_dirmap_foreach(dir_file, value) for (int __k = ((key) = (value)->name, 1); __k; __k = 0)
+#define fs_foreach_val(dir_file, val) fs_dirmap_foreach(dir_file, val)
 
 #endif
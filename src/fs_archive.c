@@ -0,0 +1,1020 @@
+#include "util.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "fs_archive.h"
+#include "fs_epoch.h"
+#include "fs_flush.h"
+#include "fs_notify.h"
+#include "fs_reclaim.h"
+
+/**
+ * Tar archives of subtrees.
+ *
+ * Imports are decoded by the calling thread while worker threads build the
+ * tree from what was decoded so far. The entries are handed to the workers
+ * by the first name of their path, so each top level subtree is built by
+ * one worker in archive order while the different subtrees are built in
+ * parallel. File data is read straight into a buffer that the file then
+ * takes over.
+ *
+ * ustar, GNU long names and the path, size, mtime, uid and gid of pax
+ * headers are understood. The tree only has files and directories so
+ * other entries are skipped. Missing parent directories are created.
+ *
+ * The workers hold the fs read lock for a batch of entries at a time. Like
+ * with tar x, an entry replaces a file or an empty directory that already
+ * has its name, whether it came from earlier in the archive or was there
+ * before. That needs the write lock, so the worker takes it for the entry.
+ * Directories are merged. The kernel is told about the changed names of
+ * the directory once the import is done. With write-behind, the new items
+ * are queued for the directory on disk like the ones created through the
+ * kernel.
+ *
+ * Exports write a GNU archive of a directory straight from the tree. Each
+ * directory is listed under the fs lock at once, its items are written out
+ * after that without it. Files written into regular files go out with one
+ * writev from the file data inside an epoch, and are written again if they
+ * changed meanwhile. Into pipes and sockets that can block for long the
+ * data is copied out in pieces under the lock first.
+ */
+
+#define TAR_BLOCK 512
+// the prefix field only holds a path in POSIX archives
+#define USTAR_MAGIC "ustar"
+// magic and version of GNU archives, which have long names
+#define GNU_MAGIC "ustar  "
+#define GNU_LONG_NAME "././@LongLink"
+// pax headers with more than this are rejected
+#define PAX_MAX (1 << 20)
+#define IMPORT_READ_BUF (1 << 20)
+// entries handed to a worker at once
+#define IMPORT_BATCH 256
+// decoded data waiting for the workers before the reader waits
+#define IMPORT_QUEUE_MAX ((size_t)64 << 20)
+#define IMPORT_WORKERS_MAX 16
+// file data copied out at once
+#define EXPORT_CHUNK (1 << 20)
+// a long name entry, the name and the header of the item
+#define EXPORT_HEADERS_MAX (3 * TAR_BLOCK + PATH_LEN_MAX + 1)
+
+typedef struct tar_header {
+    char name[100];
+    char mode[8];
+    char uid[8];
+    char gid[8];
+    char size[12];
+    char mtime[12];
+    char chksum[8];
+    char typeflag;
+    char linkname[100];
+    char magic[6];
+    char version[2];
+    char uname[32];
+    char gname[32];
+    char devmajor[8];
+    char devminor[8];
+    char prefix[155];
+    char pad[12];
+} tar_header;
+
+typedef struct archive_reader {
+    int fd;
+    char* buf;
+    size_t pos;
+    size_t len;
+} archive_reader;
+
+// values from pax and GNU headers for the entry that follows them
+typedef struct pax_values {
+    char path[PATH_LEN_MAX + 1];
+    bool has_path;
+    bool has_size;
+    bool has_mtime;
+    bool has_uid;
+    bool has_gid;
+    uint64_t size;
+    uint64_t mtime;
+    uint64_t uid;
+    uint64_t gid;
+} pax_values;
+
+typedef struct import_entry {
+    struct import_entry* next;
+    struct stat st;
+    // file data, taken over by the file
+    uint8_t* data;
+    // below the directory imported into, without empty or . names
+    char path[];
+} import_entry;
+
+// directory from the archive whose times are set once everything is built
+typedef struct import_dir {
+    fs_item* item;
+    struct stat st;
+} import_dir;
+
+struct importer;
+
+typedef struct import_worker {
+    struct importer* imp;
+    pthread_t thread;
+    pthread_cond_t cond;
+    import_entry* head;
+    import_entry* tail;
+    // batch the reader is filling
+    import_entry* batch_head;
+    import_entry* batch_tail;
+    size_t batch_count;
+    size_t batch_bytes;
+    // last parent directory, valid while the fs lock is held
+    fs_item* dir;
+    size_t dir_len;
+    char dir_path[PATH_LEN_MAX + 1];
+    import_dir* dirs;
+    size_t dir_count;
+    size_t dir_cap;
+    uint64_t items;
+} import_worker;
+
+typedef struct export_entry {
+    fs_item* item;
+    struct stat st;
+    // in the names of the directory listing
+    size_t name_offset;
+    size_t name_len;
+} export_entry;
+
+typedef struct exporter {
+    int fd;
+    // the output doesn't block, so file data can be written from the tree
+    bool direct;
+    uint64_t items;
+    char* chunk;
+    char headers[EXPORT_HEADERS_MAX];
+} exporter;
+
+typedef struct importer {
+    fs_item* root;
+    pthread_mutex_t lock;
+    // the reader waits on this while too much is queued
+    pthread_cond_t space_cond;
+    size_t queued_bytes;
+    bool done;
+    int error;
+    size_t worker_count;
+    import_worker workers[IMPORT_WORKERS_MAX];
+} importer;
+
+/**
+ * Read len bytes of the archive into dst, or skip them if dst is NULL.
+ * A short archive is -EINVAL
+ */
+static int read_archive(archive_reader* r, void* dst, size_t len) {
+    char* out = dst;
+    while (len > 0) {
+        if (r->pos == r->len) {
+            // big files are read straight into their buffer
+            bool direct = out != NULL && len >= IMPORT_READ_BUF;
+            ssize_t got = read(r->fd, direct ? out : r->buf, direct ? len : IMPORT_READ_BUF);
+            if (got < 0 && errno == EINTR)
+                continue;
+            if (got <= 0)
+                return got == 0 ? -EINVAL : -errno;
+            if (direct) {
+                out += got;
+                len -= got;
+                continue;
+            }
+            r->pos = 0;
+            r->len = got;
+        }
+
+        size_t chunk = len < r->len - r->pos ? len : r->len - r->pos;
+        if (out != NULL) {
+            memcpy(out, &r->buf[r->pos], chunk);
+            out += chunk;
+        }
+        r->pos += chunk;
+        len -= chunk;
+    }
+    return 0;
+}
+
+static size_t tar_padding(uint64_t size) {
+    return (TAR_BLOCK - size % TAR_BLOCK) % TAR_BLOCK;
+}
+
+/**
+ * Octal number of a header field, or base-256 for numbers that don't fit
+ * the digits
+ */
+static bool parse_number(const char* field, size_t len, uint64_t* buf) {
+    uint64_t val = 0;
+    if ((unsigned char)field[0] == 0x80) {
+        for (size_t ii = 1; ii < len; ii++) {
+            if (val >> 56)
+                return false;
+            val = val << 8 | (unsigned char)field[ii];
+        }
+        *buf = val;
+        return true;
+    }
+
+    size_t pos = 0;
+    while (pos < len && field[pos] == ' ')
+        pos++;
+    for (; pos < len && field[pos] >= '0' && field[pos] <= '7'; pos++) {
+        if (val >> 61)
+            return false;
+        val = val * 8 + (field[pos] - '0');
+    }
+    if (pos < len && field[pos] != ' ' && field[pos] != '\0')
+        return false;
+    *buf = val;
+    return true;
+}
+
+static bool check_header(const tar_header* header) {
+    uint64_t expected;
+    if (!parse_number(header->chksum, sizeof(header->chksum), &expected))
+        return false;
+
+    // the checksum is counted with its own field as spaces
+    const unsigned char* bytes = (const unsigned char*)header;
+    uint64_t sum = ' ' * sizeof(header->chksum);
+    for (size_t ii = 0; ii < TAR_BLOCK; ii++) {
+        if (ii < offsetof(tar_header, chksum) || ii >= offsetof(tar_header, typeflag))
+            sum += bytes[ii];
+    }
+    return sum == expected;
+}
+
+static bool is_end(const tar_header* header) {
+    const char* bytes = (const char*)header;
+    for (size_t ii = 0; ii < TAR_BLOCK; ii++) {
+        if (bytes[ii] != '\0')
+            return false;
+    }
+    return true;
+}
+
+/**
+ * Pax records are "<length> <key>=<value>\n"
+ */
+static void parse_pax(char* records, size_t len, pax_values* pax) {
+    for (size_t pos = 0; pos < len;) {
+        char* end;
+        unsigned long rec_len = strtoul(&records[pos], &end, 10);
+        if (rec_len == 0 || rec_len > len - pos || *end != ' ' || end >= &records[pos + rec_len - 1]
+            || records[pos + rec_len - 1] != '\n')
+            return;
+
+        char* key = end + 1;
+        char* value = memchr(key, '=', &records[pos + rec_len - 1] - key);
+        pos += rec_len;
+        if (value == NULL)
+            continue;
+        *value++ = '\0';
+        records[pos - 1] = '\0';
+
+        if (strcmp(key, "path") == 0 && strlen(value) <= PATH_LEN_MAX) {
+            strcpy(pax->path, value);
+            pax->has_path = true;
+        } else if (strcmp(key, "size") == 0) {
+            pax->size = strtoull(value, NULL, 10);
+            pax->has_size = true;
+        } else if (strcmp(key, "mtime") == 0) {
+            // fractions of a second are dropped
+            pax->mtime = strtoull(value, NULL, 10);
+            pax->has_mtime = true;
+        } else if (strcmp(key, "uid") == 0) {
+            pax->uid = strtoull(value, NULL, 10);
+            pax->has_uid = true;
+        } else if (strcmp(key, "gid") == 0) {
+            pax->gid = strtoull(value, NULL, 10);
+            pax->has_gid = true;
+        }
+    }
+}
+
+/**
+ * Path of the entry from the header or the pax and GNU headers before it,
+ * without empty and . names. Returns the length, 0 for the directory
+ * itself or -EINVAL for paths leaving it
+ */
+static int entry_path(const tar_header* header, const pax_values* pax, char* buf) {
+    char raw[PATH_LEN_MAX + 1];
+    if (pax->has_path) {
+        strcpy(raw, pax->path);
+    } else {
+        int len = 0;
+        if (memcmp(header->magic, USTAR_MAGIC, sizeof(USTAR_MAGIC)) == 0 && header->prefix[0] != '\0')
+            len = snprintf(raw, sizeof(raw), "%.*s/", (int)strnlen(header->prefix, sizeof(header->prefix)), header->prefix);
+        snprintf(&raw[len], sizeof(raw) - len, "%.*s", (int)strnlen(header->name, sizeof(header->name)), header->name);
+    }
+
+    size_t len = 0;
+    char* save;
+    for (char* name = strtok_r(raw, "/", &save); name != NULL; name = strtok_r(NULL, "/", &save)) {
+        if (strcmp(name, ".") == 0)
+            continue;
+        if (strcmp(name, "..") == 0 || strlen(name) > FILE_NAME_MAX)
+            return -EINVAL;
+        if (len != 0)
+            buf[len++] = '/';
+        strcpy(&buf[len], name);
+        len += strlen(name);
+    }
+    buf[len] = '\0';
+    return len;
+}
+
+/**
+ * Queue the new item for write-behind, files with all of their data
+ */
+static void flush_item(fs_item* item) {
+    char path[PATH_LEN_MAX + 1];
+    if (!fs_flush_enabled() || fs_item_path(item, path) < 0)
+        return;
+    fs_flush_create(path, item->st.st_mode);
+    if (!fs_item_is_dir(item))
+        fs_flush_write(&fs_item_file(item), 0, item->st.st_size);
+}
+
+/**
+ * Parent directory of the entry, created with its parents if missing
+ */
+static int find_dir(import_worker* w, const char* path, size_t len, fs_item** buf) {
+    if (w->dir != NULL && len == w->dir_len && memcmp(path, w->dir_path, len) == 0) {
+        *buf = w->dir;
+        return 0;
+    }
+
+    fs_item* dir = w->imp->root;
+    for (size_t pos = 0; pos < len;) {
+        size_t end = pos;
+        while (end < len && path[end] != '/')
+            end++;
+
+        fs_item* child;
+        int ret = fs_dir_fill(&fs_item_dir(dir));
+        if (ret == 0)
+            ret = fs_add_child(dir, &path[pos], end - pos, S_IFDIR | 0755, &child);
+        if (ret == 0) {
+            w->items++;
+            flush_item(child);
+        } else if (ret == -EEXIST) {
+            ret = fs_item_is_dir(child) ? 0 : -ENOTDIR;
+        }
+        if (ret != 0)
+            return ret;
+        dir = child;
+        pos = end + 1;
+    }
+
+    w->dir = dir;
+    w->dir_len = len;
+    memcpy(w->dir_path, path, len);
+    *buf = dir;
+    return 0;
+}
+
+static int add_dir(import_worker* w, fs_item* item, const struct stat* st) {
+    if (w->dir_count == w->dir_cap) {
+        size_t cap = w->dir_cap == 0 ? 64 : w->dir_cap * 2;
+        import_dir* dirs = realloc(w->dirs, cap * sizeof(import_dir));
+        if (dirs == NULL)
+            return -ENOMEM;
+        w->dirs = dirs;
+        w->dir_cap = cap;
+    }
+
+    // held until the times are set in case it's removed before that
+    fs_item_ref(item);
+    w->dirs[w->dir_count].item = item;
+    w->dirs[w->dir_count].st = *st;
+    w->dir_count++;
+    return 0;
+}
+
+/**
+ * Create the item of the entry. Returns -EAGAIN if an item has to be
+ * replaced and exclusive, holding the write lock, isn't set
+ */
+static int build_entry(import_worker* w, import_entry* entry, bool exclusive) {
+    fs_item* dir = w->imp->root;
+    const char* name = strrchr(entry->path, '/');
+    int ret = 0;
+    if (name == NULL) {
+        name = entry->path;
+    } else {
+        ret = find_dir(w, entry->path, name - entry->path, &dir);
+        name++;
+    }
+    if (ret == 0)
+        ret = fs_dir_fill(&fs_item_dir(dir));
+
+    fs_item* item;
+    if (ret == 0)
+        ret = fs_add_child(dir, name, strlen(name), entry->st.st_mode, &item);
+    if (ret == -EEXIST && S_ISDIR(entry->st.st_mode) && fs_item_is_dir(item))
+        return add_dir(w, item, &entry->st);
+    if (ret == -EEXIST && !exclusive)
+        return -EAGAIN;
+    if (ret == -EEXIST) {
+        ret = fs_remove_child(item);
+        if (ret == 0)
+            ret = fs_add_child(dir, name, strlen(name), entry->st.st_mode, &item);
+    }
+    if (ret != 0)
+        return ret;
+
+    w->items++;
+
+    if (S_ISDIR(entry->st.st_mode)) {
+        flush_item(item);
+        return add_dir(w, item, &entry->st);
+    }
+
+    fs_file_adopt(&fs_item_file(item), entry->data, entry->st.st_size);
+    entry->data = NULL;
+    fs_item_restore(item, &entry->st, item->timer.ttl);
+    flush_item(item);
+    return 0;
+}
+
+static size_t entry_bytes(const import_entry* entry) {
+    return sizeof(import_entry) + strlen(entry->path) + 1 + entry->st.st_size;
+}
+
+static void* import_fn(void* arg) {
+    import_worker* w = arg;
+    importer* imp = w->imp;
+    pthread_mutex_lock(&imp->lock);
+    while (true) {
+        if (w->head == NULL) {
+            if (imp->done)
+                break;
+            pthread_cond_wait(&w->cond, &imp->lock);
+            continue;
+        }
+
+        import_entry* entry = w->head;
+        w->head = NULL;
+        w->tail = NULL;
+        int ret = imp->error;
+        pthread_mutex_unlock(&imp->lock);
+
+        size_t bytes = 0;
+        fs_rdlock();
+        for (size_t count = 1; entry != NULL; count++) {
+            // let the writers in between batches
+            if (count % IMPORT_BATCH == 0) {
+                fs_unlock();
+                fs_rdlock();
+                w->dir = NULL;
+            }
+            if (ret == 0)
+                ret = build_entry(w, entry, false);
+            if (ret == -EAGAIN) {
+                fs_unlock();
+                fs_wrlock();
+                w->dir = NULL;
+                ret = build_entry(w, entry, true);
+                fs_unlock();
+                fs_rdlock();
+                w->dir = NULL;
+            }
+
+            import_entry* next = entry->next;
+            bytes += entry_bytes(entry);
+            free(entry->data);
+            free(entry);
+            entry = next;
+        }
+        // the directories can be removed once the lock is given up
+        w->dir = NULL;
+        fs_unlock();
+
+        pthread_mutex_lock(&imp->lock);
+        if (ret != 0 && imp->error == 0)
+            imp->error = ret;
+        imp->queued_bytes -= bytes;
+        pthread_cond_signal(&imp->space_cond);
+    }
+    pthread_mutex_unlock(&imp->lock);
+    return NULL;
+}
+
+/**
+ * Hand the batch the reader filled to the worker. Returns the error of the
+ * workers so the reader can stop
+ */
+static int push_batch(importer* imp, import_worker* w) {
+    pthread_mutex_lock(&imp->lock);
+    if (w->batch_head != NULL) {
+        if (w->tail != NULL) {
+            w->tail->next = w->batch_head;
+        } else {
+            w->head = w->batch_head;
+        }
+        w->tail = w->batch_tail;
+        imp->queued_bytes += w->batch_bytes;
+        pthread_cond_signal(&w->cond);
+    }
+    while (imp->queued_bytes > IMPORT_QUEUE_MAX && imp->error == 0)
+        pthread_cond_wait(&imp->space_cond, &imp->lock);
+    int ret = imp->error;
+    pthread_mutex_unlock(&imp->lock);
+
+    w->batch_head = NULL;
+    w->batch_tail = NULL;
+    w->batch_count = 0;
+    w->batch_bytes = 0;
+    return ret;
+}
+
+/**
+ * Queue the entry for the worker building its top level subtree
+ */
+static int queue_entry(importer* imp, import_entry* entry) {
+    size_t first_len = strcspn(entry->path, "/");
+    import_worker* w = &imp->workers[fs_dirmap_hash(entry->path, first_len) % imp->worker_count];
+    if (w->batch_tail != NULL) {
+        w->batch_tail->next = entry;
+    } else {
+        w->batch_head = entry;
+    }
+    w->batch_tail = entry;
+    w->batch_count++;
+    w->batch_bytes += entry_bytes(entry);
+
+    if (w->batch_count < IMPORT_BATCH && w->batch_bytes < IMPORT_READ_BUF)
+        return 0;
+    return push_batch(imp, w);
+}
+
+/**
+ * Decode the entry of the header and queue it
+ */
+static int read_entry(importer* imp, archive_reader* r, const tar_header* header, const pax_values* pax, uint64_t size) {
+    char path[PATH_LEN_MAX + 1];
+    int len = entry_path(header, pax, path);
+    bool is_dir = header->typeflag == '5';
+    uint64_t mode, uid, gid, mtime;
+    if (len < 0 || !parse_number(header->mode, sizeof(header->mode), &mode)
+        || !parse_number(header->uid, sizeof(header->uid), &uid)
+        || !parse_number(header->gid, sizeof(header->gid), &gid)
+        || !parse_number(header->mtime, sizeof(header->mtime), &mtime))
+        return -EINVAL;
+    // the directory imported into
+    if (len == 0)
+        return read_archive(r, NULL, size + tar_padding(size));
+    if (is_dir)
+        size = 0;
+    if (size > (uint64_t)INT64_MAX)
+        return -EFBIG;
+
+    import_entry* entry = malloc(sizeof(import_entry) + len + 1);
+    uint8_t* data = size == 0 ? NULL : malloc(size);
+    if (entry == NULL || (size != 0 && data == NULL)) {
+        free(entry);
+        free(data);
+        return -ENOMEM;
+    }
+
+    memset(&entry->st, 0, sizeof(entry->st));
+    entry->st.st_mode = (is_dir ? S_IFDIR : S_IFREG) | (mode & 07777);
+    entry->st.st_uid = pax->has_uid ? pax->uid : uid;
+    entry->st.st_gid = pax->has_gid ? pax->gid : gid;
+    entry->st.st_mtime = pax->has_mtime ? pax->mtime : mtime;
+    entry->st.st_atime = entry->st.st_mtime;
+    entry->st.st_ctime = entry->st.st_mtime;
+    entry->st.st_size = size;
+    entry->data = data;
+    entry->next = NULL;
+    memcpy(entry->path, path, len + 1);
+
+    int ret = read_archive(r, data, size);
+    if (ret == 0)
+        ret = read_archive(r, NULL, tar_padding(size));
+    if (ret != 0) {
+        free(data);
+        free(entry);
+        return ret;
+    }
+    return queue_entry(imp, entry);
+}
+
+static int read_entries(importer* imp, archive_reader* r) {
+    pax_values pax = { .has_path = false };
+    char* records = NULL;
+    int ret = 0;
+    while (ret == 0) {
+        tar_header header;
+        ret = read_archive(r, &header, sizeof(header));
+        if (ret != 0 || is_end(&header))
+            break;
+
+        uint64_t size;
+        if (!check_header(&header) || !parse_number(header.size, sizeof(header.size), &size)) {
+            ret = -EINVAL;
+            break;
+        }
+        switch (header.typeflag) {
+        case 'L':
+            // GNU long name of the next entry
+            if (size > PATH_LEN_MAX) {
+                ret = -ENAMETOOLONG;
+                break;
+            }
+            ret = read_archive(r, pax.path, size);
+            if (ret == 0)
+                ret = read_archive(r, NULL, tar_padding(size));
+            pax.path[size] = '\0';
+            pax.has_path = true;
+            continue;
+        case 'x':
+            if (size > PAX_MAX) {
+                ret = -EINVAL;
+                break;
+            }
+            free(records);
+            records = malloc(size + 1);
+            if (records == NULL) {
+                ret = -ENOMEM;
+                break;
+            }
+            ret = read_archive(r, records, size);
+            if (ret == 0)
+                ret = read_archive(r, NULL, tar_padding(size));
+            records[size] = '\0';
+            if (ret == 0)
+                parse_pax(records, size, &pax);
+            continue;
+        case '0':
+        case '\0':
+        case '7':
+        case '5':
+            ret = read_entry(imp, r, &header, &pax, pax.has_size ? pax.size : size);
+            break;
+        default:
+            // links, devices, global pax headers and the like
+            size = pax.has_size ? pax.size : size;
+            ret = read_archive(r, NULL, size + tar_padding(size));
+            break;
+        }
+        memset(&pax, 0, sizeof(pax));
+    }
+
+    free(records);
+    return ret;
+}
+
+/**
+ * Drop what the kernel has cached of the directory and its items, including
+ * the failed lookups of the new names. The items below them are only found
+ * through these, except for the ones that were replaced, which were
+ * invalidated on their own. Needs the fs lock
+ */
+static void notify_import(const fs_item* dir) {
+    char path[PATH_LEN_MAX + 1];
+    int len = fs_item_path(dir, path);
+    if (len < 0)
+        return;
+    fs_notify_inval(path);
+    // the root is just "/"
+    if (len == 1)
+        len = 0;
+
+    fs_item* item;
+    fs_foreach_val(&fs_item_dir(dir).items, item) {
+        if (len + 1 + item->name_len > PATH_LEN_MAX)
+            continue;
+        path[len] = '/';
+        memcpy(&path[len + 1], item->name, item->name_len + 1);
+        fs_notify_inval(path);
+    }
+}
+
+/**
+ * Create the items of the tar archive read from fd in the directory. Takes
+ * the fs lock itself
+ */
+int fs_archive_import(fs_item* dir, int fd, uint64_t* items) {
+    importer* imp = calloc(1, sizeof(importer));
+    archive_reader r = { .fd = fd, .buf = malloc(IMPORT_READ_BUF), .pos = 0, .len = 0 };
+    if (imp == NULL || r.buf == NULL) {
+        free(imp);
+        free(r.buf);
+        return -ENOMEM;
+    }
+
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    imp->root = dir;
+    imp->worker_count = cpus < 1 ? 1 : cpus > IMPORT_WORKERS_MAX ? IMPORT_WORKERS_MAX : (size_t)cpus;
+    pthread_mutex_init(&imp->lock, NULL);
+    pthread_cond_init(&imp->space_cond, NULL);
+    for (size_t ii = 0; ii < imp->worker_count; ii++) {
+        import_worker* w = &imp->workers[ii];
+        w->imp = imp;
+        pthread_cond_init(&w->cond, NULL);
+        pthread_create(&w->thread, NULL, import_fn, w);
+    }
+
+    int ret = read_entries(imp, &r);
+    for (size_t ii = 0; ii < imp->worker_count; ii++)
+        push_batch(imp, &imp->workers[ii]);
+    pthread_mutex_lock(&imp->lock);
+    imp->done = true;
+    for (size_t ii = 0; ii < imp->worker_count; ii++)
+        pthread_cond_signal(&imp->workers[ii].cond);
+    pthread_mutex_unlock(&imp->lock);
+
+    for (size_t ii = 0; ii < imp->worker_count; ii++)
+        pthread_join(imp->workers[ii].thread, NULL);
+
+    // building the items touched the directories so the times go last
+    *items = 0;
+    fs_wrlock();
+    for (size_t ii = 0; ii < imp->worker_count; ii++) {
+        import_worker* w = &imp->workers[ii];
+        for (size_t jj = 0; jj < w->dir_count; jj++) {
+            fs_item_restore(w->dirs[jj].item, &w->dirs[jj].st, w->dirs[jj].item->timer.ttl);
+            fs_item_unref(w->dirs[jj].item);
+        }
+        free(w->dirs);
+        pthread_cond_destroy(&w->cond);
+        *items += w->items;
+    }
+    notify_import(dir);
+    fs_unlock();
+
+    if (ret == 0)
+        ret = imp->error;
+    pthread_mutex_destroy(&imp->lock);
+    pthread_cond_destroy(&imp->space_cond);
+    free(imp);
+    free(r.buf);
+    return ret;
+}
+
+static void put_number(char* field, size_t len, uint64_t val) {
+    if (val < (uint64_t)1 << (3 * (len - 1))) {
+        snprintf(field, len, "%0*llo", (int)len - 1, (unsigned long long)val);
+        return;
+    }
+    // base-256 for sizes that don't fit the octal digits
+    field[0] = (char)0x80;
+    for (size_t ii = len - 1; ii > 0; ii--) {
+        field[ii] = (char)(val & 0xff);
+        val >>= 8;
+    }
+}
+
+static void put_header(tar_header* header, const char* name, size_t len, const struct stat* st, char typeflag) {
+    memset(header, 0, sizeof(tar_header));
+    memcpy(header->name, name, len < sizeof(header->name) ? len : sizeof(header->name));
+    put_number(header->mode, sizeof(header->mode), st->st_mode & 07777);
+    put_number(header->uid, sizeof(header->uid), st->st_uid);
+    put_number(header->gid, sizeof(header->gid), st->st_gid);
+    put_number(header->size, sizeof(header->size), st->st_size);
+    put_number(header->mtime, sizeof(header->mtime), st->st_mtime < 0 ? 0 : st->st_mtime);
+    header->typeflag = typeflag;
+    memcpy(header->magic, GNU_MAGIC, sizeof(GNU_MAGIC));
+
+    unsigned sum = ' ' * sizeof(header->chksum);
+    const unsigned char* bytes = (const unsigned char*)header;
+    for (size_t ii = 0; ii < TAR_BLOCK; ii++)
+        sum += bytes[ii];
+    snprintf(header->chksum, sizeof(header->chksum) - 1, "%06o", sum);
+    header->chksum[sizeof(header->chksum) - 1] = ' ';
+}
+
+/**
+ * Headers of the item into ex->headers, with a long name entry before if
+ * the path doesn't fit. Returns their size
+ */
+static size_t put_headers(exporter* ex, const char* path, size_t len, const struct stat* st) {
+    size_t pos = 0;
+    if (len > sizeof(((tar_header*)NULL)->name)) {
+        struct stat name_st = { .st_mode = 0644, .st_size = len + 1 };
+        put_header((tar_header*)ex->headers, GNU_LONG_NAME, strlen(GNU_LONG_NAME), &name_st, 'L');
+        pos = TAR_BLOCK;
+        memcpy(&ex->headers[pos], path, len);
+        memset(&ex->headers[pos + len], 0, 1 + tar_padding(len + 1));
+        pos += len + 1 + tar_padding(len + 1);
+    }
+    put_header((tar_header*)&ex->headers[pos], path, len, st, S_ISDIR(st->st_mode) ? '5' : '0');
+    return pos + TAR_BLOCK;
+}
+
+static int write_all(int fd, struct iovec* iov, int count) {
+    while (count > 0) {
+        ssize_t written = writev(fd, iov, count);
+        if (written < 0 && errno == EINTR)
+            continue;
+        if (written < 0)
+            return -errno;
+
+        for (; count > 0 && (size_t)written >= iov->iov_len; iov++, count--)
+            written -= iov->iov_len;
+        if (count > 0) {
+            iov->iov_base = (char*)iov->iov_base + written;
+            iov->iov_len -= written;
+        }
+    }
+    return 0;
+}
+
+static int write_bytes(exporter* ex, const void* data, size_t len) {
+    struct iovec iov = { .iov_base = (void*)data, .iov_len = len };
+    return write_all(ex->fd, &iov, 1);
+}
+
+/**
+ * The file in one writev from its data, with the size it has now. If the
+ * file was written to meanwhile, the output is rewound so export_copy
+ * writes it again with the same size
+ */
+static int export_direct(exporter* ex, const char* path, size_t len, export_entry* entry, bool* done) {
+    static const char zeros[TAR_BLOCK] = { 0 };
+    off_t start = lseek(ex->fd, 0, SEEK_CUR);
+    if (start < 0)
+        return -errno;
+    // the data can't be freed before the epoch is left
+    fs_epoch_enter();
+    off_t size;
+    uint32_t seq;
+    const uint8_t* data = fs_file_data(&fs_item_file(entry->item), &size, &seq);
+    int ret = 0;
+    *done = data != NULL || size == 0;
+    if (*done) {
+        entry->st.st_size = size;
+        struct iovec iov[3] = {
+            { .iov_base = ex->headers, .iov_len = put_headers(ex, path, len, &entry->st) },
+            { .iov_base = (void*)data, .iov_len = size },
+            { .iov_base = (void*)zeros, .iov_len = tar_padding(size) },
+        };
+        ret = write_all(ex->fd, iov, 3);
+    }
+    if (ret == 0 && *done && fs_file_data_retry(&fs_item_file(entry->item), seq)) {
+        *done = false;
+        if (lseek(ex->fd, start, SEEK_SET) < 0)
+            ret = -errno;
+    }
+    fs_epoch_exit();
+    return ret;
+}
+
+/**
+ * The file with the size it was listed with, copied out in pieces. Also
+ * for data in memfds and in --lower
+ */
+static int export_copy(exporter* ex, const char* path, size_t len, const export_entry* entry) {
+    int ret = write_bytes(ex, ex->headers, put_headers(ex, path, len, &entry->st));
+    off_t size = entry->st.st_size;
+    for (off_t pos = 0; ret == 0 && pos < size;) {
+        size_t chunk = size - pos < EXPORT_CHUNK ? size - pos : EXPORT_CHUNK;
+        fs_rdlock();
+        int got = fs_item_read(entry->item, ex->chunk, chunk, pos);
+        fs_unlock();
+        if (got < 0)
+            return got;
+        // cut since it was listed, the header already has the size
+        memset(&ex->chunk[got], 0, chunk - got);
+        ret = write_bytes(ex, ex->chunk, chunk);
+        pos += chunk;
+    }
+    if (ret == 0) {
+        memset(ex->chunk, 0, tar_padding(size));
+        ret = write_bytes(ex, ex->chunk, tar_padding(size));
+    }
+    return ret;
+}
+
+/**
+ * List the directory under the fs lock, with references to the items so
+ * they stay valid after it
+ */
+static int list_dir(fs_item* dir, export_entry** entries, uint32_t* count, char** names) {
+    *entries = NULL;
+    *names = NULL;
+    *count = 0;
+    fs_rdlock();
+    int ret = fs_dir_fill(&fs_item_dir(dir));
+    fs_item** items = ret == 0 ? fs_dirmap_snapshot(&fs_item_dir(dir).items, count) : NULL;
+    if (ret == 0 && items != NULL) {
+        size_t names_len = 0;
+        for (uint32_t ii = 0; ii < *count; ii++)
+            names_len += items[ii]->name_len;
+        *entries = malloc(*count * sizeof(export_entry) + 1);
+        *names = malloc(names_len + 1);
+    }
+    if (ret == 0 && (*entries == NULL || *names == NULL)) {
+        ret = -ENOMEM;
+        *count = 0;
+    }
+
+    size_t pos = 0;
+    for (uint32_t ii = 0; ii < *count; ii++) {
+        export_entry* entry = &(*entries)[ii];
+        fs_item_ref(items[ii]);
+        entry->item = items[ii];
+        fs_item_stat(items[ii], &entry->st);
+        entry->name_offset = pos;
+        entry->name_len = items[ii]->name_len;
+        memcpy(&(*names)[pos], items[ii]->name, entry->name_len);
+        pos += entry->name_len;
+    }
+    fs_unlock();
+    free(items);
+    return ret;
+}
+
+/**
+ * Write the items of the directory below path, which is len long
+ */
+static int export_dir(exporter* ex, fs_item* dir, char* path, size_t len) {
+    export_entry* entries;
+    uint32_t count;
+    char* names;
+    int ret = list_dir(dir, &entries, &count, &names);
+
+    for (uint32_t ii = 0; ii < count; ii++) {
+        export_entry* entry = &entries[ii];
+        bool is_dir = S_ISDIR(entry->st.st_mode);
+        // directories end with a slash in archives
+        size_t child_len = len + entry->name_len + (is_dir ? 1 : 0);
+        if (ret == 0 && child_len > PATH_LEN_MAX)
+            ret = -ENAMETOOLONG;
+        if (ret == 0) {
+            memcpy(&path[len], &names[entry->name_offset], entry->name_len);
+            if (is_dir)
+                path[child_len - 1] = '/';
+            path[child_len] = '\0';
+        }
+
+        if (ret == 0 && is_dir) {
+            entry->st.st_size = 0;
+            ret = write_bytes(ex, ex->headers, put_headers(ex, path, child_len, &entry->st));
+            if (ret == 0)
+                ret = export_dir(ex, entry->item, path, child_len);
+        } else if (ret == 0) {
+            bool done = false;
+            if (ex->direct)
+                ret = export_direct(ex, path, child_len, entry, &done);
+            if (ret == 0 && !done)
+                ret = export_copy(ex, path, child_len, entry);
+        }
+        if (ret == 0)
+            ex->items++;
+        fs_item_unref(entry->item);
+    }
+
+    free(entries);
+    free(names);
+    return ret;
+}
+
+/**
+ * Write a tar archive of everything under the directory to fd. Takes the
+ * fs lock itself
+ */
+int fs_archive_export(fs_item* dir, int fd, uint64_t* items) {
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+        return -errno;
+
+    exporter* ex = malloc(sizeof(exporter));
+    char* path = malloc(PATH_LEN_MAX + 1);
+    char* chunk = malloc(EXPORT_CHUNK);
+    int ret = -ENOMEM;
+    if (ex != NULL && path != NULL && chunk != NULL) {
+        ex->fd = fd;
+        // rewinding doesn't work for appends
+        ex->direct = S_ISREG(st.st_mode) && (fcntl(fd, F_GETFL) & O_APPEND) == 0;
+        ex->items = 0;
+        ex->chunk = chunk;
+        ret = export_dir(ex, dir, path, 0);
+        // the end of the archive
+        memset(chunk, 0, 2 * TAR_BLOCK);
+        if (ret == 0)
+            ret = write_bytes(ex, chunk, 2 * TAR_BLOCK);
+        *items = ex->items;
+    }
+
+    free(ex);
+    free(path);
+    free(chunk);
+    return ret;
+}
@@ -0,0 +1,12 @@
+#ifndef FS_ARCHIVE_H
+#define FS_ARCHIVE_H
+
+#include <stdint.h>
+
+#include "fs.h"
+#include "util.h"
+
+int fs_archive_import(fs_item* dir, int fd, uint64_t* items) __nonnull((1, 3));
+int fs_archive_export(fs_item* dir, int fd, uint64_t* items) __nonnull((1, 3));
+
+#endif
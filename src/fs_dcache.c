@@ -0,0 +1,110 @@
+#include "util.h"
+
+#include <sched.h>
+
+#include "fs_dcache.h"
+
+/**
+ * Lookup cache from full path to item.
+ *
+ * A direct mapped table indexed by the hash of the path. Entries are never
+ * invalidated by the writers. Instead a hit is only a candidate that the
+ * caller verifies by walking the item's parents back to the root, so
+ * renamed and removed items simply stop matching.
+ *
+ * The cache keeps pointers to items that might have been removed so every
+ * item remembers the slot it's in. The reclaimer clears the slot before the
+ * item is freed, see reclaim_batch.
+ *
+ * Slots are protected by seqcounts. Readers never write to the table,
+ * concurrent writers of the same slot just skip the insert.
+ */
+#define DCACHE_BITS 14
+#define DCACHE_SIZE (1 << DCACHE_BITS)
+#define DCACHE_MASK (DCACHE_SIZE - 1)
+
+typedef struct dcache_slot {
+    // odd while the slot is being written
+    uint32_t seq;
+    uint32_t hash;
+    fs_item* item;
+} dcache_slot;
+
+static dcache_slot slots[DCACHE_SIZE];
+
+static bool slot_trylock(dcache_slot* slot) {
+    uint32_t seq = __atomic_load_n(&slot->seq, __ATOMIC_RELAXED);
+    return (seq & 1) == 0
+        && __atomic_compare_exchange_n(&slot->seq, &seq, seq + 1, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+static void slot_unlock(dcache_slot* slot) {
+    __atomic_store_n(&slot->seq, slot->seq + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Remove the item from the slot if it's still there
+ */
+static void clear_slot(uint32_t idx, const fs_item* item) {
+    dcache_slot* slot = &slots[idx];
+    while (!slot_trylock(slot))
+        sched_yield();
+    if (slot->item == item)
+        __atomic_store_n(&slot->item, NULL, __ATOMIC_RELAXED);
+    slot_unlock(slot);
+}
+
+/**
+ * Get the item cached for the path hash. The caller has to verify that the
+ * item really is at the path, inside an epoch even when holding the fs lock
+ * since the reclaimer frees the items without it.
+ */
+bool fs_dcache_get(uint32_t hash, fs_item** buf) {
+    const dcache_slot* slot = &slots[hash & DCACHE_MASK];
+    uint32_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+    if (seq & 1)
+        return false;
+
+    uint32_t slot_hash = __atomic_load_n(&slot->hash, __ATOMIC_RELAXED);
+    fs_item* item = __atomic_load_n(&slot->item, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != seq || item == NULL || slot_hash != hash)
+        return false;
+
+    *buf = item;
+    return true;
+}
+
+/**
+ * Cache the item that was just found from the path. The item must be
+ * reachable from the tree so it can't have been handed to the reclaimer yet.
+ */
+void fs_dcache_put(uint32_t hash, fs_item* item) {
+    uint32_t idx = hash & DCACHE_MASK;
+    dcache_slot* slot = &slots[idx];
+    if (__atomic_load_n(&slot->item, __ATOMIC_RELAXED) == item
+        && __atomic_load_n(&slot->hash, __ATOMIC_RELAXED) == hash)
+        return;
+
+    if (!slot_trylock(slot))
+        return;
+    __atomic_store_n(&slot->hash, hash, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->item, item, __ATOMIC_RELAXED);
+    slot_unlock(slot);
+
+    // an item is only kept in one slot so it can be found when it's freed.
+    // if someone else cached the item at the same time, the later one wins
+    uint32_t old = __atomic_exchange_n(&item->dcache_slot, idx, __ATOMIC_ACQ_REL);
+    if (old != idx && old != FS_DCACHE_NONE)
+        clear_slot(old, item);
+}
+
+/**
+ * Drop the item from the cache. Called by the reclaimer once nobody can
+ * insert the item anymore, the item can be freed after the next grace period.
+ */
+void fs_dcache_forget(fs_item* item) {
+    uint32_t idx = __atomic_load_n(&item->dcache_slot, __ATOMIC_ACQUIRE);
+    if (idx != FS_DCACHE_NONE)
+        clear_slot(idx, item);
+}
@@ -0,0 +1,16 @@
+#ifndef FS_DCACHE_H
+#define FS_DCACHE_H
+
+#include <stdint.h>
+
+#include "fs.h"
+#include "util.h"
+
+// dcache_slot of an item that isn't cached
+#define FS_DCACHE_NONE UINT32_MAX
+
+bool fs_dcache_get(uint32_t hash, fs_item** buf) __nonnull((2));
+void fs_dcache_put(uint32_t hash, fs_item* item) __nonnull((2));
+void fs_dcache_forget(fs_item* item) __nonnull((1));
+
+#endif
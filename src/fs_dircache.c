@@ -0,0 +1,111 @@
+#include "util.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "fs_dircache.h"
+
+/**
+ * Per-thread cache of the directories the last requests were in.
+ *
+ * Build tools and the like work one directory at a time so the requests of
+ * a thread keep resolving the same parent path. Each thread remembers the
+ * last few parent paths it resolved and the lookups skip straight to the
+ * last component.
+ *
+ * The cache is keyed by the path up to the last component and is only a
+ * candidate, fs.c checks that the directory wasn't moved or removed since
+ * from its generation and the tree gen.
+ *
+ * Nobody else can see the entries of a thread so they are never cleared.
+ * Instead the generation here is moved forward before the reclaimer frees
+ * any directories, which drops every entry that was filled before it.
+ */
+#define DIRCACHE_ENTRIES 4
+
+typedef struct dircache_slot {
+    fs_dircache_entry entry;
+    size_t len;
+    char prefix[PATH_LEN_MAX + 1];
+} dircache_slot;
+
+typedef struct dircache {
+    dircache_slot slots[DIRCACHE_ENTRIES];
+    // slot replaced next
+    int next;
+} dircache;
+
+static pthread_key_t cache_key;
+static uint32_t flush_gen = 0;
+
+/**
+ * Length of the path up to the last component, including the slash
+ */
+static size_t prefix_len(const path_string* p_string) {
+    return ps_last(p_string)->offset;
+}
+
+/**
+ * Get the directory the last component of the path is in. Has to be called
+ * inside an epoch, the directory can be accessed until the epoch is left.
+ */
+bool fs_dircache_get(const path_string* p_string, fs_dircache_entry* buf) {
+    const dircache* cache = pthread_getspecific(cache_key);
+    if (cache == NULL || p_string->files < 2)
+        return false;
+
+    size_t len = prefix_len(p_string);
+    uint32_t gen = fs_dircache_generation();
+    for (int ii = 0; ii < DIRCACHE_ENTRIES; ii++) {
+        const dircache_slot* slot = &cache->slots[ii];
+        if (slot->len == len && slot->entry.flush_gen == gen
+            && memcmp(slot->prefix, p_string->path, len) == 0) {
+            *buf = slot->entry;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+void fs_dircache_put(const path_string* p_string, const fs_dircache_entry* entry) {
+    if (p_string->files < 2)
+        return;
+
+    dircache* cache = pthread_getspecific(cache_key);
+    if (cache == NULL) {
+        cache = calloc(1, sizeof(dircache));
+        if (cache == NULL)
+            return;
+        pthread_setspecific(cache_key, cache);
+    }
+
+    dircache_slot* slot = &cache->slots[cache->next];
+    cache->next = (cache->next + 1) % DIRCACHE_ENTRIES;
+    slot->len = prefix_len(p_string);
+    memcpy(slot->prefix, p_string->path, slot->len);
+    slot->entry = *entry;
+}
+
+uint32_t fs_dircache_generation() {
+    return __atomic_load_n(&flush_gen, __ATOMIC_SEQ_CST);
+}
+
+/**
+ * Drop the entries of every thread. Directories can be freed once the
+ * readers that were in an epoch at the time have left.
+ */
+void fs_dircache_flush() {
+    __atomic_add_fetch(&flush_gen, 1, __ATOMIC_SEQ_CST);
+}
+
+void init_fs_dircache() {
+    pthread_key_create(&cache_key, free);
+}
+
+void free_fs_dircache() {
+    free(pthread_getspecific(cache_key));
+    pthread_setspecific(cache_key, NULL);
+    pthread_key_delete(cache_key);
+}
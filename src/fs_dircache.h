@@ -0,0 +1,26 @@
+#ifndef FS_DIRCACHE_H
+#define FS_DIRCACHE_H
+
+#include <stdint.h>
+
+#include "fs.h"
+#include "util.h"
+
+typedef struct fs_dircache_entry {
+    fs_item* dir;
+    // tree_gen when the directory was resolved
+    uint32_t tree_gen;
+    // gen of the directory when it was resolved
+    uint32_t gen;
+    // fs_dircache_generation() before the directory was found
+    uint32_t flush_gen;
+} fs_dircache_entry;
+
+bool fs_dircache_get(const path_string* p_string, fs_dircache_entry* buf) __nonnull((1, 2));
+void fs_dircache_put(const path_string* p_string, const fs_dircache_entry* entry) __nonnull((1, 2));
+uint32_t fs_dircache_generation();
+void fs_dircache_flush();
+void init_fs_dircache();
+void free_fs_dircache();
+
+#endif
@@ -0,0 +1,594 @@
+#include "util.h"
+
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "fs.h"
+#include "fs_dirmap.h"
+#include "fs_epoch.h"
+
+/**
+ * Hash table of the directory items.
+ *
+ * Open addressing in groups of 16 slots like the swiss tables. Every slot
+ * has a control byte with 7 bits of the hash, so a whole group is checked
+ * with a single SIMD compare and the names are only compared for the slots
+ * whose tag matched. Removed slots are left as tombstones unless the probe
+ * sequences can't go past them. Tombstones are cleaned up when the table
+ * is rebuilt.
+ *
+ * The table is rebuilt incrementally so a single request never has to move
+ * a million items. The new table is put in place right away and every
+ * modification after that moves a few items from the old one, lookups check
+ * both until it's empty. Tables that become sparse after mass deletes are
+ * shrunk the same way.
+ *
+ * Items are created with only the fs read lock held so busy directories are
+ * split into shards that are modified independently. Every shard has a seq
+ * that writers take like a spinlock and readers use to validate what they
+ * found, so lookups never write to shared memory. Small directories stay
+ * in a single shard to save memory.
+ *
+ * The keys are the names of the items themselves so a slot is just a
+ * pointer. Lock-free readers use fs_dirmap_get_rcu() and validate the result
+ * with the directory's seq. Replaced tables are freed through the epochs.
+ */
+
+// hash bits picking the shard, below the tag and above the slot bits of
+// anything but huge tables
+#define SHARD_SHIFT 22
+// the table grows when it's 7/8 full
+#define max_load(_cap) ((_cap) - (_cap) / 8)
+// old table slots looked at per modification while resizing
+#define MIGRATE_SCAN 256
+// items moved per modification while resizing. The new table has room for
+// the old items twice over so the move is done long before it fills up
+#define MIGRATE_ITEMS 16
+
+#define HASH_K1 UINT64_C(0x9e3779b97f4a7c15)
+#define HASH_K2 UINT64_C(0xbf58476d1ce4e5b9)
+
+#define E4 FS_DIRMAP_EMPTY, FS_DIRMAP_EMPTY, FS_DIRMAP_EMPTY, FS_DIRMAP_EMPTY
+#define E16 E4, E4, E4, E4
+
+// shared by all the empty maps, the first insert replaces it
+static uint8_t empty_ctrl[FS_DIRMAP_GROUP * 2] = { E16, E16 };
+static struct fs_item* empty_slots[FS_DIRMAP_GROUP];
+static fs_dirmap_table empty_table = { FS_DIRMAP_GROUP, 0, empty_ctrl, empty_slots };
+// never written to, the first insert gives the map shards of its own
+static fs_dirmap_shard empty_shard = { &empty_table, NULL, 0, 0, FS_DIRMAP_GROUP, 0, 0 };
+
+static uint32_t hash_tag(uint32_t hash) {
+    return hash >> 25;
+}
+
+#ifdef __SSE2__
+static uint32_t group_match(const uint8_t* ctrl, uint8_t tag) {
+    __m128i group = _mm_loadu_si128((const __m128i*)ctrl);
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_set1_epi8(tag)));
+}
+
+/**
+ * Slots that are empty or deleted, both have the high bit set
+ */
+static uint32_t group_match_free(const uint8_t* ctrl) {
+    return _mm_movemask_epi8(_mm_loadu_si128((const __m128i*)ctrl));
+}
+#else
+static uint32_t group_match(const uint8_t* ctrl, uint8_t tag) {
+    uint32_t mask = 0;
+    for (int ii = 0; ii < FS_DIRMAP_GROUP; ii++)
+        mask |= (uint32_t)(ctrl[ii] == tag) << ii;
+    return mask;
+}
+
+static uint32_t group_match_free(const uint8_t* ctrl) {
+    uint32_t mask = 0;
+    for (int ii = 0; ii < FS_DIRMAP_GROUP; ii++)
+        mask |= (uint32_t)(ctrl[ii] >> 7) << ii;
+    return mask;
+}
+#endif
+
+static uint32_t group_match_empty(const uint8_t* ctrl) {
+    return group_match(ctrl, FS_DIRMAP_EMPTY);
+}
+
+static void set_ctrl(fs_dirmap_table* table, uint32_t slot, uint8_t value) {
+    table->ctrl[slot] = value;
+    // keep the copy of the first group in sync
+    if (slot < FS_DIRMAP_GROUP)
+        table->ctrl[table->cap + slot] = value;
+}
+
+static fs_dirmap_table* alloc_table(uint32_t cap) {
+    size_t ctrl_size = (cap + FS_DIRMAP_GROUP + sizeof(void*) - 1) & ~(sizeof(void*) - 1);
+    fs_dirmap_table* table = calloc(1, sizeof(fs_dirmap_table) + ctrl_size + sizeof(struct fs_item*) * cap);
+    if (table == NULL)
+        return NULL;
+
+    table->cap = cap;
+    table->growth_left = max_load(cap);
+    table->ctrl = (uint8_t*)(table + 1);
+    table->slots = (struct fs_item**)(table->ctrl + ctrl_size);
+    memset(table->ctrl, FS_DIRMAP_EMPTY, cap + FS_DIRMAP_GROUP);
+    return table;
+}
+
+static void free_table(fs_dirmap_table* table) {
+    if (table != &empty_table)
+        fs_epoch_free(table);
+}
+
+/**
+ * First empty or deleted slot in the probe sequence of the hash
+ */
+static uint32_t find_free(const fs_dirmap_table* table, uint32_t hash) {
+    const uint32_t mask = table->cap - 1;
+    uint32_t pos = hash & mask;
+    for (uint32_t step = FS_DIRMAP_GROUP;; step += FS_DIRMAP_GROUP) {
+        uint32_t match = group_match_free(&table->ctrl[pos]);
+        if (match != 0)
+            return (pos + __builtin_ctz(match)) & mask;
+        pos = (pos + step) & mask;
+    }
+}
+
+/**
+ * Slot of the name or -1 if it's not in the table
+ */
+static int64_t find(const fs_dirmap_table* table, const char* name, size_t len, uint32_t hash) {
+    const uint32_t mask = table->cap - 1;
+    const uint8_t tag = hash_tag(hash);
+    uint32_t pos = hash & mask;
+    for (uint32_t step = FS_DIRMAP_GROUP; step <= table->cap; step += FS_DIRMAP_GROUP) {
+        for (uint32_t match = group_match(&table->ctrl[pos], tag); match != 0; match &= match - 1) {
+            uint32_t slot = (pos + __builtin_ctz(match)) & mask;
+            const struct fs_item* item = table->slots[slot];
+            if (item->name_len == len && memcmp(item->name, name, len) == 0)
+                return slot;
+        }
+        if (group_match_empty(&table->ctrl[pos]) != 0)
+            break;
+        pos = (pos + step) & mask;
+    }
+
+    return -1;
+}
+
+/**
+ * Find the name from the current table or the one being moved from
+ */
+static bool find_any(const fs_dirmap_shard* shard, const char* name, size_t len, uint32_t hash, fs_dirmap_table** table, uint32_t* slot) {
+    int64_t found = find(shard->table, name, len, hash);
+    if (found >= 0) {
+        *table = shard->table;
+    } else if (shard->old != NULL && (found = find(shard->old, name, len, hash)) >= 0) {
+        *table = shard->old;
+    } else {
+        return false;
+    }
+
+    *slot = found;
+    return true;
+}
+
+static void insert(fs_dirmap_table* table, struct fs_item* item, uint32_t hash) {
+    uint32_t slot = find_free(table, hash);
+    if (table->ctrl[slot] == FS_DIRMAP_EMPTY)
+        table->growth_left--;
+    __atomic_store_n(&table->slots[slot], item, __ATOMIC_RELAXED);
+    // the readers need to see the item before the tag
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    set_ctrl(table, slot, hash_tag(hash));
+}
+
+static void erase(fs_dirmap_table* table, uint32_t slot) {
+    // the slot can be emptied if no probe sequence ever went past it, that
+    // is if there is no full group of taken slots around it
+    const uint32_t mask = table->cap - 1;
+    uint32_t empty_before = group_match_empty(&table->ctrl[(slot - FS_DIRMAP_GROUP) & mask]);
+    uint32_t empty_after = group_match_empty(&table->ctrl[slot]);
+    bool never_full = empty_before != 0 && empty_after != 0
+        && (uint32_t)__builtin_ctz(empty_after) + (__builtin_clz(empty_before) - (32 - FS_DIRMAP_GROUP)) < FS_DIRMAP_GROUP;
+    if (never_full) {
+        set_ctrl(table, slot, FS_DIRMAP_EMPTY);
+        table->growth_left++;
+    } else {
+        set_ctrl(table, slot, FS_DIRMAP_DELETED);
+    }
+}
+
+/**
+ * Smallest table that fits count items
+ */
+static uint32_t cap_for(uint32_t count) {
+    uint32_t cap = FS_DIRMAP_GROUP;
+    while (max_load(cap) < count)
+        cap *= 2;
+    return cap;
+}
+
+/**
+ * Move items from the old table until it's empty or a limit is hit
+ */
+static void migrate(fs_dirmap_shard* shard, uint32_t scan, uint32_t items) {
+    fs_dirmap_table* old = shard->old;
+    if (old == NULL)
+        return;
+
+    uint32_t end = old->cap - shard->moved > scan ? shard->moved + scan : old->cap;
+    for (; shard->moved < end && items > 0; shard->moved++) {
+        if (!fs_dirmap_full(old->ctrl[shard->moved]))
+            continue;
+        struct fs_item* item = old->slots[shard->moved];
+        insert(shard->table, item, fs_dirmap_hash(item->name, item->name_len));
+        // keep the probe sequences of the items still left intact
+        set_ctrl(old, shard->moved, FS_DIRMAP_DELETED);
+        items--;
+    }
+
+    if (shard->moved == old->cap) {
+        __atomic_store_n(&shard->old, NULL, __ATOMIC_RELEASE);
+        free_table(old);
+    }
+}
+
+/**
+ * Start moving the items to a new table with cap slots
+ */
+static bool start_resize(fs_dirmap_shard* shard, uint32_t cap) {
+    // the previous resize has to be done first
+    migrate(shard, UINT32_MAX, UINT32_MAX);
+    fs_dirmap_table* table = alloc_table(cap);
+    if (table == NULL)
+        return false;
+
+    shard->moved = 0;
+    __atomic_store_n(&shard->old, shard->table, __ATOMIC_RELEASE);
+    __atomic_store_n(&shard->table, table, __ATOMIC_RELEASE);
+    return true;
+}
+
+static fs_dirmap_shard* alloc_shards(uint32_t count) {
+    void* ptr;
+    if (posix_memalign(&ptr, sizeof(fs_dirmap_shard), sizeof(fs_dirmap_shard) * count) != 0)
+        return NULL;
+
+    fs_dirmap_shard* shards = ptr;
+    for (uint32_t ii = 0; ii < count; ii++) {
+        shards[ii] = empty_shard;
+        shards[ii].mask = count - 1;
+    }
+    return shards;
+}
+
+static fs_dirmap_shard* shard_of(fs_dirmap_shard* shards, uint32_t hash) {
+    return &shards[(hash >> SHARD_SHIFT) & shards->mask];
+}
+
+/**
+ * Lock the shard of the hash. Has to be called inside an epoch since the
+ * shards can be replaced by a split while we wait.
+ */
+static fs_dirmap_shard* lock_shard(fs_dirmap* map, uint32_t hash) {
+    while (true) {
+        fs_dirmap_shard* shards = __atomic_load_n(&map->shards, __ATOMIC_ACQUIRE);
+        if (shards == &empty_shard) {
+            fs_dirmap_shard* first = alloc_shards(1);
+            if (first == NULL)
+                abort();
+            if (!__atomic_compare_exchange_n(&map->shards, &shards, first, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+                free(first);
+            continue;
+        }
+
+        // split shards stay odd so we can only get one that is still used
+        fs_dirmap_shard* shard = shard_of(shards, hash);
+        uint32_t seq = __atomic_load_n(&shard->seq, __ATOMIC_RELAXED);
+        if ((seq & 1) == 0 && __atomic_compare_exchange_n(&shard->seq, &seq, seq + 1, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+            __atomic_thread_fence(__ATOMIC_RELEASE);
+            return shard;
+        }
+        sched_yield();
+    }
+}
+
+static void unlock_shard(fs_dirmap_shard* shard) {
+    __atomic_store_n(&shard->seq, __atomic_load_n(&shard->seq, __ATOMIC_RELAXED) + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Spread the items of the map's only shard over FS_DIRMAP_SHARDS new ones.
+ * The old shard is left locked so everyone waiting for it moves on to the
+ * new shards.
+ */
+static void split(fs_dirmap* map, fs_dirmap_shard* shard) {
+    fs_dirmap_shard* shards = alloc_shards(FS_DIRMAP_SHARDS);
+    if (shards == NULL) {
+        // a single shard works just as well, only slower
+        unlock_shard(shard);
+        return;
+    }
+
+    uint32_t cap = cap_for((shard->size / FS_DIRMAP_SHARDS + 1) * 2);
+    uint32_t min_cap = shard->min_cap / FS_DIRMAP_SHARDS;
+    for (int ii = 0; ii < FS_DIRMAP_SHARDS; ii++) {
+        shards[ii].table = alloc_table(cap);
+        if (shards[ii].table == NULL)
+            abort();
+        shards[ii].min_cap = min_cap > FS_DIRMAP_GROUP ? min_cap : FS_DIRMAP_GROUP;
+    }
+
+    for (const fs_dirmap_table* table = shard->table; table != NULL; table = table == shard->table ? shard->old : NULL) {
+        for (uint32_t ii = 0; ii < table->cap; ii++) {
+            if (!fs_dirmap_full(table->ctrl[ii]))
+                continue;
+            struct fs_item* item = table->slots[ii];
+            uint32_t hash = fs_dirmap_hash(item->name, item->name_len);
+            fs_dirmap_shard* target = shard_of(shards, hash);
+            if (target->table->growth_left == 0 && !start_resize(target, cap_for((target->size + 1) * 2)))
+                abort();
+            insert(target->table, item, hash);
+            target->size++;
+        }
+    }
+    for (int ii = 0; ii < FS_DIRMAP_SHARDS; ii++)
+        migrate(&shards[ii], UINT32_MAX, UINT32_MAX);
+
+    __atomic_store_n(&map->shards, shards, __ATOMIC_RELEASE);
+    free_table(shard->table);
+    if (shard->old != NULL)
+        free_table(shard->old);
+    fs_epoch_free(shard);
+}
+
+/**
+ * Hash of a name, 8 bytes at a time
+ */
+uint32_t fs_dirmap_hash(const char* name, size_t len) {
+    uint64_t hash = len * HASH_K2;
+    uint64_t word;
+    for (; len >= sizeof(word); len -= sizeof(word), name += sizeof(word)) {
+        memcpy(&word, name, sizeof(word));
+        hash = (hash ^ word) * HASH_K1;
+        hash ^= hash >> 32;
+    }
+    if (len > 0) {
+        word = 0;
+        memcpy(&word, name, len);
+        hash = (hash ^ word) * HASH_K1;
+    }
+
+    hash ^= hash >> 31;
+    hash *= HASH_K2;
+    hash ^= hash >> 29;
+    return (uint32_t)hash;
+}
+
+void fs_dirmap_init(fs_dirmap* map) {
+    map->shards = &empty_shard;
+}
+
+/**
+ * Free the map. Nobody can be using it anymore
+ */
+void fs_dirmap_term(fs_dirmap* map) {
+    if (map->shards == &empty_shard)
+        return;
+
+    for (uint32_t ii = 0; ii <= map->shards->mask; ii++) {
+        free_table(map->shards[ii].table);
+        if (map->shards[ii].old != NULL)
+            free_table(map->shards[ii].old);
+    }
+    fs_epoch_free(map->shards);
+    fs_dirmap_init(map);
+}
+
+/**
+ * Make room for count items so the map doesn't have to grow while they are
+ * added, and don't shrink it below that. Returns false if out of memory
+ */
+bool fs_dirmap_reserve(fs_dirmap* map, uint32_t count) {
+    bool ret = true;
+    fs_epoch_enter();
+    fs_dirmap_shard* shard = lock_shard(map, 0);
+    uint32_t shards = FS_DIRMAP_SHARDS;
+    if (shard->mask == 0 && count > FS_DIRMAP_SPLIT) {
+        split(map, shard);
+    } else {
+        shards = shard->mask + 1;
+        unlock_shard(shard);
+    }
+
+    // hashes spread the items evenly enough for the tables' spare room
+    uint32_t cap = cap_for(count / shards + 1);
+    for (uint32_t ii = 0; ii < shards && ret; ii++) {
+        shard = lock_shard(map, ii << SHARD_SHIFT);
+        if (cap > shard->table->cap && !start_resize(shard, cap)) {
+            ret = false;
+        } else {
+            migrate(shard, UINT32_MAX, UINT32_MAX);
+            shard->min_cap = cap;
+        }
+        unlock_shard(shard);
+    }
+    fs_epoch_exit();
+    return ret;
+}
+
+/**
+ * Count of the items in the map
+ */
+uint32_t fs_dirmap_size(const fs_dirmap* map) {
+    uint32_t size = 0;
+    fs_epoch_enter();
+    const fs_dirmap_shard* shards = __atomic_load_n(&map->shards, __ATOMIC_ACQUIRE);
+    for (uint32_t ii = 0; ii <= shards->mask; ii++)
+        size += __atomic_load_n(&shards[ii].size, __ATOMIC_RELAXED);
+    fs_epoch_exit();
+    return size;
+}
+
+static bool get_rcu(const fs_dirmap_table* table, const char* name, size_t len, uint32_t hash, struct fs_item** buf) {
+    const uint32_t mask = table->cap - 1;
+    const uint8_t tag = hash_tag(hash);
+    uint32_t pos = hash & mask;
+    for (uint32_t step = FS_DIRMAP_GROUP; step <= table->cap; step += FS_DIRMAP_GROUP) {
+        uint32_t match = group_match(&table->ctrl[pos], tag);
+        uint32_t empty = group_match_empty(&table->ctrl[pos]);
+        // pairs with the fence in insert so the slots are at least as new
+        // as the tags
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        for (; match != 0; match &= match - 1) {
+            uint32_t slot = (pos + __builtin_ctz(match)) & mask;
+            const struct fs_item* item = __atomic_load_n(&table->slots[slot], __ATOMIC_RELAXED);
+            // the name might be rewritten by a rename so don't trust the length
+            if (item != NULL && strncmp(item->name, name, len) == 0 && item->name[len] == '\0') {
+                *buf = (struct fs_item*)item;
+                return true;
+            }
+        }
+        if (empty != 0)
+            break;
+        pos = (pos + step) & mask;
+    }
+
+    return false;
+}
+
+/**
+ * fs_dirmap_get without entering an epoch, the caller has to be inside one.
+ * Retries while the shard is modified under us.
+ */
+bool fs_dirmap_get_rcu(const fs_dirmap* map, const char* name, size_t len, uint32_t hash, struct fs_item** buf) {
+    while (true) {
+        const fs_dirmap_shard* shard = shard_of(__atomic_load_n(&map->shards, __ATOMIC_ACQUIRE), hash);
+        uint32_t seq = __atomic_load_n(&shard->seq, __ATOMIC_ACQUIRE);
+        if (seq & 1) {
+            sched_yield();
+            continue;
+        }
+
+        struct fs_item* item;
+        const fs_dirmap_table* table = __atomic_load_n(&shard->table, __ATOMIC_ACQUIRE);
+        const fs_dirmap_table* old = __atomic_load_n(&shard->old, __ATOMIC_ACQUIRE);
+        bool found = get_rcu(table, name, len, hash, &item)
+            || (old != NULL && get_rcu(old, name, len, hash, &item));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&shard->seq, __ATOMIC_RELAXED) != seq)
+            continue;
+
+        if (found)
+            *buf = item;
+        return found;
+    }
+}
+
+/**
+ * Find the item with the name. Safe with concurrent writers, the item stays
+ * valid as long as the caller holds the fs lock.
+ */
+bool fs_dirmap_get(const fs_dirmap* map, const char* name, size_t len, uint32_t hash, struct fs_item** buf) {
+    fs_epoch_enter();
+    bool found = fs_dirmap_get_rcu(map, name, len, hash, buf);
+    fs_epoch_exit();
+    return found;
+}
+
+/**
+ * Add the item to the map. Returns false and leaves the map alone if it
+ * already has an item with the same name, creates under the read lock can
+ * race for the name. hash is fs_dirmap_hash() of the item's name.
+ */
+bool fs_dirmap_put(fs_dirmap* map, struct fs_item* item, uint32_t hash) {
+    fs_epoch_enter();
+    fs_dirmap_shard* shard = lock_shard(map, hash);
+    fs_dirmap_table* table;
+    uint32_t slot;
+    bool found = find_any(shard, item->name, item->name_len, hash, &table, &slot);
+    if (!found) {
+        if (shard->table->growth_left == 0 && !start_resize(shard, cap_for((shard->size + 1) * 2)))
+            abort();
+
+        insert(shard->table, item, hash);
+        __atomic_store_n(&shard->size, shard->size + 1, __ATOMIC_RELAXED);
+        migrate(shard, MIGRATE_SCAN, MIGRATE_ITEMS);
+    }
+
+    if (shard->mask == 0 && shard->size > FS_DIRMAP_SPLIT) {
+        split(map, shard);
+    } else {
+        unlock_shard(shard);
+    }
+    fs_epoch_exit();
+    return !found;
+}
+
+/**
+ * Remove the item from the map. Returns false if it wasn't there
+ */
+bool fs_dirmap_del(fs_dirmap* map, const struct fs_item* item) {
+    uint32_t hash = fs_dirmap_hash(item->name, item->name_len);
+    fs_epoch_enter();
+    fs_dirmap_shard* shard = lock_shard(map, hash);
+    fs_dirmap_table* table;
+    uint32_t slot;
+    bool found = find_any(shard, item->name, item->name_len, hash, &table, &slot);
+    if (found) {
+        erase(table, slot);
+        __atomic_store_n(&shard->size, shard->size - 1, __ATOMIC_RELAXED);
+        if (shard->old != NULL) {
+            migrate(shard, MIGRATE_SCAN, MIGRATE_ITEMS);
+        } else if (shard->table->cap > shard->min_cap && shard->size < max_load(shard->table->cap) / 8) {
+            // shrinking is only an optimization so running out of memory is fine
+            uint32_t cap = cap_for((shard->size + 1) * 2);
+            start_resize(shard, cap > shard->min_cap ? cap : shard->min_cap);
+        }
+    }
+    unlock_shard(shard);
+    fs_epoch_exit();
+    return found;
+}
+
+/**
+ * Copy of the items in the map that can be used while the map is being
+ * modified. Each shard is copied at a single point in time. The items stay
+ * valid as long as the caller holds the fs lock. Returns NULL if out of
+ * memory, the array has to be freed by the caller.
+ */
+struct fs_item** fs_dirmap_snapshot(fs_dirmap* map, uint32_t* count) {
+    uint32_t cap = 16;
+    struct fs_item** items = malloc(sizeof(struct fs_item*) * cap);
+    *count = 0;
+    fs_epoch_enter();
+    // a split can happen only before we get the first shard
+    uint32_t shards = 1;
+    for (uint32_t ii = 0; ii < shards && items != NULL; ii++) {
+        fs_dirmap_shard* shard = lock_shard(map, ii << SHARD_SHIFT);
+        shards = shard->mask + 1;
+        if (*count + shard->size > cap) {
+            cap = *count + shard->size;
+            struct fs_item** new_items = realloc(items, sizeof(struct fs_item*) * cap);
+            if (new_items == NULL)
+                free(items);
+            items = new_items;
+        }
+        if (items != NULL) {
+            for (const fs_dirmap_table* table = shard->table; table != NULL; table = table == shard->table ? shard->old : NULL) {
+                for (uint32_t jj = 0; jj < table->cap; jj++) {
+                    if (fs_dirmap_full(table->ctrl[jj]))
+                        items[(*count)++] = table->slots[jj];
+                }
+            }
+        }
+        unlock_shard(shard);
+    }
+    fs_epoch_exit();
+    return items;
+}
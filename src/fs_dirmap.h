@@ -0,0 +1,87 @@
+#ifndef FS_DIRMAP_H
+#define FS_DIRMAP_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "util.h"
+
+struct fs_item;
+
+// slots that are probed with a single compare
+#define FS_DIRMAP_GROUP 16
+// control byte of a slot that was never used
+#define FS_DIRMAP_EMPTY 0x80
+// control byte of a slot whose item was removed
+#define FS_DIRMAP_DELETED 0xfe
+
+typedef struct fs_dirmap_table {
+    // number of slots, power of two and at least FS_DIRMAP_GROUP
+    uint32_t cap;
+    // inserts left before the table has to be rebuilt
+    uint32_t growth_left;
+    // 7 bit hash tag of each slot or one of the markers above. The first
+    // group is repeated at the end so groups can be loaded at any slot
+    uint8_t* ctrl;
+    struct fs_item** slots;
+} fs_dirmap_table;
+
+// items a directory gets before its map is split into shards
+#define FS_DIRMAP_SPLIT 128
+// shards of a split map, power of two
+#define FS_DIRMAP_SHARDS 8
+
+typedef struct fs_dirmap_shard {
+    fs_dirmap_table* table;
+    // table the items are being moved from while resizing, NULL otherwise
+    fs_dirmap_table* old;
+    // slots of the old table that have been moved
+    uint32_t moved;
+    uint32_t size;
+    // the table is not shrunk below this, see fs_dirmap_reserve
+    uint32_t min_cap;
+    // shard count - 1, the same in every shard of the map
+    uint32_t mask;
+    // odd while the shard is being modified. Writers take it like a lock and
+    // readers retry if it changed under them. Shards replaced by a split
+    // stay odd
+    uint32_t seq;
+} __attribute__((aligned(64))) fs_dirmap_shard;
+
+typedef struct fs_dirmap {
+    // a single shard until the directory gets FS_DIRMAP_SPLIT items
+    fs_dirmap_shard* shards;
+} fs_dirmap;
+
+uint32_t fs_dirmap_hash(const char* name, size_t len) __nonnull((1));
+void fs_dirmap_init(fs_dirmap* map) __nonnull((1));
+void fs_dirmap_term(fs_dirmap* map) __nonnull((1));
+bool fs_dirmap_reserve(fs_dirmap* map, uint32_t count) __nonnull((1));
+uint32_t fs_dirmap_size(const fs_dirmap* map) __nonnull((1));
+bool fs_dirmap_get(const fs_dirmap* map, const char* name, size_t len, uint32_t hash, struct fs_item** buf) __nonnull((1, 2, 5));
+bool fs_dirmap_get_rcu(const fs_dirmap* map, const char* name, size_t len, uint32_t hash, struct fs_item** buf) __nonnull((1, 2, 5));
+bool fs_dirmap_put(fs_dirmap* map, struct fs_item* item, uint32_t hash) __nonnull((1, 2));
+bool fs_dirmap_del(fs_dirmap* map, const struct fs_item* item) __nonnull((1, 2));
+struct fs_item** fs_dirmap_snapshot(fs_dirmap* map, uint32_t* count) __nonnull((1, 2));
+
+#define fs_dirmap_full(_ctrl) (((_ctrl)&0x80) == 0)
+
+/**
+ * Foreach loop over the items of the map. Goes through both tables while
+ * the map is being resized. The map can't be modified during the loop so
+ * the caller needs the fs write lock, see fs_dirmap_snapshot otherwise.
+ *
+ * fs_dirmap_foreach(&dir->items, item) {
+ *     printf("%s\n", item->name);
+ * }
+ */
+#define fs_dirmap_foreach(map, V)                                                      \
+    for (const fs_dirmap_shard* __s = (map)->shards;                                   \
+         __s != (map)->shards + (map)->shards->mask + 1; __s++)                        \
+        for (const fs_dirmap_table* __t = __s->table; __t != NULL;                     \
+             __t = __t == __s->table ? __s->old : NULL)                                \
+            for (uint32_t __i = 0, __b = 0; __i < __t->cap; __i++)                     \
+                for (__b = fs_dirmap_full(__t->ctrl[__i]);                             \
+                     __b && ((V) = __t->slots[__i], true); __b = 0)
+
+#endif
@@ -0,0 +1,205 @@
+#include "util.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+
+#include "fs_epoch.h"
+
+/**
+ * Epoch based reclamation.
+ *
+ * Requests that read the tree without the fs lock wrap the access in
+ * fs_epoch_enter() and fs_epoch_exit(). Memory that such a reader might
+ * still see (removed items, replaced file data, old directory map tables)
+ * is not freed right away but only after every reader that was active at
+ * the time has left.
+ *
+ * Each thread has a record with the epoch it entered in, 0 when outside.
+ * fs_epoch_synchronize() moves the global epoch forward and waits until no
+ * record has an older epoch left.
+ */
+
+// records are written on every enter so each gets its own cache line
+#define CACHE_LINE 64
+
+typedef struct epoch_record {
+    struct epoch_record* next;
+    // epoch the thread entered in, 0 if not inside
+    uint64_t epoch;
+    // fs_epoch_enter() calls can be nested
+    int depth;
+    bool in_use;
+    char pad[CACHE_LINE - sizeof(void*) - sizeof(uint64_t) - sizeof(int) - sizeof(bool)];
+} epoch_record;
+
+static uint64_t global_epoch = 1;
+// records are never freed while running, new threads reuse the records of
+// exited threads
+static epoch_record* records = NULL;
+static pthread_mutex_t records_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t record_key;
+
+// pointers waiting for the readers to leave
+static void** limbo = NULL;
+static size_t limbo_len = 0;
+static size_t limbo_cap = 0;
+static bool stopping = false;
+static pthread_mutex_t limbo_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t limbo_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t collect_thread;
+
+static void release_record(void* ptr) {
+    epoch_record* rec = ptr;
+    rec->depth = 0;
+    __atomic_store_n(&rec->epoch, 0, __ATOMIC_RELEASE);
+    __atomic_store_n(&rec->in_use, false, __ATOMIC_RELEASE);
+}
+
+static epoch_record* get_record() {
+    epoch_record* rec = pthread_getspecific(record_key);
+    if (rec != NULL)
+        return rec;
+
+    pthread_mutex_lock(&records_lock);
+    for (rec = records; rec != NULL; rec = rec->next) {
+        if (!__atomic_load_n(&rec->in_use, __ATOMIC_ACQUIRE))
+            break;
+    }
+    if (rec == NULL) {
+        void* mem;
+        posix_memalign(&mem, CACHE_LINE, sizeof(epoch_record));
+        rec = mem;
+        rec->epoch = 0;
+        rec->depth = 0;
+        rec->next = records;
+        records = rec;
+    }
+    rec->in_use = true;
+    pthread_mutex_unlock(&records_lock);
+
+    pthread_setspecific(record_key, rec);
+    return rec;
+}
+
+void fs_epoch_enter() {
+    epoch_record* rec = get_record();
+    if (rec->depth++ > 0)
+        return;
+
+    __atomic_store_n(&rec->epoch, __atomic_load_n(&global_epoch, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+    // the epoch needs to be visible before we load any pointers from the tree
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+void fs_epoch_exit() {
+    epoch_record* rec = pthread_getspecific(record_key);
+    if (--rec->depth > 0)
+        return;
+
+    __atomic_store_n(&rec->epoch, 0, __ATOMIC_RELEASE);
+}
+
+/**
+ * Wait for the readers other than self, which may be NULL
+ */
+static void wait_for_readers(const epoch_record* self) {
+    uint64_t target = __atomic_add_fetch(&global_epoch, 1, __ATOMIC_SEQ_CST);
+    pthread_mutex_lock(&records_lock);
+    for (epoch_record* rec = records; rec != NULL; rec = rec->next) {
+        if (rec == self)
+            continue;
+        uint64_t epoch;
+        while ((epoch = __atomic_load_n(&rec->epoch, __ATOMIC_SEQ_CST)) != 0 && epoch < target)
+            sched_yield();
+    }
+    pthread_mutex_unlock(&records_lock);
+}
+
+/**
+ * Wait until all the readers that might have seen memory unlinked before
+ * this call have left. Must not be called between enter and exit.
+ */
+void fs_epoch_synchronize() {
+    wait_for_readers(NULL);
+}
+
+/**
+ * Free the memory once the current readers have left.
+ */
+void fs_epoch_free(void* ptr) {
+    if (ptr == NULL)
+        return;
+
+    pthread_mutex_lock(&limbo_lock);
+    if (limbo_len == limbo_cap) {
+        size_t cap = limbo_cap == 0 ? 64 : limbo_cap * 2;
+        void** grown = realloc(limbo, sizeof(void*) * cap);
+        if (grown == NULL) {
+            pthread_mutex_unlock(&limbo_lock);
+            // no room to queue it, wait for the other readers here instead.
+            // The caller may be inside an epoch but is done with the memory
+            wait_for_readers(pthread_getspecific(record_key));
+            free(ptr);
+            return;
+        }
+        limbo = grown;
+        limbo_cap = cap;
+    }
+    limbo[limbo_len++] = ptr;
+    pthread_cond_signal(&limbo_cond);
+    pthread_mutex_unlock(&limbo_lock);
+}
+
+static void* collect_fn(void* unused) {
+    pthread_mutex_lock(&limbo_lock);
+    while (true) {
+        if (limbo_len == 0) {
+            if (stopping)
+                break;
+            pthread_cond_wait(&limbo_cond, &limbo_lock);
+            continue;
+        }
+
+        // take everything queued so far, one grace period covers all of it
+        void** batch = limbo;
+        size_t count = limbo_len;
+        limbo = NULL;
+        limbo_len = 0;
+        limbo_cap = 0;
+        pthread_mutex_unlock(&limbo_lock);
+
+        fs_epoch_synchronize();
+        for (size_t ii = 0; ii < count; ii++)
+            free(batch[ii]);
+        free(batch);
+
+        pthread_mutex_lock(&limbo_lock);
+    }
+    pthread_mutex_unlock(&limbo_lock);
+    return NULL;
+}
+
+void init_fs_epoch() {
+    pthread_key_create(&record_key, release_record);
+    stopping = false;
+    pthread_create(&collect_thread, NULL, collect_fn, NULL);
+}
+
+/**
+ * Free everything still waiting. There must not be any readers left.
+ */
+void free_fs_epoch() {
+    pthread_mutex_lock(&limbo_lock);
+    stopping = true;
+    pthread_cond_signal(&limbo_cond);
+    pthread_mutex_unlock(&limbo_lock);
+    pthread_join(collect_thread, NULL);
+
+    pthread_key_delete(record_key);
+    while (records != NULL) {
+        epoch_record* next = records->next;
+        free(records);
+        records = next;
+    }
+}
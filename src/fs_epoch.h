@@ -0,0 +1,13 @@
+#ifndef FS_EPOCH_H
+#define FS_EPOCH_H
+
+#include "util.h"
+
+void fs_epoch_enter();
+void fs_epoch_exit();
+void fs_epoch_synchronize();
+void fs_epoch_free(void* ptr);
+void init_fs_epoch();
+void free_fs_epoch();
+
+#endif
@@ -9,6 +9,7 @@
 #include <unistd.h>
 
 #include "fs_fh.h"
+#include "fs_reclaim.h"
 #include "sc_map.h"
 
 // pid is 32 bits so 64-32 = 32
@@ -29,15 +30,30 @@ typedef struct fs_fh_pid {
 
 struct sc_map_32v fs_pids;
 pthread_t clean_thread;
+// handles are looked up without the fs lock so they have their own
+static pthread_rwlock_t fh_lock = PTHREAD_RWLOCK_INITIALIZER;
 
 #define split_handle(_fh, _pid, _fd) \
     int _fd = (int)_fh;              \
     pid_t _pid = (pid_t)(_fh >> PID_OFFSET)
 
+/**
+ * Drop the references of all the files the process has open
+ */
+static void free_ffp(fs_fh_pid* ffp) {
+    fs_item* item;
+    sc_map_foreach_value(&ffp->items, item) {
+        fs_item_unref(item);
+    }
+    sc_map_term_32v(&ffp->items);
+    free(ffp);
+}
+
 static void* pid_clean_fn(void* unused) {
     pid_t pid;
     fs_fh_pid* pobj;
     while (true) {
+        pthread_rwlock_wrlock(&fh_lock);
         sc_map_foreach(&fs_pids, pid, pobj) {
             // If sig is 0, then no signal is sent, but existence and
             // permission checks are still performed; this can be used to check
@@ -45,11 +61,11 @@ static void* pid_clean_fn(void* unused) {
             // caller is per-mitted to signal.
             // TODO: what happens if we don't have a persmission to send a signal?
             if (kill(pid, 0) == -1) {
-                sc_map_term_32v(&pobj->items);
-                free(pobj);
+                free_ffp(pobj);
                 sc_map_del_32v(&fs_pids, pid);
             }
         }
+        pthread_rwlock_unlock(&fh_lock);
 
         sleep_ms(1000); // is 1 second too agressive?
     }
@@ -72,6 +88,7 @@ static file_handle add_file(pid_t pid, const fs_item* item) {
         sc_map_put_32v(&fs_pids, pid, ffp);
     }
 
+    fs_item_ref((fs_item*)item);
     sc_map_put_32v(&ffp->items, ffp->next_fd, (void*)item);
     file_handle handle = ((uint64_t)pid << PID_OFFSET) + ffp->next_fd;
     ffp->next_fd += 1;
@@ -81,29 +98,50 @@ static file_handle add_file(pid_t pid, const fs_item* item) {
 file_handle fs_fh_file_handle(const fs_item* item) {
     // TODO: too many files open error
     pid_t pid = fuse_get_context()->pid;
-    return add_file(pid, item);
+    pthread_rwlock_wrlock(&fh_lock);
+    file_handle fh = add_file(pid, item);
+    pthread_rwlock_unlock(&fh_lock);
+    return fh;
 }
 
+/**
+ * Close the handle. If the file was removed while open, it is reclaimed
+ * when the last handle is closed.
+ */
 void fs_fh_release_file(file_handle fh) {
     split_handle(fh, pid, fd);
+    fs_item* item = NULL;
+    pthread_rwlock_wrlock(&fh_lock);
     fs_fh_pid* ffp = sc_map_get_32v(&fs_pids, pid);
     if (sc_map_found(&fs_pids)) {
-        sc_map_del_32v(&ffp->items, fd);
+        item = sc_map_del_32v(&ffp->items, fd);
+        if (!sc_map_found(&ffp->items))
+            item = NULL;
     }
+    pthread_rwlock_unlock(&fh_lock);
+
+    if (item != NULL)
+        fs_item_unref(item);
 }
 
+/**
+ * The item stays valid as long as the handle is open
+ */
 int fs_fh_get_item(file_handle fh, fs_item** buf) {
     split_handle(fh, pid, fd);
-    fs_fh_pid* ffp = sc_map_get_32v(&fs_pids, pid);
-    if (!sc_map_found(&fs_pids))
-        return -EBADF; // process is terminated
-
-    fs_item* item = sc_map_get_32v(&ffp->items, fd);
-    if (!sc_map_found(&ffp->items))
-        return -EBADF; // file is closed
-
-    *buf = item;
-    return 0;
+    int ret = 0;
+    pthread_rwlock_rdlock(&fh_lock);
+    void* ffp;
+    void* item;
+    if (!sc_map_lookup_32v(&fs_pids, pid, &ffp)) {
+        ret = -EBADF; // process is terminated
+    } else if (!sc_map_lookup_32v(&((fs_fh_pid*)ffp)->items, fd, &item)) {
+        ret = -EBADF; // file is closed
+    } else {
+        *buf = item;
+    }
+    pthread_rwlock_unlock(&fh_lock);
+    return ret;
 }
 
 int fs_fh_get_file(file_handle fh, fs_file** buf) {
@@ -138,11 +176,12 @@ void init_fs_fh() {
 }
 
 void free_fs_fh() {
+    pthread_cancel(clean_thread);
+    pthread_join(clean_thread, NULL);
+
     fs_fh_pid* pid;
     sc_map_foreach_value(&fs_pids, pid) {
-        sc_map_term_32v(&pid->items);
-        free(pid);
+        free_ffp(pid);
     }
     sc_map_term_32v(&fs_pids);
-    pthread_cancel(clean_thread);
 }
@@ -0,0 +1,453 @@
+#include "util.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "fs_flush.h"
+#include "fs_reclaim.h"
+
+/**
+ * Write-behind of the changes to a directory on disk.
+ *
+ * With --write-behind=<dir> the changes made to the tree are queued while
+ * the request holds the fs lock and a flusher thread makes the same changes
+ * to the directory in the background. The requests return at memory speed
+ * and the directory catches up a moment later.
+ *
+ * The queue is replayed in order, so the changes to a file land in the
+ * order they were made. A write to a file is merged into the write still
+ * waiting in the queue if it overlaps or continues it and nothing was
+ * moved or removed since, otherwise it is queued on its own. The data is
+ * copied from the file when the write is replayed, so a file written in
+ * small pieces is flushed with a few large writes.
+ *
+ * Writers wait before taking the fs lock while more than the limit of
+ * written data is waiting for the flusher.
+ */
+
+// 256 MiB of data waiting for the flusher by default
+#define DEFAULT_LIMIT ((size_t)256 << 20)
+// file data is copied to the directory in pieces of this
+#define FLUSH_CHUNK (1 << 20)
+
+typedef enum FLUSH_TYPE {
+    FLUSH_MKDIR,
+    FLUSH_CREATE,
+    FLUSH_WRITE,
+    FLUSH_TRUNCATE,
+    FLUSH_RENAME,
+    FLUSH_REMOVE
+} FLUSH_TYPE;
+
+typedef struct fs_flush_op {
+    struct fs_flush_op* next;
+    FLUSH_TYPE type;
+    mode_t mode;
+    // file of a write, referenced until the write is replayed
+    fs_item* item;
+    // range of a write or the size of a truncate
+    off_t start;
+    off_t end;
+    // moves when the write was queued
+    uint64_t moves;
+    char* path;
+    // target of a rename
+    char* new_path;
+} fs_flush_op;
+
+static int backing_fd = -1;
+static size_t limit = DEFAULT_LIMIT;
+// bytes in the queued writes
+static size_t dirty = 0;
+// renames and removals so far, paths of the queued writes are only valid
+// as long as this doesn't change
+static uint64_t moves = 0;
+static fs_flush_op* head = NULL;
+static fs_flush_op* tail = NULL;
+static bool stopping = false;
+static pthread_mutex_t flush_lock = PTHREAD_MUTEX_INITIALIZER;
+// the flusher waits for ops on this and the writers for space
+static pthread_cond_t flush_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t space_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t flush_thread;
+static char chunk[FLUSH_CHUNK];
+
+/**
+ * Replay the changes to the tree in dir
+ */
+int fs_flush_enable(const char* dir) {
+    int fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0)
+        return -errno;
+
+    if (backing_fd >= 0)
+        close(backing_fd);
+    backing_fd = fd;
+    return 0;
+}
+
+bool fs_flush_enabled() {
+    return backing_fd >= 0;
+}
+
+/**
+ * Bytes of written data that can wait for the flusher before writers have
+ * to wait
+ */
+void fs_flush_set_limit(size_t bytes) {
+    limit = bytes;
+}
+
+static fs_flush_op* new_op(FLUSH_TYPE type, const char* path) {
+    fs_flush_op* op = calloc(1, sizeof(fs_flush_op));
+    if (op != NULL) {
+        op->type = type;
+        op->path = strdup(path);
+        if (op->path == NULL) {
+            free(op);
+            op = NULL;
+        }
+    }
+    // the directory won't have the change but there isn't much else to do
+    if (op == NULL)
+        fprintf(stderr, "no memory to write '%s' behind\n", path);
+    return op;
+}
+
+static void free_op(fs_flush_op* op) {
+    free(op->path);
+    free(op->new_path);
+    free(op);
+}
+
+/**
+ * Caller holds the flush lock
+ */
+static void queue_op(fs_flush_op* op) {
+    if (tail != NULL) {
+        tail->next = op;
+    } else {
+        head = op;
+    }
+    tail = op;
+    pthread_cond_signal(&flush_cond);
+}
+
+void fs_flush_create(const char* path, mode_t mode) {
+    if (!fs_flush_enabled())
+        return;
+
+    fs_flush_op* op = new_op(S_ISDIR(mode) ? FLUSH_MKDIR : FLUSH_CREATE, path);
+    if (op == NULL)
+        return;
+    op->mode = mode;
+    pthread_mutex_lock(&flush_lock);
+    queue_op(op);
+    pthread_mutex_unlock(&flush_lock);
+}
+
+/**
+ * Queue a write to a file in the tree. Needs the fs write lock
+ */
+void fs_flush_write(fs_file* file, off_t offset, size_t size) {
+    if (!fs_flush_enabled() || size == 0)
+        return;
+
+    off_t end = offset + (off_t)size;
+    pthread_mutex_lock(&flush_lock);
+    fs_flush_op* op = file->flush;
+    if (op != NULL && op->moves == moves && offset <= op->end && end >= op->start) {
+        dirty -= op->end - op->start;
+        op->start = offset < op->start ? offset : op->start;
+        op->end = end > op->end ? end : op->end;
+        dirty += op->end - op->start;
+        pthread_mutex_unlock(&flush_lock);
+        return;
+    }
+
+    char path[PATH_LEN_MAX + 1];
+    op = fs_item_path(file->item, path) < 0 ? NULL : new_op(FLUSH_WRITE, path);
+    if (op != NULL) {
+        fs_item_ref(file->item);
+        op->item = file->item;
+        op->mode = file->item->st.st_mode;
+        op->start = offset;
+        op->end = end;
+        op->moves = moves;
+        file->flush = op;
+        dirty += size;
+        queue_op(op);
+    }
+    pthread_mutex_unlock(&flush_lock);
+}
+
+/**
+ * Queue setting the size of a file in the tree. Needs the fs write lock
+ */
+void fs_flush_truncate(fs_file* file, off_t size) {
+    if (!fs_flush_enabled())
+        return;
+
+    char path[PATH_LEN_MAX + 1];
+    fs_flush_op* op = fs_item_path(file->item, path) < 0 ? NULL : new_op(FLUSH_TRUNCATE, path);
+    if (op == NULL)
+        return;
+    op->mode = file->item->st.st_mode;
+    op->start = size;
+    pthread_mutex_lock(&flush_lock);
+    // the writes before must not be merged with the ones after
+    file->flush = NULL;
+    queue_op(op);
+    pthread_mutex_unlock(&flush_lock);
+}
+
+void fs_flush_rename(const char* oldpath, const char* newpath) {
+    if (!fs_flush_enabled())
+        return;
+
+    fs_flush_op* op = new_op(FLUSH_RENAME, oldpath);
+    if (op != NULL && (op->new_path = strdup(newpath)) == NULL) {
+        free_op(op);
+        op = NULL;
+    }
+    pthread_mutex_lock(&flush_lock);
+    moves++;
+    if (op != NULL)
+        queue_op(op);
+    pthread_mutex_unlock(&flush_lock);
+}
+
+/**
+ * Queue removing the item and everything under it. Called before the item
+ * is detached from the tree
+ */
+void fs_flush_remove(const fs_item* item) {
+    if (!fs_flush_enabled())
+        return;
+
+    char path[PATH_LEN_MAX + 1];
+    fs_flush_op* op = fs_item_path(item, path) < 0 ? NULL : new_op(FLUSH_REMOVE, path);
+    pthread_mutex_lock(&flush_lock);
+    moves++;
+    if (op != NULL)
+        queue_op(op);
+    pthread_mutex_unlock(&flush_lock);
+}
+
+/**
+ * Wait until the flusher has caught up with the limit. Called by writers
+ * before they take the fs lock
+ */
+void fs_flush_wait() {
+    if (!fs_flush_enabled())
+        return;
+
+    pthread_mutex_lock(&flush_lock);
+    while (dirty > limit && !stopping)
+        pthread_cond_wait(&space_cond, &flush_lock);
+    pthread_mutex_unlock(&flush_lock);
+}
+
+/**
+ * Path in the directory from a path of the tree
+ */
+static const char* relative(const char* path) {
+    while (*path == '/')
+        path++;
+    return path;
+}
+
+/**
+ * Create the missing directories of the path, for items the flusher didn't
+ * see created, like the ones restored from an image
+ */
+static void make_parents(const char* path) {
+    char dir[PATH_LEN_MAX + 1];
+    snprintf(dir, sizeof(dir), "%s", path);
+    for (char* sep = strchr(dir, '/'); sep != NULL; sep = strchr(sep + 1, '/')) {
+        *sep = '\0';
+        mkdirat(backing_fd, dir, 0755);
+        *sep = '/';
+    }
+}
+
+static int open_backing(const char* path, int flags, mode_t mode) {
+    int fd = openat(backing_fd, path, flags | O_NOFOLLOW | O_CLOEXEC, mode & 07777);
+    if (fd < 0 && errno == ENOENT && (flags & O_CREAT)) {
+        make_parents(path);
+        fd = openat(backing_fd, path, flags | O_NOFOLLOW | O_CLOEXEC, mode & 07777);
+    }
+    return fd < 0 ? -errno : fd;
+}
+
+static int remove_tree(int dir_fd, const char* name) {
+    if (unlinkat(dir_fd, name, 0) == 0 || errno == ENOENT)
+        return 0;
+    if (errno != EISDIR && errno != EPERM)
+        return -errno;
+
+    int fd = openat(dir_fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    DIR* stream = fd < 0 ? NULL : fdopendir(fd);
+    if (stream == NULL) {
+        int ret = -errno;
+        if (fd >= 0)
+            close(fd);
+        return ret;
+    }
+
+    int ret = 0;
+    struct dirent* entry;
+    while (ret == 0 && (entry = readdir(stream)) != NULL) {
+        if (strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0)
+            ret = remove_tree(dirfd(stream), entry->d_name);
+    }
+    closedir(stream);
+    if (ret == 0 && unlinkat(dir_fd, name, AT_REMOVEDIR) != 0)
+        ret = -errno;
+    return ret;
+}
+
+/**
+ * Copy the written range from the file as it is now. If the file was cut
+ * since, the truncate after the write in the queue sets the size
+ */
+static int replay_write(const fs_flush_op* op, const char* path) {
+    int fd = open_backing(path, O_WRONLY | O_CREAT, op->mode);
+    if (fd < 0)
+        return fd;
+
+    int ret = 0;
+    for (off_t pos = op->start; ret == 0 && pos < op->end;) {
+        size_t len = op->end - pos < FLUSH_CHUNK ? op->end - pos : FLUSH_CHUNK;
+        fs_rdlock();
+        int got = fs_item_read(op->item, chunk, len, pos);
+        fs_unlock();
+        if (got <= 0) {
+            ret = got;
+            break;
+        }
+        if (pwrite(fd, chunk, got, pos) != got)
+            ret = errno != 0 ? -errno : -EIO;
+        pos += got;
+    }
+    close(fd);
+    return ret;
+}
+
+static int replay(const fs_flush_op* op) {
+    const char* path = relative(op->path);
+    const char* new_path = op->new_path != NULL ? relative(op->new_path) : NULL;
+    int ret = 0;
+    int fd;
+    switch (op->type) {
+    case FLUSH_MKDIR:
+        ret = mkdirat(backing_fd, path, op->mode & 07777) == 0 ? 0 : -errno;
+        if (ret == -ENOENT) {
+            make_parents(path);
+            ret = mkdirat(backing_fd, path, op->mode & 07777) == 0 ? 0 : -errno;
+        }
+        if (ret == -EEXIST)
+            ret = 0;
+        break;
+    case FLUSH_CREATE:
+        fd = open_backing(path, O_WRONLY | O_CREAT | O_TRUNC, op->mode);
+        if (fd < 0)
+            return fd;
+        close(fd);
+        break;
+    case FLUSH_WRITE:
+        ret = replay_write(op, path);
+        break;
+    case FLUSH_TRUNCATE:
+        fd = open_backing(path, O_WRONLY | O_CREAT, op->mode);
+        if (fd < 0)
+            return fd;
+        if (ftruncate(fd, op->start) != 0)
+            ret = -errno;
+        close(fd);
+        break;
+    case FLUSH_RENAME:
+        ret = renameat(backing_fd, path, backing_fd, new_path) == 0 ? 0 : -errno;
+        if (ret == -ENOENT) {
+            make_parents(new_path);
+            ret = renameat(backing_fd, path, backing_fd, new_path) == 0 ? 0 : -errno;
+        }
+        break;
+    case FLUSH_REMOVE:
+        ret = remove_tree(backing_fd, path);
+        break;
+    }
+    return ret;
+}
+
+static void* flush_fn(void* unused) {
+    pthread_mutex_lock(&flush_lock);
+    while (true) {
+        if (head == NULL) {
+            if (stopping)
+                break;
+            pthread_cond_wait(&flush_cond, &flush_lock);
+            continue;
+        }
+
+        fs_flush_op* batch = head;
+        head = NULL;
+        tail = NULL;
+        // writes from now on are queued after the batch
+        for (fs_flush_op* op = batch; op != NULL; op = op->next) {
+            if (op->type == FLUSH_WRITE && fs_item_file(op->item).flush == op)
+                fs_item_file(op->item).flush = NULL;
+        }
+        pthread_mutex_unlock(&flush_lock);
+
+        while (batch != NULL) {
+            fs_flush_op* op = batch;
+            batch = op->next;
+            int ret = replay(op);
+            if (ret != 0)
+                fprintf(stderr, "writing '%s' behind failed: %s\n", op->path, strerror(-ret));
+
+            if (op->type == FLUSH_WRITE) {
+                fs_item_unref(op->item);
+                pthread_mutex_lock(&flush_lock);
+                dirty -= op->end - op->start;
+                pthread_cond_broadcast(&space_cond);
+                pthread_mutex_unlock(&flush_lock);
+            }
+            free_op(op);
+        }
+
+        pthread_mutex_lock(&flush_lock);
+    }
+    pthread_mutex_unlock(&flush_lock);
+    return NULL;
+}
+
+void init_fs_flush() {
+    if (!fs_flush_enabled())
+        return;
+
+    stopping = false;
+    pthread_create(&flush_thread, NULL, flush_fn, NULL);
+}
+
+/**
+ * Replay what is still queued and stop the flusher
+ */
+void free_fs_flush() {
+    if (!fs_flush_enabled())
+        return;
+
+    pthread_mutex_lock(&flush_lock);
+    stopping = true;
+    pthread_cond_signal(&flush_cond);
+    pthread_cond_broadcast(&space_cond);
+    pthread_mutex_unlock(&flush_lock);
+    pthread_join(flush_thread, NULL);
+}
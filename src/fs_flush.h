@@ -0,0 +1,22 @@
+#ifndef FS_FLUSH_H
+#define FS_FLUSH_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#include "fs.h"
+#include "util.h"
+
+int fs_flush_enable(const char* dir) __nonnull((1));
+bool fs_flush_enabled();
+void fs_flush_set_limit(size_t bytes);
+void fs_flush_create(const char* path, mode_t mode) __nonnull((1));
+void fs_flush_write(fs_file* file, off_t offset, size_t size) __nonnull((1));
+void fs_flush_truncate(fs_file* file, off_t size) __nonnull((1));
+void fs_flush_rename(const char* oldpath, const char* newpath) __nonnull((1, 2));
+void fs_flush_remove(const fs_item* item) __nonnull((1));
+void fs_flush_wait();
+void init_fs_flush();
+void free_fs_flush();
+
+#endif
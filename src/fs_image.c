@@ -0,0 +1,321 @@
+#include "util.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "fs.h"
+#include "fs_image.h"
+
+/**
+ * Images of the whole tree for restarting the daemon.
+ *
+ * The tree is written as a flat list of records in depth first order, each
+ * referring to its directory by the index of the directory's record instead
+ * of a pointer. Directories always come before their items so the tree can
+ * be rebuilt in one pass over the mapped file, with the file data copied
+ * straight from it.
+ *
+ * Record 0 is the root. Every record is followed by the name and, for files,
+ * the data, padded to 8 bytes.
+ */
+
+#define IMAGE_MAGIC "fsimg001"
+#define IMAGE_ALIGN 8
+// file data is copied in and out in pieces of this
+#define IMAGE_CHUNK (1 << 20)
+
+typedef struct image_header {
+    char magic[8];
+    uint64_t items;
+    // of the whole image, catches images that weren't written completely
+    uint64_t size;
+} image_header;
+
+typedef struct image_item {
+    // index of the directory record, always smaller than the item's own
+    uint64_t parent;
+    // bytes of file data after the name
+    uint64_t size;
+    int64_t atime;
+    int64_t mtime;
+    int64_t ctime;
+    uint32_t mode;
+    uint32_t uid;
+    uint32_t gid;
+    uint32_t ttl;
+    uint8_t name_len;
+    uint8_t pad[7];
+} image_item;
+
+#define image_padding(_len) ((IMAGE_ALIGN - (_len) % IMAGE_ALIGN) % IMAGE_ALIGN)
+
+typedef struct image_writer {
+    FILE* out;
+    uint64_t items;
+    uint64_t size;
+    char* chunk;
+} image_writer;
+
+static int write_bytes(image_writer* w, const void* data, size_t len) {
+    if (len != 0 && fwrite(data, 1, len, w->out) != len)
+        return -EIO;
+    w->size += len;
+    return 0;
+}
+
+static int write_padding(image_writer* w, size_t len) {
+    static const char zeros[IMAGE_ALIGN] = { 0 };
+    return write_bytes(w, zeros, image_padding(len));
+}
+
+static int write_item(image_writer* w, fs_item* item, uint64_t parent) {
+    uint64_t index = w->items++;
+    struct stat st;
+    fs_item_stat(item, &st);
+
+    image_item rec = {
+        .parent = parent,
+        .size = fs_item_is_file(item) ? (uint64_t)st.st_size : 0,
+        .atime = st.st_atime,
+        .mtime = st.st_mtime,
+        .ctime = st.st_ctime,
+        .mode = st.st_mode,
+        .uid = st.st_uid,
+        .gid = st.st_gid,
+        .ttl = item->timer.ttl,
+        // the root is saved without a name
+        .name_len = item->parent == NULL ? 0 : item->name_len,
+    };
+    int ret = write_bytes(w, &rec, sizeof(rec));
+    if (ret == 0)
+        ret = write_bytes(w, item->name, rec.name_len);
+    if (ret == 0)
+        ret = write_padding(w, rec.name_len);
+
+    for (uint64_t done = 0; ret == 0 && done < rec.size;) {
+        size_t len = rec.size - done < IMAGE_CHUNK ? rec.size - done : IMAGE_CHUNK;
+        int read = fs_item_read(item, w->chunk, len, done);
+        if (read <= 0)
+            return read < 0 ? read : -EIO;
+        ret = write_bytes(w, w->chunk, read);
+        done += read;
+    }
+    if (ret == 0)
+        ret = write_padding(w, rec.size);
+
+    if (fs_item_is_dir(item)) {
+        fs_item* child;
+        fs_foreach_val(&fs_item_dir(item).items, child) {
+            if (ret == 0)
+                ret = write_item(w, child, index);
+        }
+    }
+    return ret;
+}
+
+/**
+ * Write the whole tree to path. The image is written next to it first and
+ * renamed over it so a crash never leaves a partial image. Needs the fs
+ * write lock
+ */
+int fs_image_save(const char* path) {
+    path_string root_path;
+    fs_item* root;
+    int ret = parse_path_string(&root_path, "/");
+    if (ret == 0)
+        ret = fs_lookup(&root_path, &root);
+    if (ret != 0)
+        return ret;
+
+    size_t path_len = strlen(path);
+    char* tmp_path = malloc(path_len + sizeof(".tmp"));
+    image_writer w = { .out = NULL, .items = 0, .size = 0, .chunk = malloc(IMAGE_CHUNK) };
+    if (tmp_path == NULL || w.chunk == NULL) {
+        free(tmp_path);
+        free(w.chunk);
+        return -ENOMEM;
+    }
+    memcpy(tmp_path, path, path_len);
+    memcpy(&tmp_path[path_len], ".tmp", sizeof(".tmp"));
+
+    w.out = fopen(tmp_path, "w");
+    if (w.out == NULL) {
+        ret = -errno;
+    } else {
+        // the header is written again at the end with the counts
+        image_header header = { .magic = IMAGE_MAGIC, .items = 0, .size = 0 };
+        ret = write_bytes(&w, &header, sizeof(header));
+        if (ret == 0)
+            ret = write_item(&w, root, 0);
+
+        header.items = w.items;
+        header.size = w.size;
+        if (ret == 0 && (fseek(w.out, 0, SEEK_SET) != 0 || fwrite(&header, sizeof(header), 1, w.out) != 1))
+            ret = -EIO;
+        if (fclose(w.out) != 0 && ret == 0)
+            ret = -EIO;
+        if (ret == 0 && rename(tmp_path, path) != 0)
+            ret = -errno;
+        if (ret != 0)
+            unlink(tmp_path);
+    }
+
+    free(tmp_path);
+    free(w.chunk);
+    return ret;
+}
+
+/**
+ * Walk the records of the image, checking that they are all in bounds and
+ * refer to directories before them. Returns the offset of each record in
+ * offsets
+ */
+static int check_image(const char* image, size_t size, uint64_t* offsets) {
+    const image_header* header = (const image_header*)image;
+    size_t pos = sizeof(image_header);
+    for (uint64_t ii = 0; ii < header->items; ii++) {
+        if (size - pos < sizeof(image_item))
+            return -EINVAL;
+
+        const image_item* rec = (const image_item*)&image[pos];
+        size_t name_len = rec->name_len + image_padding(rec->name_len);
+        if ((ii == 0) != (rec->name_len == 0) || (ii == 0 && !S_ISDIR(rec->mode)))
+            return -EINVAL;
+        if (ii != 0 && (rec->parent >= ii || !S_ISDIR(((const image_item*)&image[offsets[rec->parent]])->mode)))
+            return -EINVAL;
+        if (!(S_ISDIR(rec->mode) || S_ISREG(rec->mode)) || (S_ISDIR(rec->mode) && rec->size != 0) || rec->size > size)
+            return -EINVAL;
+
+        offsets[ii] = pos;
+        pos += sizeof(image_item);
+        if (size - pos < name_len || size - pos - name_len < rec->size + image_padding(rec->size))
+            return -EINVAL;
+        pos += name_len + rec->size + image_padding(rec->size);
+    }
+    return pos == size ? 0 : -EINVAL;
+}
+
+static void item_stat(const image_item* rec, struct stat* st) {
+    st->st_mode = rec->mode;
+    st->st_uid = rec->uid;
+    st->st_gid = rec->gid;
+    st->st_atime = rec->atime;
+    st->st_mtime = rec->mtime;
+    st->st_ctime = rec->ctime;
+}
+
+/**
+ * Map the image at path and check its records. Returns the offset of each
+ * record in offsets, which the caller frees along with unmapping the image
+ */
+static int map_image(const char* path, const char** buf, size_t* buf_size, uint64_t** offsets) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return -errno;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(image_header)) {
+        close(fd);
+        return -EINVAL;
+    }
+    size_t size = st.st_size;
+    const char* image = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (image == MAP_FAILED)
+        return -errno;
+
+    const image_header* header = (const image_header*)image;
+    *offsets = NULL;
+    int ret = 0;
+    // each record takes at least its own size
+    if (memcmp(header->magic, IMAGE_MAGIC, sizeof(header->magic)) != 0 || header->size != size
+        || header->items == 0 || header->items > size / sizeof(image_item)) {
+        ret = -EINVAL;
+    } else {
+        *offsets = malloc(header->items * sizeof(uint64_t));
+        if (*offsets == NULL)
+            ret = -ENOMEM;
+    }
+    if (ret == 0)
+        ret = check_image(image, size, *offsets);
+
+    if (ret != 0) {
+        free(*offsets);
+        munmap((void*)image, size);
+        return ret;
+    }
+    *buf = image;
+    *buf_size = size;
+    return 0;
+}
+
+/**
+ * Check that the image at path can be restored, without touching the tree
+ */
+int fs_image_check(const char* path) {
+    const char* image;
+    size_t size;
+    uint64_t* offsets;
+    int ret = map_image(path, &image, &size, &offsets);
+    if (ret == 0) {
+        free(offsets);
+        munmap((void*)image, size);
+    }
+    return ret;
+}
+
+/**
+ * Rebuild the tree from the image at path. The records are checked before
+ * anything is created. Needs the fs write lock and an empty tree
+ */
+int fs_image_load(const char* path) {
+    const char* image;
+    size_t size;
+    uint64_t* offsets;
+    int ret = map_image(path, &image, &size, &offsets);
+    if (ret != 0)
+        return ret;
+
+    const image_header* header = (const image_header*)image;
+    fs_item** items = malloc(header->items * sizeof(fs_item*));
+    if (items == NULL)
+        ret = -ENOMEM;
+
+    path_string root_path;
+    if (ret == 0)
+        ret = parse_path_string(&root_path, "/");
+    if (ret == 0)
+        ret = fs_lookup(&root_path, &items[0]);
+
+    for (uint64_t ii = 1; ret == 0 && ii < header->items; ii++) {
+        const image_item* rec = (const image_item*)&image[offsets[ii]];
+        const char* name = (const char*)(rec + 1);
+        ret = fs_add_child(items[rec->parent], name, rec->name_len, rec->mode, &items[ii]);
+        const char* data = name + rec->name_len + image_padding(rec->name_len);
+        for (uint64_t done = 0; ret == 0 && done < rec->size;) {
+            size_t len = rec->size - done < IMAGE_CHUNK ? rec->size - done : IMAGE_CHUNK;
+            int written = fs_item_write(items[ii], &data[done], len, done);
+            ret = written < 0 ? written : 0;
+            done += len;
+        }
+    }
+
+    // adding the items touched the directories so the times go last
+    for (uint64_t ii = 0; ret == 0 && ii < header->items; ii++) {
+        const image_item* rec = (const image_item*)&image[offsets[ii]];
+        struct stat item_st;
+        item_stat(rec, &item_st);
+        fs_item_restore(items[ii], &item_st, rec->ttl);
+    }
+
+    free(offsets);
+    free(items);
+    munmap((void*)image, size);
+    return ret;
+}
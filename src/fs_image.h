@@ -0,0 +1,10 @@
+#ifndef FS_IMAGE_H
+#define FS_IMAGE_H
+
+#include "util.h"
+
+int fs_image_save(const char* path) __nonnull((1));
+int fs_image_load(const char* path) __nonnull((1));
+int fs_image_check(const char* path) __nonnull((1));
+
+#endif
@@ -0,0 +1,141 @@
+#ifndef FS_IOCTL_H
+#define FS_IOCTL_H
+
+#include <stdint.h>
+#include <sys/ioctl.h>
+
+/**
+ * ioctl commands supported by the filesystem. These are shared with the
+ * programs using the mount so keep this header free of the fs internals.
+ *
+ * Usage:
+ *
+ * uint32_t ttl = 60 * 60;
+ * int fd = open("/mnt/scratch", O_RDONLY);
+ * ioctl(fd, FS_IOC_SET_TTL, &ttl);
+ */
+
+#define FS_IOC_MAGIC 'N'
+// same as FILE_NAME_MAX in util.h
+#define FS_IOC_NAME_MAX 255
+// largest count FS_IOC_RESERVE accepts. The tables for it take about a MiB,
+// bigger directories grow on their own as before
+#define FS_IOC_RESERVE_MAX (1u << 16)
+
+struct fs_ioc_rmtree {
+    // name of the item in the directory the ioctl is called on
+    char name[FS_IOC_NAME_MAX + 1];
+};
+
+struct fs_ioc_archive {
+    // tar archive in the calling process, read or written from its offset
+    // like with read and write. The fs gets it with pidfd_getfd so the fs
+    // needs to be allowed to ptrace the caller
+    int32_t fd;
+    uint32_t pad;
+    // set to the number of items created or written
+    uint64_t items;
+};
+
+struct fs_ioc_scan {
+    // fd in the calling process the records are written to, from its offset
+    // like with write
+    int32_t fd;
+    uint32_t pad;
+    // set to the number of records written
+    uint64_t items;
+};
+
+// record written by FS_IOC_SCAN, followed by the path and padding to
+// FS_IOC_SCAN_ALIGN bytes. The next record starts after that
+struct fs_ioc_scan_record {
+    uint64_t size;
+    int64_t mtime;
+    uint32_t mode;
+    uint32_t nlink;
+    // of the path below the directory, not terminated
+    uint16_t path_len;
+    uint16_t pad[3];
+};
+
+#define FS_IOC_SCAN_ALIGN 8
+#define fs_ioc_scan_next(_rec) \
+    ((const struct fs_ioc_scan_record*)((const char*)((_rec) + 1) + (((_rec)->path_len + FS_IOC_SCAN_ALIGN - 1) & ~(FS_IOC_SCAN_ALIGN - 1))))
+
+#define FS_IOC_JOURNAL_BUF 8192
+
+struct fs_ioc_journal {
+    // seq of the first record wanted, 0 for the oldest one kept. Set to the
+    // cursor for the next call
+    uint64_t cursor;
+    // set to the number of records dropped from the journal before they
+    // were read, the tree needs to be scanned again if not 0
+    uint64_t lost;
+    // set to the bytes of records in buf
+    uint32_t len;
+    uint32_t pad;
+    char buf[FS_IOC_JOURNAL_BUF];
+};
+
+enum {
+    FS_JOURNAL_CREATE = 1,
+    FS_JOURNAL_REMOVE,
+    // the data or the size of the file changed
+    FS_JOURNAL_WRITE,
+    // the mode, owner or times changed
+    FS_JOURNAL_ATTR,
+    // a rename is recorded as the old name followed by the new one
+    FS_JOURNAL_RENAME_FROM,
+    FS_JOURNAL_RENAME_TO,
+};
+
+// record in fs_ioc_journal.buf, followed by the name and padding to
+// FS_IOC_JOURNAL_ALIGN bytes. The inodes number the items within a mount,
+// they are not the ones shown by stat
+struct fs_ioc_journal_record {
+    uint64_t seq;
+    uint64_t ino;
+    // inode of the directory of the item
+    uint64_t parent;
+    uint32_t op;
+    // of the name in the directory, not terminated
+    uint16_t name_len;
+    uint16_t pad;
+};
+
+#define FS_IOC_JOURNAL_ALIGN 8
+#define fs_ioc_journal_next(_rec) \
+    ((const struct fs_ioc_journal_record*)((const char*)((_rec) + 1) + (((_rec)->name_len + FS_IOC_JOURNAL_ALIGN - 1) & ~(FS_IOC_JOURNAL_ALIGN - 1))))
+
+// Set the time-to-live (in seconds) of the item. Files are removed once they
+// haven't been modified in ttl seconds. Directories pass the ttl on to the
+// items created inside them. 0 removes the ttl.
+#define FS_IOC_SET_TTL _IOW(FS_IOC_MAGIC, 1, uint32_t)
+// Get the time-to-live of the item. 0 if not set
+#define FS_IOC_GET_TTL _IOR(FS_IOC_MAGIC, 2, uint32_t)
+// Remove an item and everything under it in a single call.
+// Called on the directory containing the item.
+#define FS_IOC_RMTREE _IOW(FS_IOC_MAGIC, 3, struct fs_ioc_rmtree)
+// Size the directory for the given number of items so it doesn't need to be
+// resized while they are created. Meant to be called right after mkdir.
+#define FS_IOC_RESERVE _IOW(FS_IOC_MAGIC, 4, uint32_t)
+// Create the files and directories of a tar archive in the directory in a
+// single call. Existing directories are merged. Like with tar x, an entry
+// replaces an existing file or empty directory of its name, including the
+// ones from earlier entries, and a non-empty directory is an error.
+#define FS_IOC_IMPORT _IOWR(FS_IOC_MAGIC, 5, struct fs_ioc_archive)
+// Write a tar archive of everything under the directory in a single call.
+// Each directory is listed at once, the files have the data they have when
+// they are written out.
+#define FS_IOC_EXPORT _IOWR(FS_IOC_MAGIC, 6, struct fs_ioc_archive)
+// Write a record with the path, mode, size, mtime and nlink of every item
+// under the directory in a single call. Directories come before their
+// items, each directory is read at once.
+#define FS_IOC_SCAN _IOWR(FS_IOC_MAGIC, 7, struct fs_ioc_scan)
+// Read the changes made to the tree since the cursor, needs --journal. Works
+// on any handle, for the user who mounted the fs and root. Consecutive
+// writes or attribute changes of an item that weren't read yet are one
+// record, removing a directory records only the directory itself.
+#define FS_IOC_JOURNAL _IOWR(FS_IOC_MAGIC, 8, struct fs_ioc_journal)
+
+#endif
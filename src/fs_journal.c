@@ -0,0 +1,142 @@
+#include "util.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "fs_journal.h"
+
+/**
+ * Journal of the changes to the tree, see FS_IOC_JOURNAL.
+ *
+ * With --journal=<records> every change appends a record with an increasing
+ * seq to a ring of that many records, overwriting the oldest. Readers keep
+ * the seq they got to as a cursor and find out from it when they fell
+ * behind and missed records.
+ *
+ * Writes and attribute changes that follow one of the same item are folded
+ * into it as long as no reader has got past it, so a file written in many
+ * pieces doesn't push everything else out.
+ */
+
+typedef struct journal_record {
+    uint64_t seq;
+    uint64_t ino;
+    uint64_t parent;
+    uint32_t op;
+    uint8_t name_len;
+    char name[FILE_NAME_MAX];
+} journal_record;
+
+static size_t size = 0;
+static journal_record* ring = NULL;
+// seq of the next record, the first one is 1
+static uint64_t next_seq = 1;
+// highest seq a reader has got, records after it can still be folded
+static uint64_t read_seq = 0;
+static pthread_mutex_t journal_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Keep the last records changes, up to FS_JOURNAL_MAX. The ring is taken
+ * here so the mount fails if there is no memory for it
+ */
+int fs_journal_set_size(size_t records) {
+    if (records == 0 || records > FS_JOURNAL_MAX)
+        return -EINVAL;
+
+    journal_record* new_ring = calloc(records, sizeof(journal_record));
+    if (new_ring == NULL)
+        return -ENOMEM;
+    free(ring);
+    ring = new_ring;
+    size = records;
+    return 0;
+}
+
+bool fs_journal_enabled() {
+    return ring != NULL;
+}
+
+static uint64_t oldest_seq() {
+    return next_seq > size ? next_seq - size : 1;
+}
+
+/**
+ * Record a change of the item under its current name. The item has to be in
+ * the tree, the root has no parent. Needs the fs lock
+ */
+void fs_journal_add(uint32_t op, const fs_item* item) {
+    if (ring == NULL)
+        return;
+
+    pthread_mutex_lock(&journal_lock);
+    // the last record is after read_seq only if there is one
+    const journal_record* last = &ring[(next_seq - 2) % size];
+    bool fold = (op == FS_JOURNAL_WRITE || op == FS_JOURNAL_ATTR) && next_seq - 1 > read_seq
+        && last->op == op && last->ino == item->st.st_ino;
+    if (!fold) {
+        journal_record* rec = &ring[(next_seq - 1) % size];
+        rec->seq = next_seq++;
+        rec->ino = item->st.st_ino;
+        rec->parent = item->parent != NULL ? item->parent->st.st_ino : 0;
+        rec->op = op;
+        rec->name_len = item->name_len;
+        memcpy(rec->name, item->name, item->name_len);
+    }
+    pthread_mutex_unlock(&journal_lock);
+}
+
+/**
+ * Copy the records from the cursor on into the request, as many as fit
+ */
+int fs_journal_read(struct fs_ioc_journal* req) {
+    if (ring == NULL)
+        return -ENOTSUP;
+
+    pthread_mutex_lock(&journal_lock);
+    uint64_t oldest = oldest_seq();
+    uint64_t seq = req->cursor == 0 ? oldest : req->cursor;
+    if (seq > next_seq) {
+        pthread_mutex_unlock(&journal_lock);
+        return -EINVAL;
+    }
+    req->lost = seq < oldest ? oldest - seq : 0;
+    if (seq < oldest)
+        seq = oldest;
+
+    req->len = 0;
+    for (; seq < next_seq; seq++) {
+        const journal_record* rec = &ring[(seq - 1) % size];
+        size_t len = sizeof(struct fs_ioc_journal_record) + rec->name_len;
+        len += (FS_IOC_JOURNAL_ALIGN - len % FS_IOC_JOURNAL_ALIGN) % FS_IOC_JOURNAL_ALIGN;
+        if (sizeof(req->buf) - req->len < len)
+            break;
+
+        struct fs_ioc_journal_record* out = (struct fs_ioc_journal_record*)&req->buf[req->len];
+        memset(out, 0, len);
+        out->seq = rec->seq;
+        out->ino = rec->ino;
+        out->parent = rec->parent;
+        out->op = rec->op;
+        out->name_len = rec->name_len;
+        memcpy(out + 1, rec->name, rec->name_len);
+        req->len += len;
+    }
+    req->cursor = seq;
+    if (seq - 1 > read_seq)
+        read_seq = seq - 1;
+    pthread_mutex_unlock(&journal_lock);
+    return 0;
+}
+
+void init_fs_journal() {
+    next_seq = 1;
+    read_seq = 0;
+}
+
+void free_fs_journal() {
+    free(ring);
+    ring = NULL;
+    size = 0;
+}
@@ -0,0 +1,21 @@
+#ifndef FS_JOURNAL_H
+#define FS_JOURNAL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "fs.h"
+#include "fs_ioctl.h"
+#include "util.h"
+
+// largest --journal, the records take about 300 MiB
+#define FS_JOURNAL_MAX (1u << 20)
+
+int fs_journal_set_size(size_t records);
+bool fs_journal_enabled();
+void fs_journal_add(uint32_t op, const fs_item* item) __nonnull((2));
+int fs_journal_read(struct fs_ioc_journal* req) __nonnull((1));
+void init_fs_journal();
+void free_fs_journal();
+
+#endif
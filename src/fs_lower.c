@@ -0,0 +1,203 @@
+#include "util.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/sysinfo.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "fs_lower.h"
+
+/**
+ * Read-through cache of a directory on disk.
+ *
+ * With --lower=<dir> the tree starts out as a view of the directory. The
+ * items of a directory are read in on the first lookup that misses in it or
+ * when it is listed, the file data on the first read. After that the items
+ * live in memory like any other, changes are not written back.
+ *
+ * Data that is the same as on disk is kept in a list, oldest first. Once
+ * there is more of it than the limit, the trimmer thread drops the data of
+ * the files that aren't open so it is read in again when needed.
+ *
+ * Items are found from the lower directory by their path, so the
+ * directories under an item are read in before it's renamed. The files
+ * under it keep the path their data has there, see lower_detach in fs.c.
+ */
+
+// seconds before the files that were open are tried to drop again
+#define TRIM_RETRY 1
+
+static int lower_fd = -1;
+// bytes of loaded data kept at most, half of the ram by default
+static size_t limit = 0;
+static size_t loaded_bytes = 0;
+static fs_file* oldest = NULL;
+static fs_file* newest = NULL;
+static bool stopping = false;
+static pthread_mutex_t lower_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t lower_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t trim_thread;
+
+/**
+ * Serve the items of dir until they are changed
+ */
+int fs_lower_enable(const char* dir) {
+    int fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0)
+        return -errno;
+
+    if (lower_fd >= 0)
+        close(lower_fd);
+    lower_fd = fd;
+    return 0;
+}
+
+bool fs_lower_enabled() {
+    return lower_fd >= 0;
+}
+
+/**
+ * Bytes of loaded file data kept before the oldest is dropped
+ */
+void fs_lower_set_limit(size_t bytes) {
+    limit = bytes;
+}
+
+/**
+ * Open the item at the path of the fs in the lower directory. Returns the
+ * fd or -errno
+ */
+int fs_lower_open(const char* path, int flags) {
+    // the lower directory itself for the root
+    while (*path == '/')
+        path++;
+    int fd = openat(lower_fd, *path == '\0' ? "." : path, flags | O_NOFOLLOW | O_CLOEXEC);
+    return fd < 0 ? -errno : fd;
+}
+
+static void unlink_file(fs_file* file) {
+    if (file->lower_prev != NULL) {
+        file->lower_prev->lower_next = file->lower_next;
+    } else {
+        oldest = file->lower_next;
+    }
+    if (file->lower_next != NULL) {
+        file->lower_next->lower_prev = file->lower_prev;
+    } else {
+        newest = file->lower_prev;
+    }
+    file->lower_prev = NULL;
+    file->lower_next = NULL;
+    loaded_bytes -= fs_item_size(file);
+}
+
+static void append_file(fs_file* file) {
+    file->lower_prev = newest;
+    file->lower_next = NULL;
+    if (newest != NULL) {
+        newest->lower_next = file;
+    } else {
+        oldest = file;
+    }
+    newest = file;
+    loaded_bytes += fs_item_size(file);
+}
+
+/**
+ * Track a file whose data was just read in. Publishes the data to the
+ * readers waiting for it
+ */
+void fs_lower_loaded(fs_file* file) {
+    pthread_mutex_lock(&lower_lock);
+    append_file(file);
+    __atomic_store_n(&file->lower, FS_LOWER_LOADED, __ATOMIC_RELEASE);
+    if (loaded_bytes > limit)
+        pthread_cond_signal(&lower_cond);
+    pthread_mutex_unlock(&lower_lock);
+}
+
+/**
+ * Stop tracking a loaded file, because it's changed or freed. Its data
+ * is kept from now on
+ */
+void fs_lower_forget(fs_file* file) {
+    pthread_mutex_lock(&lower_lock);
+    if (file->lower == FS_LOWER_LOADED) {
+        unlink_file(file);
+        __atomic_store_n(&file->lower, FS_LOWER_NONE, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&lower_lock);
+}
+
+/**
+ * Drop the oldest data until it fits the limit. Files that are open are
+ * moved to the end of the list instead. Caller holds the fs write lock
+ */
+static void trim() {
+    size_t count = 0;
+    for (fs_file* file = oldest; file != NULL; file = file->lower_next)
+        count++;
+
+    for (; count > 0 && loaded_bytes > limit; count--) {
+        fs_file* file = oldest;
+        unlink_file(file);
+        if (!fs_file_drop(file))
+            append_file(file);
+    }
+}
+
+static void* trim_fn(void* unused) {
+    pthread_mutex_lock(&lower_lock);
+    while (!stopping) {
+        if (loaded_bytes <= limit) {
+            pthread_cond_wait(&lower_cond, &lower_lock);
+            continue;
+        }
+
+        // the fs lock is taken first everywhere else
+        pthread_mutex_unlock(&lower_lock);
+        fs_wrlock();
+        pthread_mutex_lock(&lower_lock);
+        trim();
+        fs_unlock();
+        // files that were open are tried again a bit later
+        if (loaded_bytes > limit && !stopping) {
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_sec += TRIM_RETRY;
+            pthread_cond_timedwait(&lower_cond, &lower_lock, &deadline);
+        }
+    }
+    pthread_mutex_unlock(&lower_lock);
+    return NULL;
+}
+
+void init_fs_lower() {
+    if (!fs_lower_enabled())
+        return;
+
+    if (limit == 0) {
+        struct sysinfo si;
+        if (sysinfo(&si) == 0)
+            limit = (size_t)si.totalram * si.mem_unit / 2;
+    }
+    stopping = false;
+    pthread_create(&trim_thread, NULL, trim_fn, NULL);
+}
+
+/**
+ * Stop the trimmer. The files still in the list are forgotten when they
+ * are freed
+ */
+void free_fs_lower() {
+    if (!fs_lower_enabled())
+        return;
+
+    pthread_mutex_lock(&lower_lock);
+    stopping = true;
+    pthread_cond_signal(&lower_cond);
+    pthread_mutex_unlock(&lower_lock);
+    pthread_join(trim_thread, NULL);
+}
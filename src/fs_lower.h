@@ -0,0 +1,18 @@
+#ifndef FS_LOWER_H
+#define FS_LOWER_H
+
+#include <stddef.h>
+
+#include "fs.h"
+#include "util.h"
+
+int fs_lower_enable(const char* dir) __nonnull((1));
+bool fs_lower_enabled();
+void fs_lower_set_limit(size_t bytes);
+int fs_lower_open(const char* path, int flags) __nonnull((1));
+void fs_lower_loaded(fs_file* file) __nonnull((1));
+void fs_lower_forget(fs_file* file) __nonnull((1));
+void init_fs_lower();
+void free_fs_lower();
+
+#endif
@@ -0,0 +1,78 @@
+// memfd_create is a GNU extension
+#define _GNU_SOURCE
+#include "util.h"
+
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+#include "fs_memfd.h"
+
+/**
+ * Files kept in memfds.
+ *
+ * With --memfd the data of each file lives in an anonymous memory file
+ * instead of a buffer of the fs. The kernel keeps the pages, holes and
+ * truncation, and fuse can splice reads from the memfd to the kernel
+ * without copying them through the fs.
+ *
+ * Every written file holds an fd. The last fds below the limit are left
+ * for the rest of the fs, like the fuse device, the lower directory and
+ * the archives, and the files that would take one of them keep their data
+ * in a buffer like without --memfd.
+ */
+
+// fds left for the rest of the fs, at most half of the limit
+#define FD_RESERVE 1024
+
+static bool enabled = false;
+// memfds get fds below this
+static rlim_t max_fd = RLIM_INFINITY;
+
+/**
+ * Keep the data of the files created from now on in memfds. Fails if the
+ * kernel doesn't support them
+ */
+int fs_memfd_enable() {
+    int fd = fs_memfd_create();
+    if (fd < 0)
+        return fd;
+
+    close(fd);
+    enabled = true;
+
+    // the default soft limit only allows some thousand files
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) != 0)
+        return 0;
+    if (limit.rlim_cur < limit.rlim_max) {
+        rlim_t soft = limit.rlim_cur;
+        limit.rlim_cur = limit.rlim_max;
+        if (setrlimit(RLIMIT_NOFILE, &limit) != 0)
+            limit.rlim_cur = soft;
+    }
+    if (limit.rlim_cur != RLIM_INFINITY)
+        max_fd = limit.rlim_cur - (limit.rlim_cur / 2 < FD_RESERVE ? limit.rlim_cur / 2 : FD_RESERVE);
+    return 0;
+}
+
+bool fs_memfd_enabled() {
+    return enabled;
+}
+
+/**
+ * New empty memfd or -errno. -EMFILE once only the reserved fds are left,
+ * the kernel gives out the lowest free fd so its number is about the fds
+ * in use
+ */
+int fs_memfd_create() {
+    int fd = memfd_create("fs_file", MFD_CLOEXEC);
+    if (fd < 0)
+        return -errno;
+    if ((rlim_t)fd >= max_fd) {
+        close(fd);
+        return -EMFILE;
+    }
+    return fd;
+}
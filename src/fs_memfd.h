@@ -0,0 +1,10 @@
+#ifndef FS_MEMFD_H
+#define FS_MEMFD_H
+
+#include "util.h"
+
+int fs_memfd_enable();
+bool fs_memfd_enabled();
+int fs_memfd_create();
+
+#endif
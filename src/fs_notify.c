@@ -0,0 +1,117 @@
+#include "util.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "fs_notify.h"
+
+/**
+ * Invalidation of the kernel's caches.
+ *
+ * The kernel caches lookups and attributes for the timeouts given at mount
+ * and keeps them up to date for the changes it makes itself. Changes the fs
+ * makes on its own, like expired ttls, are sent to the kernel from here so
+ * the timeouts can be long.
+ *
+ * The notifications are sent from a thread of their own. The kernel might
+ * wait for a request that is waiting for the fs lock while handling one, so
+ * they must not be sent while holding it.
+ */
+
+static fs_notify_fn handler = NULL;
+static char** queue = NULL;
+static size_t queue_len = 0;
+static size_t queue_cap = 0;
+static bool stopping = false;
+static pthread_mutex_t notify_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t notify_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t notify_thread;
+
+/**
+ * Set the function sending the notifications. Has to be called before
+ * init_fs_notify, without one nothing is sent.
+ */
+void fs_notify_set_handler(fs_notify_fn fn) {
+    handler = fn;
+}
+
+/**
+ * Queue invalidation of the path
+ */
+void fs_notify_inval(const char* path) {
+    if (handler == NULL)
+        return;
+
+    // the kernel drops the entry once the timeout passes anyway
+    char* copy = strdup(path);
+    if (copy == NULL)
+        return;
+
+    pthread_mutex_lock(&notify_lock);
+    if (queue_len == queue_cap) {
+        size_t cap = queue_cap == 0 ? 64 : queue_cap * 2;
+        char** new_queue = realloc(queue, sizeof(char*) * cap);
+        if (new_queue == NULL) {
+            pthread_mutex_unlock(&notify_lock);
+            free(copy);
+            return;
+        }
+        queue = new_queue;
+        queue_cap = cap;
+    }
+    queue[queue_len++] = copy;
+    pthread_cond_signal(&notify_cond);
+    pthread_mutex_unlock(&notify_lock);
+}
+
+static void* notify_fn(void* unused) {
+    pthread_mutex_lock(&notify_lock);
+    while (true) {
+        if (queue_len == 0) {
+            if (stopping)
+                break;
+            pthread_cond_wait(&notify_cond, &notify_lock);
+            continue;
+        }
+
+        char** batch = queue;
+        size_t count = queue_len;
+        queue = NULL;
+        queue_len = 0;
+        queue_cap = 0;
+        pthread_mutex_unlock(&notify_lock);
+
+        for (size_t ii = 0; ii < count; ii++) {
+            handler(batch[ii]);
+            free(batch[ii]);
+        }
+        free(batch);
+
+        pthread_mutex_lock(&notify_lock);
+    }
+    pthread_mutex_unlock(&notify_lock);
+    return NULL;
+}
+
+void init_fs_notify() {
+    if (handler == NULL)
+        return;
+
+    stopping = false;
+    pthread_create(&notify_thread, NULL, notify_fn, NULL);
+}
+
+/**
+ * Send what is still queued and stop the thread
+ */
+void free_fs_notify() {
+    if (handler == NULL)
+        return;
+
+    pthread_mutex_lock(&notify_lock);
+    stopping = true;
+    pthread_cond_signal(&notify_cond);
+    pthread_mutex_unlock(&notify_lock);
+    pthread_join(notify_thread, NULL);
+}
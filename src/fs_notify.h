@@ -0,0 +1,14 @@
+#ifndef FS_NOTIFY_H
+#define FS_NOTIFY_H
+
+#include "util.h"
+
+// drops the kernel's cached entry and attributes of the path
+typedef void (*fs_notify_fn)(const char* path);
+
+void fs_notify_set_handler(fs_notify_fn fn);
+void fs_notify_inval(const char* path) __nonnull((1));
+void init_fs_notify();
+void free_fs_notify();
+
+#endif
@@ -0,0 +1,208 @@
+#include "util.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <sys/sysinfo.h>
+#include <unistd.h>
+
+#include "fs_dcache.h"
+#include "fs_dircache.h"
+#include "fs_epoch.h"
+#include "fs_lower.h"
+#include "fs_reclaim.h"
+#include "fs_ttl.h"
+
+/**
+ * Background reclamation of removed items.
+ *
+ * Freeing a big file or a large tree can take a long time so the request
+ * threads only detach the items from the tree and queue them here.
+ * A reclaimer thread frees the queued items in batches. Directories are
+ * freed by queuing their items again so a single huge directory doesn't
+ * keep a thread busy for long.
+ *
+ * Items are only reclaimed once the parent and every open file handle have
+ * dropped their reference, so open files stay usable after they are
+ * removed. The memory is freed after an epoch grace period since lock-free
+ * readers might still be looking at it.
+ *
+ * On teardown more reclaimers are started so the whole tree is freed in
+ * parallel.
+ */
+
+// how many items a reclaimer takes from the queue at once
+#define RECLAIM_BATCH 64
+
+static fs_item** queue = NULL;
+static size_t queue_len = 0;
+static size_t queue_cap = 0;
+// reclaimers currently freeing a batch
+static int busy = 0;
+// set on teardown, reclaimers exit once the queue is empty
+static bool stopping = false;
+static pthread_mutex_t reclaim_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t reclaim_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t reclaim_thread;
+
+static void queue_push(fs_item* item) {
+    if (queue_len == queue_cap) {
+        queue_cap = queue_cap == 0 ? RECLAIM_BATCH : queue_cap * 2;
+        queue = realloc(queue, sizeof(fs_item*) * queue_cap);
+    }
+    queue[queue_len++] = item;
+}
+
+static void push_children(fs_dir* dir) {
+    fs_item* item;
+    pthread_mutex_lock(&reclaim_lock);
+    fs_foreach_val(&dir->items, item) {
+        // the items are no longer part of the tree
+        fs_ttl_disarm(item);
+        item->parent = NULL;
+        if (__atomic_sub_fetch(&item->refs, 1, __ATOMIC_ACQ_REL) == 0)
+            queue_push(item);
+    }
+    pthread_cond_broadcast(&reclaim_cond);
+    pthread_mutex_unlock(&reclaim_lock);
+}
+
+/**
+ * Items of removed directories might still be in the timer wheel so they
+ * are disarmed while holding the fs lock before they can be freed.
+ */
+static void reclaim_batch(fs_item** batch, size_t count) {
+    bool has_dirs = false;
+    fs_wrlock();
+    for (size_t ii = 0; ii < count; ii++) {
+        fs_item* item = batch[ii];
+        if (!fs_item_is_dir(item))
+            continue;
+        has_dirs = true;
+        if (fs_dirmap_size(&fs_item_dir(item).items) != 0)
+            push_children(&fs_item_dir(item));
+    }
+    fs_unlock();
+
+    // the threads might still have the directories cached
+    if (has_dirs)
+        fs_dircache_flush();
+
+    // nobody can find the items from the tree anymore. Once the readers that
+    // could have are gone, drop the items from the lookup cache and wait
+    // for the readers that got them from there
+    fs_epoch_synchronize();
+    for (size_t ii = 0; ii < count; ii++)
+        fs_dcache_forget(batch[ii]);
+    fs_epoch_synchronize();
+
+    for (size_t ii = 0; ii < count; ii++) {
+        fs_item* item = batch[ii];
+        if (fs_item_is_dir(item)) {
+            fs_dirmap_term(&fs_item_dir(item).items);
+        } else {
+            // the item can't be dropped anymore so the state is stable
+            if (fs_item_file(item).lower == FS_LOWER_LOADED)
+                fs_lower_forget(&fs_item_file(item));
+            free(fs_item_file(item).data);
+            free(fs_item_file(item).lower_path);
+            if (fs_item_file(item).fd >= 0)
+                close(fs_item_file(item).fd);
+        }
+        free(item);
+    }
+}
+
+static void* reclaim_fn(void* unused) {
+    fs_item* batch[RECLAIM_BATCH];
+    pthread_mutex_lock(&reclaim_lock);
+    while (true) {
+        if (queue_len == 0) {
+            if (stopping && busy == 0)
+                break;
+            pthread_cond_wait(&reclaim_cond, &reclaim_lock);
+            continue;
+        }
+
+        size_t count = 0;
+        while (count < RECLAIM_BATCH && queue_len > 0)
+            batch[count++] = queue[--queue_len];
+        busy++;
+        pthread_mutex_unlock(&reclaim_lock);
+
+        reclaim_batch(batch, count);
+
+        pthread_mutex_lock(&reclaim_lock);
+        busy--;
+    }
+
+    // wake up the other reclaimers so they can see that we are done
+    pthread_cond_broadcast(&reclaim_cond);
+    pthread_mutex_unlock(&reclaim_lock);
+    return NULL;
+}
+
+void fs_item_ref(fs_item* item) {
+    __atomic_add_fetch(&item->refs, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * Drop a reference. The item is reclaimed if it was the last one
+ */
+void fs_item_unref(fs_item* item) {
+    if (__atomic_sub_fetch(&item->refs, 1, __ATOMIC_ACQ_REL) == 0)
+        fs_reclaim(item);
+}
+
+/**
+ * Queue an item that is already detached from the tree to be freed.
+ * Directories are freed with all of their items.
+ */
+void fs_reclaim(fs_item* item) {
+    pthread_mutex_lock(&reclaim_lock);
+    queue_push(item);
+    pthread_cond_signal(&reclaim_cond);
+    pthread_mutex_unlock(&reclaim_lock);
+}
+
+/**
+ * Queue all the items of the directory and empty it.
+ * Caller needs to hold the fs lock.
+ */
+void fs_reclaim_children(fs_item* dir_item) {
+    fs_dir* dir = &fs_item_dir(dir_item);
+    if (fs_dirmap_size(&dir->items) != 0)
+        push_children(dir);
+    fs_dirmap_term(&dir->items);
+}
+
+void init_fs_reclaim() {
+    stopping = false;
+    pthread_create(&reclaim_thread, NULL, reclaim_fn, NULL);
+}
+
+/**
+ * Free everything still in the queue and stop the reclaimers.
+ * Extra reclaimer is started for each cpu so tearing down a large tree
+ * doesn't take longer than it has to.
+ */
+void free_fs_reclaim() {
+    int helper_count = get_nprocs() - 1;
+    pthread_t* helpers = malloc(sizeof(pthread_t) * (helper_count > 0 ? helper_count : 1));
+
+    pthread_mutex_lock(&reclaim_lock);
+    stopping = true;
+    pthread_cond_broadcast(&reclaim_cond);
+    pthread_mutex_unlock(&reclaim_lock);
+
+    for (int ii = 0; ii < helper_count; ii++)
+        pthread_create(&helpers[ii], NULL, reclaim_fn, NULL);
+    for (int ii = 0; ii < helper_count; ii++)
+        pthread_join(helpers[ii], NULL);
+    pthread_join(reclaim_thread, NULL);
+
+    free(helpers);
+    free(queue);
+    queue = NULL;
+    queue_len = 0;
+    queue_cap = 0;
+}
@@ -0,0 +1,14 @@
+#ifndef FS_RECLAIM_H
+#define FS_RECLAIM_H
+
+#include "fs.h"
+#include "util.h"
+
+void fs_item_ref(fs_item* item) __nonnull((1));
+void fs_item_unref(fs_item* item) __nonnull((1));
+void fs_reclaim(fs_item* item) __nonnull((1));
+void fs_reclaim_children(fs_item* dir_item) __nonnull((1));
+void init_fs_reclaim();
+void free_fs_reclaim();
+
+#endif
@@ -0,0 +1,156 @@
+#include "util.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "fs_ioctl.h"
+#include "fs_reclaim.h"
+#include "fs_scan.h"
+
+/**
+ * Metadata of whole subtrees in one pass, see FS_IOC_SCAN.
+ *
+ * The directories are read one at a time under the fs read lock, writing
+ * a record for each item into a buffer. The subdirectories are referenced
+ * and kept on a stack for later, so the buffer can be written out without
+ * the lock after each directory.
+ */
+
+#define SCAN_BUF (1 << 20)
+
+typedef struct scan_dir {
+    fs_item* item;
+    // below the directory scanned, "" for itself
+    char* path;
+    size_t len;
+} scan_dir;
+
+typedef struct scanner {
+    int fd;
+    char* buf;
+    size_t len;
+    size_t cap;
+    scan_dir* stack;
+    size_t depth;
+    size_t stack_cap;
+    uint64_t items;
+} scanner;
+
+static int push_dir(scanner* s, fs_item* item, const char* path, size_t len) {
+    if (s->depth == s->stack_cap) {
+        size_t cap = s->stack_cap == 0 ? 64 : s->stack_cap * 2;
+        scan_dir* stack = realloc(s->stack, cap * sizeof(scan_dir));
+        if (stack == NULL)
+            return -ENOMEM;
+        s->stack = stack;
+        s->stack_cap = cap;
+    }
+
+    char* copy = malloc(len + 1);
+    if (copy == NULL)
+        return -ENOMEM;
+    memcpy(copy, path, len);
+    copy[len] = '\0';
+    // held until the directory is read in case it's removed before that
+    fs_item_ref(item);
+    s->stack[s->depth++] = (scan_dir) { .item = item, .path = copy, .len = len };
+    return 0;
+}
+
+static int add_record(scanner* s, const scan_dir* dir, fs_item* item) {
+    size_t path_len = dir->len + (dir->len != 0 ? 1 : 0) + item->name_len;
+    size_t len = sizeof(struct fs_ioc_scan_record) + path_len;
+    len += (FS_IOC_SCAN_ALIGN - len % FS_IOC_SCAN_ALIGN) % FS_IOC_SCAN_ALIGN;
+    if (path_len > PATH_LEN_MAX)
+        return -ENAMETOOLONG;
+
+    // a directory is written out at once so the buffer grows for big ones
+    if (s->cap - s->len < len) {
+        size_t cap = s->cap * 2 > s->len + len ? s->cap * 2 : s->len + len;
+        char* buf = realloc(s->buf, cap);
+        if (buf == NULL)
+            return -ENOMEM;
+        s->buf = buf;
+        s->cap = cap;
+    }
+
+    struct stat st;
+    fs_item_stat(item, &st);
+    struct fs_ioc_scan_record* rec = (struct fs_ioc_scan_record*)&s->buf[s->len];
+    memset(rec, 0, len);
+    rec->size = fs_item_is_dir(item) ? 0 : st.st_size;
+    rec->mtime = st.st_mtime;
+    rec->mode = st.st_mode;
+    rec->nlink = st.st_nlink;
+    rec->path_len = path_len;
+
+    char* path = (char*)(rec + 1);
+    memcpy(path, dir->path, dir->len);
+    if (dir->len != 0)
+        path[dir->len] = '/';
+    memcpy(&path[path_len - item->name_len], item->name, item->name_len);
+    s->len += len;
+    s->items++;
+
+    if (fs_item_is_dir(item))
+        return push_dir(s, item, path, path_len);
+    return 0;
+}
+
+/**
+ * Records of the items of the directory into the buffer
+ */
+static int scan_items(scanner* s, const scan_dir* dir) {
+    fs_rdlock();
+    uint32_t count = 0;
+    int ret = fs_dir_fill(&fs_item_dir(dir->item));
+    fs_item** items = ret == 0 ? fs_dirmap_snapshot(&fs_item_dir(dir->item).items, &count) : NULL;
+    if (ret == 0 && items == NULL)
+        ret = -ENOMEM;
+    for (uint32_t ii = 0; ret == 0 && ii < count; ii++)
+        ret = add_record(s, dir, items[ii]);
+    fs_unlock();
+    free(items);
+    return ret;
+}
+
+static int write_out(scanner* s) {
+    for (size_t pos = 0; pos < s->len;) {
+        ssize_t written = write(s->fd, &s->buf[pos], s->len - pos);
+        if (written < 0 && errno == EINTR)
+            continue;
+        if (written < 0)
+            return -errno;
+        pos += written;
+    }
+    s->len = 0;
+    return 0;
+}
+
+/**
+ * Write the records of everything under the directory to fd. Takes the fs
+ * lock itself
+ */
+int fs_scan(fs_item* dir, int fd, uint64_t* items) {
+    scanner s = { .fd = fd, .buf = malloc(SCAN_BUF), .len = 0, .cap = SCAN_BUF };
+    int ret = s.buf == NULL ? -ENOMEM : push_dir(&s, dir, "", 0);
+    while (s.depth > 0) {
+        scan_dir next = s.stack[--s.depth];
+        if (ret == 0)
+            ret = scan_items(&s, &next);
+        // many small directories are written out together
+        if (ret == 0 && s.len >= SCAN_BUF)
+            ret = write_out(&s);
+        fs_item_unref(next.item);
+        free(next.path);
+    }
+    if (ret == 0)
+        ret = write_out(&s);
+
+    *items = s.items;
+    free(s.buf);
+    free(s.stack);
+    return ret;
+}
@@ -0,0 +1,11 @@
+#ifndef FS_SCAN_H
+#define FS_SCAN_H
+
+#include <stdint.h>
+
+#include "fs.h"
+#include "util.h"
+
+int fs_scan(fs_item* dir, int fd, uint64_t* items) __nonnull((1, 3));
+
+#endif
@@ -0,0 +1,163 @@
+// cpu_set_t and sched_setaffinity are GNU extensions
+#define _GNU_SOURCE
+#include "util.h"
+
+#include <errno.h>
+#include <fuse_lowlevel.h>
+#include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "fs_session.h"
+
+/**
+ * Request loop with a fixed set of workers.
+ *
+ * The fuse multithreaded loop starts and stops threads as the load changes
+ * and lets the scheduler place them. Here all the workers are started up
+ * front and each can be pinned to a cpu, so a worker and the data it
+ * touches stay on the same core.
+ *
+ * Shutdown works like in the fuse loop. The signal handlers or a worker
+ * that sees the device go away exit the session and wake the main thread,
+ * which cancels the workers still waiting for requests.
+ */
+
+typedef struct session_worker {
+    pthread_t thread;
+    // request buffer, freed after the worker is joined since it can be
+    // cancelled while reading into it
+    struct fuse_buf buf;
+    // cpu to pin to, -1 if not pinned
+    int cpu;
+    bool started;
+} session_worker;
+
+typedef struct session {
+    struct fuse_session* se;
+    sem_t finish;
+    // first error from a worker, 0 if none
+    int error;
+} session;
+
+typedef struct worker_arg {
+    session* session;
+    session_worker* worker;
+} worker_arg;
+
+static void pin_worker(int cpu) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    if (sched_setaffinity(0, sizeof(set), &set) != 0)
+        perror("pinning worker");
+}
+
+static void* worker_fn(void* data) {
+    worker_arg* arg = data;
+    session* s = arg->session;
+    session_worker* worker = arg->worker;
+    free(arg);
+    if (worker->cpu >= 0)
+        pin_worker(worker->cpu);
+
+    int ret = 0;
+    while (!fuse_session_exited(s->se)) {
+        // the worker is only cancelled while it waits for a request
+        pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, NULL);
+        ret = fuse_session_receive_buf(s->se, &worker->buf);
+        pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, NULL);
+
+        if (ret == -EINTR || ret == -EAGAIN)
+            continue;
+        if (ret <= 0)
+            break;
+
+        fuse_session_process_buf(s->se, &worker->buf);
+    }
+
+    // 0 means the fs was unmounted
+    int none = 0;
+    if (ret < 0 && ret != -EINTR && ret != -EAGAIN)
+        __atomic_compare_exchange_n(&s->error, &none, ret, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+    fuse_session_exit(s->se);
+    sem_post(&s->finish);
+    return NULL;
+}
+
+/**
+ * Cpus the process is allowed to run on, in order. Returns the count
+ */
+static int allowed_cpus(int* cpus, int max) {
+    cpu_set_t set;
+    if (sched_getaffinity(0, sizeof(set), &set) != 0)
+        return 0;
+
+    int count = 0;
+    for (int cpu = 0; cpu < CPU_SETSIZE && count < max; cpu++) {
+        if (CPU_ISSET(cpu, &set))
+            cpus[count++] = cpu;
+    }
+    return count;
+}
+
+/**
+ * Handle the requests of the fuse until it is unmounted or the session is
+ * exited. Returns 0 or -errno like fuse_loop_mt
+ */
+int fs_session_loop(struct fuse* fuse, const fs_session_config* config) {
+    session s = { .se = fuse_get_session(fuse), .error = 0 };
+    session_worker* workers = calloc(config->workers, sizeof(session_worker));
+    if (workers == NULL)
+        return -ENOMEM;
+    sem_init(&s.finish, 0, 0);
+
+    int cpus[CPU_SETSIZE];
+    int cpu_count = config->pin ? allowed_cpus(cpus, CPU_SETSIZE) : 0;
+
+    int ret = fuse_start_cleanup_thread(fuse);
+    for (unsigned ii = 0; ret == 0 && ii < config->workers; ii++) {
+        worker_arg* arg = malloc(sizeof(worker_arg));
+        if (arg == NULL) {
+            ret = -ENOMEM;
+            break;
+        }
+        // more workers than cpus share them round robin
+        workers[ii].cpu = cpu_count > 0 ? cpus[ii % cpu_count] : -1;
+        arg->session = &s;
+        arg->worker = &workers[ii];
+        int err = pthread_create(&workers[ii].thread, NULL, worker_fn, arg);
+        if (err != 0) {
+            free(arg);
+            ret = -err;
+            break;
+        }
+        workers[ii].started = true;
+    }
+
+    if (ret == 0) {
+        while (!fuse_session_exited(s.se))
+            sem_wait(&s.finish);
+    }
+
+    fuse_session_exit(s.se);
+    for (unsigned ii = 0; ii < config->workers; ii++) {
+        if (workers[ii].started)
+            pthread_cancel(workers[ii].thread);
+    }
+    for (unsigned ii = 0; ii < config->workers; ii++) {
+        if (workers[ii].started)
+            pthread_join(workers[ii].thread, NULL);
+        free(workers[ii].buf.mem);
+    }
+    fuse_stop_cleanup_thread(fuse);
+
+    sem_destroy(&s.finish);
+    free(workers);
+    if (ret == 0)
+        ret = s.error;
+    fuse_session_reset(s.se);
+    return ret;
+}
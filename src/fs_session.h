@@ -0,0 +1,17 @@
+#ifndef FS_SESSION_H
+#define FS_SESSION_H
+
+#include <fuse.h>
+
+#include "util.h"
+
+typedef struct fs_session_config {
+    // threads reading and handling the requests, they are all started at once
+    unsigned workers;
+    // pin each worker to a cpu of its own
+    bool pin;
+} fs_session_config;
+
+int fs_session_loop(struct fuse* fuse, const fs_session_config* config) __nonnull((1, 2));
+
+#endif
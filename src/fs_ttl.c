@@ -0,0 +1,326 @@
+#include "util.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "fs_ttl.h"
+
+/**
+ * Hierarchical timer wheel for the item time-to-lives.
+ *
+ * Level 0 has a slot for each of the next 64 seconds, level 1 a slot for each
+ * of the next 64 * 64 seconds and so on. When the time reaches the start of a
+ * higher level slot, the items in it are cascaded down to the lower levels.
+ * Every item moves at most WHEEL_LEVELS times so arming, disarming and
+ * expiring are all O(1) amortized and we never have to scan the tree.
+ *
+ * Timers further away than the wheel covers (~194 days) are parked at the
+ * top level and re-inserted when they come around.
+ *
+ * The wheel has a lock of its own since items are created with only the fs
+ * read lock held.
+ */
+#define WHEEL_BITS 6
+#define WHEEL_SIZE (1 << WHEEL_BITS)
+#define WHEEL_MASK (WHEEL_SIZE - 1)
+#define WHEEL_LEVELS 4
+#define WHEEL_SPAN ((time_t)1 << (WHEEL_BITS * WHEEL_LEVELS))
+
+// How many items are expired before giving the lock to the request threads
+#define EXPIRE_BATCH 256
+
+#define timer_item(_timer) ((fs_item*)((char*)(_timer)-offsetof(fs_item, timer)))
+
+typedef struct ttl_rule {
+    char* prefix;
+    uint32_t ttl;
+} ttl_rule;
+
+static fs_timer wheel[WHEEL_LEVELS][WHEEL_SIZE];
+// expired items waiting to be handled by fs_expire_item
+static fs_timer pending;
+// the last second the wheel has processed
+static time_t wheel_now;
+
+static ttl_rule* rules = NULL;
+static size_t rule_count = 0;
+
+static pthread_t tick_thread;
+static pthread_mutex_t wheel_lock = PTHREAD_MUTEX_INITIALIZER;
+static bool stopping = false;
+// the tick thread waits on this between the ticks
+static pthread_mutex_t tick_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t tick_cond = PTHREAD_COND_INITIALIZER;
+
+static void list_init(fs_timer* head) {
+    head->next = head;
+    head->prev = head;
+}
+
+static bool list_empty(const fs_timer* head) {
+    return head->next == head;
+}
+
+static void list_add(fs_timer* head, fs_timer* timer) {
+    timer->next = head;
+    timer->prev = head->prev;
+    head->prev->next = timer;
+    head->prev = timer;
+}
+
+static void list_del(fs_timer* timer) {
+    timer->prev->next = timer->next;
+    timer->next->prev = timer->prev;
+    timer->next = NULL;
+    timer->prev = NULL;
+}
+
+/**
+ * Move all the timers from src to dst. dst needs to be empty.
+ */
+static void list_splice(fs_timer* src, fs_timer* dst) {
+    list_init(dst);
+    if (list_empty(src))
+        return;
+
+    dst->next = src->next;
+    dst->prev = src->prev;
+    dst->next->prev = dst;
+    dst->prev->next = dst;
+    list_init(src);
+}
+
+static void wheel_insert(fs_timer* timer) {
+    time_t delta = timer->deadline - wheel_now;
+    if (delta < 0) {
+        delta = 0;
+    } else if (delta >= WHEEL_SPAN) {
+        delta = WHEEL_SPAN - 1;
+    }
+
+    int level = 0;
+    while (delta >= (time_t)1 << (WHEEL_BITS * (level + 1)))
+        level++;
+
+    time_t expires = wheel_now + delta;
+    int slot = (expires >> (WHEEL_BITS * level)) & WHEEL_MASK;
+    list_add(&wheel[level][slot], timer);
+}
+
+static void wheel_cascade(int level) {
+    fs_timer head;
+    int slot = (wheel_now >> (WHEEL_BITS * level)) & WHEEL_MASK;
+    // detach the slot first since parked timers may land in the same slot
+    list_splice(&wheel[level][slot], &head);
+    while (!list_empty(&head)) {
+        fs_timer* timer = head.next;
+        list_del(timer);
+        wheel_insert(timer);
+    }
+}
+
+void fs_ttl_arm(fs_item* item, time_t deadline) {
+    fs_timer* timer = &item->timer;
+    pthread_mutex_lock(&wheel_lock);
+    if (timer->next != NULL)
+        list_del(timer);
+
+    timer->deadline = deadline;
+    if (deadline <= wheel_now) {
+        list_add(&pending, timer);
+    } else {
+        wheel_insert(timer);
+    }
+    pthread_mutex_unlock(&wheel_lock);
+}
+
+void fs_ttl_disarm(fs_item* item) {
+    pthread_mutex_lock(&wheel_lock);
+    if (item->timer.next != NULL)
+        list_del(&item->timer);
+    pthread_mutex_unlock(&wheel_lock);
+}
+
+bool fs_ttl_armed(const fs_item* item) {
+    pthread_mutex_lock(&wheel_lock);
+    bool armed = item->timer.next != NULL;
+    pthread_mutex_unlock(&wheel_lock);
+    return armed;
+}
+
+/**
+ * Move the wheel forward to now. Expired items are collected to the pending
+ * list that is emptied with fs_ttl_pop().
+ */
+void fs_ttl_advance(time_t now) {
+    pthread_mutex_lock(&wheel_lock);
+    while (wheel_now < now) {
+        wheel_now++;
+
+        // cascade from the highest level whose slot starts now so the
+        // timers can fall all the way down in a single tick
+        int top = 0;
+        for (int level = 1; level < WHEEL_LEVELS; level++) {
+            if ((wheel_now & (((time_t)1 << (WHEEL_BITS * level)) - 1)) != 0)
+                break;
+            top = level;
+        }
+        for (int level = top; level > 0; level--)
+            wheel_cascade(level);
+
+        fs_timer head;
+        list_splice(&wheel[0][wheel_now & WHEEL_MASK], &head);
+        while (!list_empty(&head)) {
+            fs_timer* timer = head.next;
+            list_del(timer);
+            if (timer->deadline <= wheel_now) {
+                list_add(&pending, timer);
+            } else { // parked timer that hasn't reached its deadline yet
+                wheel_insert(timer);
+            }
+        }
+    }
+    pthread_mutex_unlock(&wheel_lock);
+}
+
+/**
+ * Get the next expired item. Returns NULL if there are none.
+ */
+fs_item* fs_ttl_pop() {
+    fs_timer* timer = NULL;
+    pthread_mutex_lock(&wheel_lock);
+    if (!list_empty(&pending)) {
+        timer = pending.next;
+        list_del(timer);
+    }
+    pthread_mutex_unlock(&wheel_lock);
+    return timer == NULL ? NULL : timer_item(timer);
+}
+
+/**
+ * Add a ttl rule in form of "<path prefix>:<seconds>"
+ */
+int fs_ttl_add_rule(const char* rule) {
+    const char* sep = strrchr(rule, ':');
+    if (sep == NULL || sep == rule || rule[0] != '/')
+        return -EINVAL;
+
+    char* end;
+    unsigned long ttl = strtoul(sep + 1, &end, 10);
+    if (*end != '\0' || end == sep + 1 || ttl == 0 || ttl > UINT32_MAX)
+        return -EINVAL;
+
+    size_t len = sep - rule;
+    // fuse gives us the paths without the trailing slash
+    while (len > 1 && rule[len - 1] == '/')
+        len--;
+
+    ttl_rule* new_rules = realloc(rules, sizeof(ttl_rule) * (rule_count + 1));
+    if (new_rules == NULL)
+        return -ENOMEM;
+
+    char* prefix = malloc(len + 1);
+    if (prefix == NULL)
+        return -ENOMEM;
+
+    memcpy(prefix, rule, len);
+    prefix[len] = '\0';
+    rules = new_rules;
+    rules[rule_count].prefix = prefix;
+    rules[rule_count].ttl = ttl;
+    rule_count++;
+    return 0;
+}
+
+/**
+ * Get the ttl of the rule for the path, the one with the longest prefix of
+ * whole names if several match. exact tells if the path is the prefix
+ * itself. 0 if there's no match
+ */
+uint32_t fs_ttl_rule(const char* path, bool* exact) {
+    uint32_t ttl = 0;
+    size_t best = 0;
+    *exact = false;
+    for (size_t ii = 0; ii < rule_count; ii++) {
+        const char* prefix = rules[ii].prefix;
+        size_t len = strlen(prefix);
+        // "/" is the only prefix that ends with a slash
+        bool match = strncmp(prefix, path, len) == 0
+            && (path[len] == '\0' || path[len] == '/' || len == 1);
+        if (match && len >= best) {
+            ttl = rules[ii].ttl;
+            best = len;
+            *exact = path[len] == '\0';
+        }
+    }
+
+    return ttl;
+}
+
+static void* ttl_tick_fn(void* unused) {
+    pthread_mutex_lock(&tick_lock);
+    while (!stopping) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += 1;
+        pthread_cond_timedwait(&tick_cond, &tick_lock, &deadline);
+        if (stopping)
+            break;
+        pthread_mutex_unlock(&tick_lock);
+
+        time_t now = time(NULL);
+        fs_wrlock();
+        fs_ttl_advance(now);
+        fs_unlock();
+
+        // expire in batches so a mass expiry doesn't stall the requests
+        bool done = false;
+        while (!done) {
+            fs_wrlock();
+            for (int ii = 0; ii < EXPIRE_BATCH; ii++) {
+                fs_item* item = fs_ttl_pop();
+                if (item == NULL) {
+                    done = true;
+                    break;
+                }
+                fs_expire_item(item, now);
+            }
+            fs_unlock();
+        }
+        pthread_mutex_lock(&tick_lock);
+    }
+    pthread_mutex_unlock(&tick_lock);
+    return NULL;
+}
+
+void init_fs_ttl() {
+    for (int level = 0; level < WHEEL_LEVELS; level++) {
+        for (int slot = 0; slot < WHEEL_SIZE; slot++)
+            list_init(&wheel[level][slot]);
+    }
+    list_init(&pending);
+    wheel_now = time(NULL);
+    stopping = false;
+    pthread_create(&tick_thread, NULL, ttl_tick_fn, NULL);
+}
+
+/**
+ * Stop the tick thread once it's done with the expiries it is on
+ */
+void free_fs_ttl() {
+    pthread_mutex_lock(&tick_lock);
+    stopping = true;
+    pthread_cond_signal(&tick_cond);
+    pthread_mutex_unlock(&tick_lock);
+    pthread_join(tick_thread, NULL);
+    for (size_t ii = 0; ii < rule_count; ii++)
+        free(rules[ii].prefix);
+    free(rules);
+    rules = NULL;
+    rule_count = 0;
+}
@@ -0,0 +1,19 @@
+#ifndef FS_TTL_H
+#define FS_TTL_H
+
+#include <time.h>
+
+#include "fs.h"
+#include "util.h"
+
+void fs_ttl_arm(fs_item* item, time_t deadline) __nonnull((1));
+void fs_ttl_disarm(fs_item* item) __nonnull((1));
+bool fs_ttl_armed(const fs_item* item) __nonnull((1));
+void fs_ttl_advance(time_t now);
+fs_item* fs_ttl_pop();
+int fs_ttl_add_rule(const char* rule) __nonnull((1));
+uint32_t fs_ttl_rule(const char* path, bool* exact) __nonnull((1, 2));
+void init_fs_ttl();
+void free_fs_ttl();
+
+#endif
@@ -1,23 +1,98 @@
-
-#define FUSE_USE_VERSION 30
+// syscall for pidfd_getfd is a GNU extension
+#define _GNU_SOURCE
+#define FUSE_USE_VERSION 32
 
 #include "util.h"
 
 #include <errno.h>
+#include <fcntl.h>
 #include <fuse.h>
+#include <fuse_lowlevel.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
+#include <unistd.h>
 
 #include "fs.h"
+#include "fs_archive.h"
+#include "fs_epoch.h"
 #include "fs_fh.h"
+#include "fs_flush.h"
+#include "fs_image.h"
+#include "fs_ioctl.h"
+#include "fs_journal.h"
+#include "fs_lower.h"
+#include "fs_memfd.h"
+#include "fs_notify.h"
+#include "fs_scan.h"
+#include "fs_session.h"
+#include "fs_ttl.h"
+
+// seconds the kernel can cache lookups and attributes by default
+#define DEFAULT_CACHE_TIMEOUT 60.0
+#define MAX_WORKERS 1024
+// 1 MiB writes, fuse lowers it if its request buffers are smaller
+#define DEFAULT_MAX_WRITE (1u << 20)
+
+enum {
+    KEY_TTL,
+    KEY_CACHE_TIMEOUT,
+    KEY_NEGATIVE_TIMEOUT,
+    KEY_WRITEBACK_CACHE,
+    KEY_MEMFD,
+    KEY_WORKERS,
+    KEY_PIN_WORKERS,
+    KEY_IO_URING,
+    KEY_MAX_READ,
+    KEY_MAX_WRITE,
+    KEY_MAX_READAHEAD,
+    KEY_MAX_BACKGROUND,
+    KEY_CONGESTION_THRESHOLD,
+    KEY_STATE,
+    KEY_LOWER,
+    KEY_LOWER_CACHE,
+    KEY_WRITE_BEHIND,
+    KEY_WRITE_BEHIND_LIMIT,
+    KEY_IMPORT,
+    KEY_JOURNAL,
+    KEY_THREAD_LIMIT,
+};
+
+static double cache_timeout = DEFAULT_CACHE_TIMEOUT;
+// negative if not given, the cache timeout is used then
+static double negative_timeout = -1;
+static bool writeback_cache = false;
+// workers 0 uses the fuse multithreaded loop
+static fs_session_config session_config = { .workers = 0, .pin = false };
+static bool io_uring = false;
+// -o max_threads or -o max_idle_threads was given, they only apply to the
+// fuse loop
+static bool thread_limits = false;
+// image the tree is saved to on unmount and restored from on start
+static char* state_path = NULL;
+// archive the tree is filled from on start
+static int import_fd = -1;
+// request sizes and queue limits set in init, 0 keeps what fuse offers
+static struct {
+    unsigned max_read;
+    unsigned max_write;
+    unsigned max_readahead;
+    unsigned max_background;
+    unsigned congestion_threshold;
+} conn_opts = { .max_write = DEFAULT_MAX_WRITE };
+static struct fuse* fuse_instance;
+// the cached entries are dropped through the parent seen from the mount
+static const char* mount_path = NULL;
 
 static int fdo_mkdir(const char* path, mode_t mode);
 static int fdo_getattr(const char* path, struct stat* st, struct fuse_file_info* fi);
 static int fdo_readdir(const char* path, void* buffer, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info* fi, enum fuse_readdir_flags flags);
 static int fdo_mknod(const char* path, mode_t mode, dev_t rdev);
 static int fdo_read(const char* path, char* buffer, size_t size, off_t offset, struct fuse_file_info* fi);
+static int fdo_read_buf(const char* path, struct fuse_bufvec** bufp, size_t size, off_t offset, struct fuse_file_info* fi);
 static int fdo_write(const char* path, const char* buffer, size_t size, off_t offset, struct fuse_file_info* fi);
 static int fdo_truncate(const char* path, off_t size, struct fuse_file_info* fi);
 static int fdo_unlink(const char* path);
@@ -41,6 +116,8 @@ static int fdo_readlink(const char* path, char* buf, size_t len);
 static int fdo_ioctl(const char* path, int cmd, void* arg, struct fuse_file_info* fi, unsigned int flags, void* data);
 static int fdo_poll(const char* path, struct fuse_file_info* fi, struct fuse_pollhandle* ph, unsigned* reventsp);
 static int fdo_fallocate(const char* path, int mode, off_t offset, off_t length, struct fuse_file_info* fi);
+static void* fdo_init(struct fuse_conn_info* conn, struct fuse_config* cfg);
+static void fdo_destroy(void* private_data);
 
 static struct fuse_operations operations = {
     .getattr = fdo_getattr,
@@ -71,6 +148,8 @@ static struct fuse_operations operations = {
     .fallocate = fdo_fallocate,
     .ioctl = fdo_ioctl,
     .release = fdo_release,
+    .init = fdo_init,
+    .destroy = fdo_destroy,
     // we don't have any xattrs
     // .setxattr = fdo_setxattr,
     // .getxattr = fdo_getxattr,
@@ -87,82 +166,155 @@ static struct fuse_operations operations = {
 };
 
 static int fdo_getattr(const char* path, struct stat* st, struct fuse_file_info* fi) {
-    int ret;
-    fs_item* item;
     path_string p_string;
 
-    if (fi != NULL) {
-        ret = fs_fh_get_item(fi->fh, &item);
-    } else {
-        create_path_string(&p_string, path);
-        ret = fs_get_item(&p_string, &item, 0);
-    }
+    // open items can't be freed under us so they don't need the lock
+    if (fi != NULL)
+        return fs_fstat(fi->fh, st);
 
-    if (ret != 0)
-        return ret;
-
-    memcpy(st, &item->st, sizeof(struct stat));
-    return 0;
+    create_path_string(&p_string, path);
+    fs_epoch_enter();
+    int ret = fs_stat(&p_string, st);
+    fs_epoch_exit();
+    return ret;
 }
 
 static int fdo_readdir(const char* path, void* buffer, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info* fi, enum fuse_readdir_flags flags) {
     fs_dir* root;
+    fs_rdlock();
     int ret = fs_fh_get_dir(fi->fh, &root);
+    if (ret == 0)
+        ret = fs_dir_fill(root);
     if (ret != 0) {
+        fs_unlock();
         return ret;
     }
 
     filler(buffer, ".", NULL, 0, 0); // Current Directory
     filler(buffer, "..", NULL, 0, 0); // Parent Directory
 
-    const char* key;
-    const fs_item* item;
-    fs_foreach(&root->items, key, item) {
-        filler(buffer, key, &item->st, 0, 0);
+    // creates only take the read lock so the directory can change under us
+    uint32_t count;
+    fs_item** items = fs_dirmap_snapshot(&root->items, &count);
+    if (items == NULL) {
+        fs_unlock();
+        return -ENOMEM;
     }
+
+    for (uint32_t ii = 0; ii < count; ii++) {
+        struct stat st;
+        fs_item_stat(items[ii], &st);
+        filler(buffer, items[ii]->name, &st, 0, 0);
+    }
+    fs_unlock();
+    free(items);
     return 0;
 }
 
 static int fdo_mkdir(const char* path, mode_t mode) {
     path_string p_string;
     create_path_string(&p_string, path);
-    return fs_mkdir(&p_string, mode);
+    // the directory map takes care of concurrent creates
+    fs_rdlock();
+    int ret = fs_mkdir(&p_string, mode);
+    fs_unlock();
+    return ret;
 }
 
 static int fdo_mknod(const char* path, mode_t mode, dev_t rdev) {
     path_string p_string;
     create_path_string(&p_string, path);
-    return fs_mknod(&p_string, mode, rdev);
+    fs_rdlock();
+    int ret = fs_mknod(&p_string, mode, rdev);
+    fs_unlock();
+    return ret;
 }
 
 static int fdo_read(const char* path, char* buffer, size_t size, off_t offset, struct fuse_file_info* fi) {
-    return fs_read(fi->fh, buffer, size, offset);
+    fs_epoch_enter();
+    int ret = fs_read(fi->fh, buffer, size, offset);
+    fs_epoch_exit();
+    return ret;
+}
+
+/**
+ * Used instead of fdo_read with --memfd. Fuse reads the data straight from
+ * the memfd and can splice it to the kernel without a copy
+ */
+static int fdo_read_buf(const char* path, struct fuse_bufvec** bufp, size_t size, off_t offset, struct fuse_file_info* fi) {
+    struct fuse_bufvec* buf = malloc(sizeof(struct fuse_bufvec));
+    if (buf == NULL)
+        return -ENOMEM;
+    *buf = FUSE_BUFVEC_INIT(size);
+
+    int fd;
+    int ret = fs_read_fd(fi->fh, &fd);
+    if (ret == 0 && fd >= 0) {
+        buf->buf[0].flags = FUSE_BUF_IS_FD | FUSE_BUF_FD_SEEK;
+        buf->buf[0].fd = fd;
+        buf->buf[0].pos = offset;
+        *bufp = buf;
+        return 0;
+    }
+
+    // the file hasn't been written yet
+    buf->buf[0].mem = malloc(size);
+    if (buf->buf[0].mem == NULL) {
+        free(buf);
+        return -ENOMEM;
+    }
+    ret = fdo_read(path, buf->buf[0].mem, size, offset, fi);
+    if (ret < 0) {
+        free(buf->buf[0].mem);
+        free(buf);
+        return ret;
+    }
+    buf->buf[0].size = ret;
+    *bufp = buf;
+    return 0;
 }
 
 static int fdo_write(const char* path, const char* buffer, size_t size, off_t offset, struct fuse_file_info* fi) {
-    return fs_write(fi->fh, buffer, size, offset);
+    // not under the lock, the flusher needs it to catch up
+    fs_flush_wait();
+    fs_wrlock();
+    int ret = fs_write(fi->fh, buffer, size, offset);
+    fs_unlock();
+    return ret;
 }
 
 static int fdo_truncate(const char* path, off_t size, struct fuse_file_info* fi) {
+    int ret;
     path_string p_string;
+    if (fi == NULL)
+        create_path_string(&p_string, path);
+
+    fs_wrlock();
     if (fi != NULL) {
-        return fs_ftruncate(fi->fh, size);
+        ret = fs_ftruncate(fi->fh, size);
     } else {
-        create_path_string(&p_string, path);
-        return fs_truncate(&p_string, size);
+        ret = fs_truncate(&p_string, size);
     }
+    fs_unlock();
+    return ret;
 }
 
 static int fdo_unlink(const char* path) {
     path_string p_string;
     create_path_string(&p_string, path);
-    return fs_file_delete(&p_string);
+    fs_wrlock();
+    int ret = fs_file_delete(&p_string);
+    fs_unlock();
+    return ret;
 }
 
 static int fdo_rmdir(const char* path) {
     path_string p_string;
     create_path_string(&p_string, path);
-    return fs_dir_delete(&p_string);
+    fs_wrlock();
+    int ret = fs_dir_delete(&p_string);
+    fs_unlock();
+    return ret;
 }
 
 static int fdo_rename(const char* oldpath, const char* newpath, unsigned int flags) {
@@ -170,7 +322,10 @@ static int fdo_rename(const char* oldpath, const char* newpath, unsigned int fla
     create_path_string(&old, oldpath);
     path_string new;
     create_path_string(&new, newpath);
-    return fs_rename(&old, &new);
+    fs_wrlock();
+    int ret = fs_rename(&old, &new);
+    fs_unlock();
+    return ret;
 }
 
 static int fdo_symlink(const char* linkname, const char* path) {
@@ -188,12 +343,16 @@ static int fdo_open(const char* path, struct fuse_file_info* fi) {
     fs_item* item;
     path_string p_string;
     create_path_string(&p_string, path);
+    fs_rdlock();
     int ret = fs_access(&p_string, mode, &item);
+    if (ret == 0)
+        fi->fh = fs_fh_file_handle(item);
+    fs_unlock();
     if (ret != 0)
         return ret;
 
-    fi->fh = fs_fh_file_handle(item);
-
+    // file data only changes through the kernel so its page cache stays valid
+    fi->keep_cache = cache_timeout > 0;
     // TODO: force files being open when writing etc.
     //       how many times can you open the same file before closing it?
     // TODO: check access modes when implementing file permissions
@@ -229,11 +388,13 @@ static int fdo_opendir(const char* path, struct fuse_file_info* fi) {
     fs_item* item;
     path_string p_string;
     create_path_string(&p_string, path);
+    fs_rdlock();
     int ret = fs_access(&p_string, mode, &item);
+    if (ret == 0)
+        fi->fh = fs_fh_file_handle(item);
+    fs_unlock();
     if (ret != 0)
         return ret;
-
-    fi->fh = fs_fh_file_handle(item);
     return 0;
 }
 
@@ -248,29 +409,51 @@ static int fdo_fsyncdir(const char* path, int datasync, struct fuse_file_info* f
 }
 
 static int fdo_chmod(const char* path, mode_t mode, struct fuse_file_info* fi) {
+    int ret;
     path_string p_string;
+    if (fi == NULL)
+        create_path_string(&p_string, path);
+
+    fs_wrlock();
     if (fi != NULL) {
-        return fs_fchmod(fi->fh, mode);
+        ret = fs_fchmod(fi->fh, mode);
     } else {
-        create_path_string(&p_string, path);
-        return fs_chmod(&p_string, mode);
+        ret = fs_chmod(&p_string, mode);
     }
+    fs_unlock();
+    return ret;
 }
 
 static int fdo_chown(const char* path, uid_t uid, gid_t gid, struct fuse_file_info* fi) {
+    int ret;
     path_string p_string;
+    if (fi == NULL)
+        create_path_string(&p_string, path);
+
+    fs_wrlock();
     if (fi != NULL) {
-        return fs_fchown(fi->fh, uid, gid);
+        ret = fs_fchown(fi->fh, uid, gid);
     } else {
-        create_path_string(&p_string, path);
-        return fs_chown(&p_string, uid, gid);
+        ret = fs_chown(&p_string, uid, gid);
     }
+    fs_unlock();
+    return ret;
 }
 
 static int fdo_utimens(const char* path, const struct timespec tv[2], struct fuse_file_info* fi) {
-    // TODO: update fs_item's stat, check docs what whe tv should affect
-    // we don't care times for now so just no-op
-    return 0;
+    int ret;
+    path_string p_string;
+    if (fi == NULL)
+        create_path_string(&p_string, path);
+
+    fs_wrlock();
+    if (fi != NULL) {
+        ret = fs_futimens(fi->fh, tv);
+    } else {
+        ret = fs_utimens(&p_string, tv);
+    }
+    fs_unlock();
+    return ret;
 }
 
 static int fdo_access(const char* path, int mask) {
@@ -283,9 +466,131 @@ static int fdo_readlink(const char* path, char* buf, size_t len) {
     return -ENOSYS;
 }
 
+/**
+ * Thread group of a thread, fuse tells the thread that made the request
+ */
+static pid_t thread_group(pid_t pid) {
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/status", (int)pid);
+    FILE* status = fopen(path, "r");
+    if (status == NULL)
+        return -1;
+
+    char line[128];
+    int tgid = -1;
+    while (fgets(line, sizeof(line), status) != NULL && sscanf(line, "Tgid: %d", &tgid) != 1)
+        ;
+    fclose(status);
+    return tgid;
+}
+
+/**
+ * Get the file of an fd of the process calling the ioctl. The fd is taken
+ * over with pidfd_getfd instead of opening the file again, so the file has
+ * to be open for writing or reading in the caller already. Returns -EBADF
+ * when it isn't, like write and read do
+ */
+static int get_caller_fd(int32_t fd, bool write) {
+    pid_t pid = fuse_get_context()->pid;
+    int pidfd = syscall(SYS_pidfd_open, pid, 0);
+    if (pidfd < 0 && errno == EINVAL)
+        pidfd = syscall(SYS_pidfd_open, thread_group(pid), 0);
+    if (pidfd < 0)
+        return -errno;
+
+    int ret = syscall(SYS_pidfd_getfd, pidfd, fd, 0);
+    ret = ret < 0 ? -errno : ret;
+    close(pidfd);
+    if (ret < 0)
+        return ret;
+
+    int flags = fcntl(ret, F_GETFL);
+    if (flags < 0 || (flags & O_PATH) || (flags & O_ACCMODE) == (write ? O_RDONLY : O_WRONLY)) {
+        close(ret);
+        return -EBADF;
+    }
+    return ret;
+}
+
+static int archive_ioctl(file_handle fh, struct fs_ioc_archive* req, bool import) {
+    fs_dir* dir;
+    fs_rdlock();
+    int ret = fs_fh_get_dir(fh, &dir);
+    fs_unlock();
+    if (ret != 0)
+        return ret;
+
+    int fd = get_caller_fd(req->fd, !import);
+    if (fd < 0)
+        return fd;
+    // the open handle keeps the directory alive while the lock is given up
+    if (import) {
+        ret = fs_archive_import(dir->item, fd, &req->items);
+    } else {
+        ret = fs_archive_export(dir->item, fd, &req->items);
+    }
+    close(fd);
+    return ret;
+}
+
+static int scan_ioctl(file_handle fh, struct fs_ioc_scan* req) {
+    fs_dir* dir;
+    fs_rdlock();
+    int ret = fs_fh_get_dir(fh, &dir);
+    fs_unlock();
+    if (ret != 0)
+        return ret;
+
+    int fd = get_caller_fd(req->fd, true);
+    if (fd < 0)
+        return fd;
+    ret = fs_scan(dir->item, fd, &req->items);
+    close(fd);
+    return ret;
+}
+
 static int fdo_ioctl(const char* path, int cmd, void* arg, struct fuse_file_info* fi, unsigned int flags, void* data) {
-    printf("fdo_ioctl unimplemented\n");
-    return -ENOSYS;
+    int ret;
+    // 32bit ioctls are not supported
+    if (flags & FUSE_IOCTL_COMPAT)
+        return -ENOSYS;
+
+    switch ((unsigned int)cmd) {
+    case FS_IOC_SET_TTL:
+        fs_wrlock();
+        ret = fs_set_ttl(fi->fh, *(uint32_t*)data);
+        fs_unlock();
+        return ret;
+    case FS_IOC_RMTREE:
+        fs_wrlock();
+        ret = fs_rmtree(fi->fh, ((struct fs_ioc_rmtree*)data)->name);
+        fs_unlock();
+        return ret;
+    case FS_IOC_RESERVE:
+        fs_wrlock();
+        ret = fs_reserve(fi->fh, *(uint32_t*)data);
+        fs_unlock();
+        return ret;
+    case FS_IOC_GET_TTL:
+        fs_rdlock();
+        ret = fs_get_ttl(fi->fh, (uint32_t*)data);
+        fs_unlock();
+        return ret;
+    case FS_IOC_IMPORT:
+        return archive_ioctl(fi->fh, (struct fs_ioc_archive*)data, true);
+    case FS_IOC_EXPORT:
+        return archive_ioctl(fi->fh, (struct fs_ioc_archive*)data, false);
+    case FS_IOC_SCAN:
+        return scan_ioctl(fi->fh, (struct fs_ioc_scan*)data);
+    case FS_IOC_JOURNAL:
+        // the records name items all over the tree, not only under the
+        // handle, so they are only for the user who mounted the fs
+        if (fuse_get_context()->uid != getuid() && fuse_get_context()->uid != 0)
+            return -EPERM;
+        return fs_journal_read((struct fs_ioc_journal*)data);
+    default:
+        return -ENOTTY;
+    }
 }
 
 static int fdo_poll(const char* path, struct fuse_file_info* fi, struct fuse_pollhandle* ph, unsigned* reventsp) {
@@ -298,13 +603,475 @@ static int fdo_fallocate(const char* path, int mode, off_t offset, off_t length,
     return -ENOSYS;
 }
 
+/**
+ * Drop the kernel's entry of the path along with the attributes and data of
+ * its inode. fuse only offers the latter by path, the entry is dropped by the
+ * node id of the parent, which the mount shows as its inode number. A
+ * negative entry is dropped the same way
+ */
+static void invalidate_path(const char* path) {
+    fuse_invalidate_path(fuse_instance, path);
+    const char* name = strrchr(path, '/') + 1;
+    if (mount_path == NULL || *name == '\0')
+        return;
+
+    char parent[PATH_MAX];
+    struct stat st;
+    int len = snprintf(parent, sizeof(parent), "%s%.*s", mount_path, (int)(name - path), path);
+    if (len < (int)sizeof(parent) && stat(parent, &st) == 0)
+        fuse_lowlevel_notify_inval_entry(fuse_get_session(fuse_instance), st.st_ino, name, strlen(name));
+}
+
+/**
+ * Fuse forks when it goes to the background so the fs threads are started
+ * here instead of main
+ */
+static void* fdo_init(struct fuse_conn_info* conn, struct fuse_config* cfg) {
+    // the kernel updates its caches for the changes it makes and the fs
+    // notifies it about the rest, so they don't need to expire quickly
+    cfg->entry_timeout = cache_timeout;
+    cfg->attr_timeout = cache_timeout;
+    // names that don't exist can be cached as long. The kernel replaces the
+    // negative entry itself when it creates or renames something over it,
+    // imports drop it through the notifications
+    cfg->negative_timeout = negative_timeout < 0 ? cache_timeout : negative_timeout;
+    // the notifications find the parent of an entry by its inode number
+    cfg->use_ino = 0;
+    // big requests pay the handle lookup and the request overhead less often
+    if (conn_opts.max_read != 0)
+        conn->max_read = conn_opts.max_read;
+    if (conn_opts.max_write != 0)
+        conn->max_write = conn_opts.max_write;
+    // the kernel offers its readahead as the upper limit
+    if (conn_opts.max_readahead != 0 && conn_opts.max_readahead < conn->max_readahead)
+        conn->max_readahead = conn_opts.max_readahead;
+    if (conn_opts.max_background != 0)
+        conn->max_background = conn_opts.max_background;
+    if (conn_opts.congestion_threshold != 0)
+        conn->congestion_threshold = conn_opts.congestion_threshold;
+    // the kernel batches small writes into pages and owns the size and mtime
+    // of the written files until it flushes them
+    if (writeback_cache && (conn->capable & FUSE_CAP_WRITEBACK_CACHE))
+        conn->want |= FUSE_CAP_WRITEBACK_CACHE;
+    if (fs_memfd_enabled() && (conn->capable & FUSE_CAP_SPLICE_WRITE))
+        conn->want |= FUSE_CAP_SPLICE_WRITE;
+    if (cache_timeout > 0) {
+        fuse_instance = fuse_get_context()->fuse;
+        fs_notify_set_handler(invalidate_path);
+    }
+    init_fs();
+    if (state_path != NULL) {
+        fs_wrlock();
+        int ret = fs_image_load(state_path);
+        fs_unlock();
+        // the first start has nothing to restore. The image was checked
+        // before mounting so this is rare, but saving the partial tree over
+        // it on unmount would lose the rest
+        if (ret != 0 && ret != -ENOENT) {
+            fprintf(stderr, "restoring '%s' failed: %s\n", state_path, strerror(-ret));
+            free(state_path);
+            state_path = NULL;
+            fuse_exit(fuse_get_context()->fuse);
+        }
+    }
+    if (import_fd >= 0) {
+        path_string root_path;
+        fs_item* root;
+        fs_rdlock();
+        int ret = parse_path_string(&root_path, "/");
+        if (ret == 0)
+            ret = fs_lookup(&root_path, &root);
+        fs_unlock();
+        uint64_t items;
+        if (ret == 0)
+            ret = fs_archive_import(root, import_fd, &items);
+        if (ret != 0)
+            fprintf(stderr, "importing the archive failed: %s\n", strerror(-ret));
+        close(import_fd);
+        import_fd = -1;
+    }
+    return NULL;
+}
+
+static void fdo_destroy(void* private_data) {
+    if (state_path != NULL) {
+        fs_wrlock();
+        int ret = fs_image_save(state_path);
+        fs_unlock();
+        if (ret != 0)
+            fprintf(stderr, "saving '%s' failed: %s\n", state_path, strerror(-ret));
+    }
+    free_fs();
+}
+
+static const struct fuse_opt fs_opts[] = {
+    // --ttl=<path>:<seconds> remove items under path after seconds of inactivity
+    FUSE_OPT_KEY("--ttl=", KEY_TTL),
+    // --cache-timeout=<seconds> how long the kernel caches lookups and
+    // attributes, 0 turns the caching off
+    FUSE_OPT_KEY("--cache-timeout=", KEY_CACHE_TIMEOUT),
+    // --negative-timeout=<seconds> how long the kernel caches lookups of
+    // names that don't exist, same as --cache-timeout by default
+    FUSE_OPT_KEY("--negative-timeout=", KEY_NEGATIVE_TIMEOUT),
+    // --writeback-cache let the kernel cache writes and send them in batches
+    FUSE_OPT_KEY("--writeback-cache", KEY_WRITEBACK_CACHE),
+    // --memfd keep the file data in memfds, see fs_memfd.c
+    FUSE_OPT_KEY("--memfd", KEY_MEMFD),
+    // --workers=<n> handle the requests with n threads started at once
+    // instead of the fuse loop, see fs_session.c
+    FUSE_OPT_KEY("--workers=", KEY_WORKERS),
+    // --pin-workers pin each worker to a cpu, needs --workers
+    FUSE_OPT_KEY("--pin-workers", KEY_PIN_WORKERS),
+    // --io-uring carry the requests over io_uring instead of reading and
+    // writing /dev/fuse when the kernel and fuse support it
+    FUSE_OPT_KEY("--io-uring", KEY_IO_URING),
+    // --max-read=<bytes> largest read request
+    FUSE_OPT_KEY("--max-read=", KEY_MAX_READ),
+    // --max-write=<bytes> largest write request, 1 MiB by default
+    FUSE_OPT_KEY("--max-write=", KEY_MAX_WRITE),
+    // --max-readahead=<bytes> how much the kernel reads ahead of a reader
+    FUSE_OPT_KEY("--max-readahead=", KEY_MAX_READAHEAD),
+    // --max-background=<n> background requests, like readahead, in flight
+    FUSE_OPT_KEY("--max-background=", KEY_MAX_BACKGROUND),
+    // --congestion-threshold=<n> background requests before the kernel
+    // reports the fs as congested
+    FUSE_OPT_KEY("--congestion-threshold=", KEY_CONGESTION_THRESHOLD),
+    // --state=<file> save the tree to file on unmount and restore it from
+    // there when mounted again, see fs_image.c
+    FUSE_OPT_KEY("--state=", KEY_STATE),
+    // --lower=<dir> serve the items of dir, reading them in when they are
+    // first used, see fs_lower.c
+    FUSE_OPT_KEY("--lower=", KEY_LOWER),
+    // --lower-cache=<MiB> file data read in from --lower that is kept
+    // before the oldest is dropped, half of the ram by default
+    FUSE_OPT_KEY("--lower-cache=", KEY_LOWER_CACHE),
+    // --write-behind=<dir> make the changes to the tree in dir as well, in
+    // the background, see fs_flush.c
+    FUSE_OPT_KEY("--write-behind=", KEY_WRITE_BEHIND),
+    // --write-behind-limit=<MiB> written data that can wait for the
+    // background writes before writers wait, 256 by default
+    FUSE_OPT_KEY("--write-behind-limit=", KEY_WRITE_BEHIND_LIMIT),
+    // --import=<archive.tar> fill the tree from the archive when mounted,
+    // after --state, see fs_archive.c
+    FUSE_OPT_KEY("--import=", KEY_IMPORT),
+    // --journal=<records> keep the last changes to the tree for
+    // FS_IOC_JOURNAL, see fs_journal.c
+    FUSE_OPT_KEY("--journal=", KEY_JOURNAL),
+    // fuse's own, only noted so they aren't silently ignored with --workers
+    FUSE_OPT_KEY("max_threads=", KEY_THREAD_LIMIT),
+    FUSE_OPT_KEY("max_idle_threads=", KEY_THREAD_LIMIT),
+    FUSE_OPT_END
+};
+
+/**
+ * Parse a non negative timeout in seconds
+ */
+static int parse_seconds(const char* str, double* buf) {
+    char* end;
+    double seconds = strtod(str, &end);
+    if (end == str || *end != '\0' || !(seconds >= 0))
+        return -EINVAL;
+
+    *buf = seconds;
+    return 0;
+}
+
+/**
+ * Copy of the path relative to the current directory since fuse moves to
+ * the root when it goes to the background. NULL if empty or on errors
+ */
+static char* absolute_path(const char* path) {
+    if (path[0] == '\0')
+        return NULL;
+    if (path[0] == '/')
+        return strdup(path);
+
+    char cwd[PATH_MAX];
+    if (getcwd(cwd, sizeof(cwd)) == NULL)
+        return NULL;
+    char* abs = malloc(strlen(cwd) + 1 + strlen(path) + 1);
+    if (abs != NULL)
+        sprintf(abs, "%s/%s", cwd, path);
+    return abs;
+}
+
+/**
+ * Parse a positive value of a --<name>=<n> option
+ */
+static int parse_conn_opt(const char* arg, unsigned* buf) {
+    const char* value = strchr(arg, '=') + 1;
+    char* end;
+    errno = 0;
+    unsigned long parsed = strtoul(value, &end, 10);
+    if (end == value || *end != '\0' || errno != 0 || parsed == 0 || parsed > UINT_MAX) {
+        fprintf(stderr, "invalid value '%s', expected a positive number\n", arg);
+        return -1;
+    }
+
+    *buf = parsed;
+    return 0;
+}
+
+static int fs_opt_proc(void* data, const char* arg, int key, struct fuse_args* outargs) {
+    switch (key) {
+    case KEY_TTL:
+        if (fs_ttl_add_rule(arg + strlen("--ttl=")) != 0) {
+            fprintf(stderr, "invalid ttl rule '%s', expected --ttl=<path>:<seconds>\n", arg);
+            return -1;
+        }
+        return 0;
+    case KEY_CACHE_TIMEOUT:
+        if (parse_seconds(arg + strlen("--cache-timeout="), &cache_timeout) != 0) {
+            fprintf(stderr, "invalid cache timeout '%s', expected --cache-timeout=<seconds>\n", arg);
+            return -1;
+        }
+        return 0;
+    case KEY_NEGATIVE_TIMEOUT:
+        if (parse_seconds(arg + strlen("--negative-timeout="), &negative_timeout) != 0) {
+            fprintf(stderr, "invalid negative timeout '%s', expected --negative-timeout=<seconds>\n", arg);
+            return -1;
+        }
+        return 0;
+    case KEY_WRITEBACK_CACHE:
+        writeback_cache = true;
+        return 0;
+    case KEY_MEMFD: {
+        int ret = fs_memfd_enable();
+        if (ret != 0) {
+            fprintf(stderr, "can't use memfds for the files: %s\n", strerror(-ret));
+            return -1;
+        }
+        operations.read_buf = fdo_read_buf;
+        return 0;
+    }
+    case KEY_WORKERS: {
+        char* end;
+        const char* count = arg + strlen("--workers=");
+        unsigned long workers = strtoul(count, &end, 10);
+        if (end == count || *end != '\0' || workers == 0 || workers > MAX_WORKERS) {
+            fprintf(stderr, "invalid worker count '%s', expected --workers=<1-%d>\n", arg, MAX_WORKERS);
+            return -1;
+        }
+        session_config.workers = workers;
+        return 0;
+    }
+    case KEY_PIN_WORKERS:
+        session_config.pin = true;
+        return 0;
+    case KEY_IO_URING:
+        io_uring = true;
+        return 0;
+    case KEY_THREAD_LIMIT:
+        thread_limits = true;
+        // fuse parses them from the remaining arguments
+        return 1;
+    case KEY_STATE:
+        free(state_path);
+        state_path = absolute_path(arg + strlen("--state="));
+        if (state_path == NULL) {
+            fprintf(stderr, "invalid state file '%s', expected --state=<file>\n", arg);
+            return -1;
+        }
+        return 0;
+    case KEY_LOWER: {
+        int ret = fs_lower_enable(arg + strlen("--lower="));
+        if (ret != 0) {
+            fprintf(stderr, "can't use '%s' as the lower directory: %s\n", arg + strlen("--lower="), strerror(-ret));
+            return -1;
+        }
+        return 0;
+    }
+    case KEY_LOWER_CACHE: {
+        unsigned mib;
+        if (parse_conn_opt(arg, &mib) != 0)
+            return -1;
+        fs_lower_set_limit((size_t)mib << 20);
+        return 0;
+    }
+    case KEY_WRITE_BEHIND: {
+        int ret = fs_flush_enable(arg + strlen("--write-behind="));
+        if (ret != 0) {
+            fprintf(stderr, "can't write behind to '%s': %s\n", arg + strlen("--write-behind="), strerror(-ret));
+            return -1;
+        }
+        return 0;
+    }
+    case KEY_IMPORT:
+        if (import_fd >= 0)
+            close(import_fd);
+        import_fd = open(arg + strlen("--import="), O_RDONLY | O_CLOEXEC);
+        if (import_fd < 0) {
+            fprintf(stderr, "can't open the archive '%s': %s\n", arg + strlen("--import="), strerror(errno));
+            return -1;
+        }
+        return 0;
+    case KEY_JOURNAL: {
+        unsigned records;
+        if (parse_conn_opt(arg, &records) != 0)
+            return -1;
+        int ret = fs_journal_set_size(records);
+        if (ret == -EINVAL) {
+            fprintf(stderr, "invalid journal size '%s', expected --journal=<1-%u>\n", arg, FS_JOURNAL_MAX);
+            return -1;
+        }
+        if (ret != 0) {
+            fprintf(stderr, "can't keep a journal of %u records: %s\n", records, strerror(-ret));
+            return -1;
+        }
+        return 0;
+    }
+    case KEY_WRITE_BEHIND_LIMIT: {
+        unsigned mib;
+        if (parse_conn_opt(arg, &mib) != 0)
+            return -1;
+        fs_flush_set_limit((size_t)mib << 20);
+        return 0;
+    }
+    case KEY_MAX_READ:
+        return parse_conn_opt(arg, &conn_opts.max_read);
+    case KEY_MAX_WRITE:
+        return parse_conn_opt(arg, &conn_opts.max_write);
+    case KEY_MAX_READAHEAD:
+        return parse_conn_opt(arg, &conn_opts.max_readahead);
+    case KEY_MAX_BACKGROUND:
+        return parse_conn_opt(arg, &conn_opts.max_background);
+    case KEY_CONGESTION_THRESHOLD:
+        return parse_conn_opt(arg, &conn_opts.congestion_threshold);
+    default:
+        // let fuse handle the rest
+        return 1;
+    }
+}
+
+/**
+ * Check that requests can be sent over io_uring. Fuse has it from 3.18 and
+ * the kernel from 6.14, where it is turned on with fuse.enable_uring
+ */
+static bool io_uring_usable() {
+#if FUSE_VERSION < FUSE_MAKE_VERSION(3, 18)
+    fprintf(stderr, "fuse %s has no io_uring support, using /dev/fuse\n", fuse_pkgversion());
+    return false;
+#else
+    FILE* param = fopen("/sys/module/fuse/parameters/enable_uring", "r");
+    int enabled = param != NULL ? fgetc(param) : EOF;
+    if (param != NULL)
+        fclose(param);
+
+    if (enabled != 'Y') {
+        fprintf(stderr, "fuse over io_uring is not enabled in the kernel (fuse.enable_uring), using /dev/fuse\n");
+        return false;
+    }
+    return true;
+#endif
+}
+
+/**
+ * Serve the mounted fs until it is unmounted or the daemon is signaled
+ */
+static int loop(struct fuse* fuse, const struct fuse_cmdline_opts* opts) {
+    struct fuse_session* se = fuse_get_session(fuse);
+    if (fuse_daemonize(opts->foreground) != 0 || fuse_set_signal_handlers(se) != 0)
+        return 1;
+
+    int ret;
+    if (opts->singlethread) {
+        ret = fuse_loop(fuse);
+    } else if (session_config.workers != 0) {
+        ret = fs_session_loop(fuse, &session_config);
+    } else {
+        struct fuse_loop_config config = {
+            .clone_fd = opts->clone_fd,
+            .max_idle_threads = opts->max_idle_threads,
+        };
+        ret = fuse_loop_mt(fuse, &config);
+    }
+
+    fuse_remove_signal_handlers(se);
+    return ret != 0;
+}
+
+/**
+ * fuse_main with a choice of the request loop
+ */
+static int run(struct fuse_args* args, const struct fuse_cmdline_opts* opts) {
+    if (opts->show_version) {
+        printf("FUSE library version %s\n", fuse_pkgversion());
+        fuse_lowlevel_version();
+        return 0;
+    } else if (opts->show_help) {
+        printf("usage: %s [options] <mountpoint>\n\n", args->argv[0]);
+        fuse_cmdline_help();
+        fuse_lib_help(args);
+        return 0;
+    } else if (opts->mountpoint == NULL) {
+        fprintf(stderr, "no mountpoint given, see %s --help\n", args->argv[0]);
+        return 1;
+    } else if (session_config.pin && session_config.workers == 0) {
+        fprintf(stderr, "--pin-workers needs --workers=<n>\n");
+        return 1;
+    } else if (opts->clone_fd && session_config.workers != 0) {
+        fprintf(stderr, "-o clone_fd can't be used with --workers=<n>\n");
+        return 1;
+    } else if (io_uring && session_config.workers != 0) {
+        fprintf(stderr, "--io-uring can't be used with --workers=<n>\n");
+        return 1;
+    } else if (thread_limits && session_config.workers != 0) {
+        fprintf(stderr, "-o max_threads and -o max_idle_threads can't be used with --workers=<n>\n");
+        return 1;
+    }
+
+    // a broken image fails the mount instead of starting with an empty tree
+    // that is saved over it on unmount
+    if (state_path != NULL) {
+        int ret = fs_image_check(state_path);
+        if (ret != 0 && ret != -ENOENT) {
+            fprintf(stderr, "can't restore '%s': %s\n", state_path, strerror(-ret));
+            return 1;
+        }
+    }
+
+    // fuse sets up the rings for the session if the kernel offers them at
+    // init and keeps using /dev/fuse otherwise
+    if (io_uring && io_uring_usable())
+        fuse_opt_add_arg(args, "-oio_uring");
+    // the kernel only learns the read limit from the mount options
+    if (conn_opts.max_read != 0) {
+        char max_read[32];
+        snprintf(max_read, sizeof(max_read), "-omax_read=%u", conn_opts.max_read);
+        fuse_opt_add_arg(args, max_read);
+    }
+
+    mount_path = opts->mountpoint;
+    struct fuse* fuse = fuse_new(args, &operations, sizeof(operations), NULL);
+    if (fuse == NULL)
+        return 1;
+
+    int ret = 1;
+    if (fuse_mount(fuse, opts->mountpoint) == 0) {
+        ret = loop(fuse, opts);
+        fuse_unmount(fuse);
+    }
+    fuse_destroy(fuse);
+    return ret;
+}
+
 int main(int argc, char* argv[]) {
     // TODO: try to create the directory that's given as an arg
     int ret = 0;
-    init_fs();
+    struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+    if (fuse_opt_parse(&args, NULL, fs_opts, fs_opt_proc) != 0)
+        return 1;
+
     // TODO: by default fuse uses umask 0022 so file mode cannot be 777 etc
     //       manually set umask to be 0000 so user can define the file mode freely
-    ret = fuse_main(argc, argv, &operations, NULL);
-    free_fs();
+    struct fuse_cmdline_opts opts;
+    if (fuse_parse_cmdline(&args, &opts) != 0) {
+        fuse_opt_free_args(&args);
+        return 1;
+    }
+    ret = run(&args, &opts);
+    free(opts.mountpoint);
+    free(state_path);
+    fuse_opt_free_args(&args);
     return ret;
 }
@@ -283,6 +283,36 @@
 	}                                                                      \
                                                                                \
 	/** NOLINTNEXTLINE */                                                  \
+	bool sc_map_lookup_##name(const struct sc_map_##name *m, K key,        \
+				  V *value)                                    \
+	{                                                                      \
+		const uint32_t mod = m->cap - 1;                               \
+		uint32_t h, pos;                                               \
+                                                                               \
+		if (key == 0) {                                                \
+			if (m->used) {                                         \
+				*value = m->mem[-1].value;                     \
+			}                                                      \
+			return m->used;                                        \
+		}                                                              \
+                                                                               \
+		h = hash_fn(key);                                              \
+		pos = h & mod;                                                 \
+                                                                               \
+		while (true) {                                                 \
+			if (m->mem[pos].key == 0) {                            \
+				return false;                                  \
+			} else if (!sc_map_cmp_##name(&m->mem[pos], key, h)) { \
+				pos = (pos + 1) & (mod);                       \
+				continue;                                      \
+			}                                                      \
+                                                                               \
+			*value = m->mem[pos].value;                            \
+			return true;                                           \
+		}                                                              \
+	}                                                                      \
+                                                                               \
+	/** NOLINTNEXTLINE */                                                  \
 	V sc_map_del_##name(struct sc_map_##name *m, K key)                    \
 	{                                                                      \
 		const uint32_t mod = m->cap - 1;                               \
@@ -136,6 +136,19 @@
 	/** NOLINTNEXTLINE */                                                  \
 	V sc_map_get_##name(struct sc_map_##name *map, K key);                 \
                                                                                \
+	/**                                                                    \
+	 * Get element without modifying the map. Safe to call from multiple   \
+	 * threads at once as long as nobody is modifying the map.             \
+	 *                                                                     \
+	 * @param map map                                                      \
+	 * @param K key                                                        \
+	 * @param value set to the current value if exists                     \
+	 * @return 'true' if the key exists                                    \
+	 */                                                                    \
+	/** NOLINTNEXTLINE */                                                  \
+	bool sc_map_lookup_##name(const struct sc_map_##name *map, K key,      \
+				  V *value);                                   \
+                                                                               \
 	/**                                                                    \
 	 * Delete element                                                      \
 	 *                                                                     \
@@ -1,10 +1,10 @@
 #ifndef UTIL_H
 #define UTIL_H
 
-#define FUSE_USE_VERSION 30
+#define FUSE_USE_VERSION 32
 
 #if __STDC_VERSION__ >= 199901L
-#define _XOPEN_SOURCE 600
+#define _XOPEN_SOURCE 700
 #else
 #define _XOPEN_SOURCE 500
 #endif /* __STDC_VERSION__ */
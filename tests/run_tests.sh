@@ -30,7 +30,7 @@ function unlink_setup {
 
 function set_up {
     mkdir -p $MOUNT_PATH
-    ./fuse_mount $MOUNT_PATH
+    ./fuse_mount --journal=4096 $MOUNT_PATH
     mkdir -p $MOUNT_PATH/test_dir
     read_dir
     unlink_setup
@@ -0,0 +1,565 @@
+// TEST_SYSCALLS: ioctl
+/**
+ * Tests for ioctl syscall and the fs specific ioctl commands
+ * https://man7.org/linux/man-pages/man2/ioctl.2.html
+ */
+
+#include <sys/ioctl.h>
+
+#include "../src/fs_ioctl.h"
+#include "test_util.h"
+
+START_TEST(ttl_success) {
+    uint32_t ttl = 1;
+    struct stat st;
+    ck_assert_int_eq(mkdir(FS_PATH "ttl", 0755), 0);
+    ck_assert_int_eq(mkdir(FS_PATH "ttl/expire", 0755), 0);
+    int dfd = open(FS_PATH "ttl/expire", O_RDONLY);
+    ck_assert_int_ge(dfd, 2);
+    ck_assert_int_eq(ioctl(dfd, FS_IOC_SET_TTL, &ttl), 0);
+    close(dfd);
+
+    int fd = open(FS_PATH "ttl/expire/foo.txt", O_RDWR | O_CREAT, DEF_FILE_MODE);
+    ck_assert_int_ge(fd, 2);
+    ttl = 0;
+    ck_assert_int_eq(ioctl(fd, FS_IOC_GET_TTL, &ttl), 0);
+    ck_assert_int_eq(ttl, 1);
+    close(fd);
+
+    fd = open(FS_PATH "ttl/keep.txt", O_RDWR | O_CREAT, DEF_FILE_MODE);
+    ck_assert_int_ge(fd, 2);
+    ck_assert_int_eq(ioctl(fd, FS_IOC_GET_TTL, &ttl), 0);
+    ck_assert_int_eq(ttl, 0);
+    close(fd);
+
+    sleep(3);
+    fn_errno(stat(FS_PATH "ttl/expire/foo.txt", &st), ENOENT);
+    ck_assert_int_eq(stat(FS_PATH "ttl/expire", &st), 0);
+    ck_assert_int_eq(stat(FS_PATH "ttl/keep.txt", &st), 0);
+    test_readdirh(FS_PATH "ttl", "expire", "keep.txt", NULL);
+
+    // the kernel dropped its entry, so the name can be created again
+    fd = open(FS_PATH "ttl/expire/foo.txt", O_WRONLY | O_CREAT, DEF_FILE_MODE);
+    ck_assert_int_ge(fd, 2);
+    close(fd);
+}
+END_TEST
+
+START_TEST(ttl_errors) {
+    uint32_t ttl = 1;
+    int fd = open(FS_PATH "ttl/keep.txt", O_RDONLY);
+    ck_assert_int_ge(fd, 2);
+    fn_errno(ioctl(fd, _IOW(FS_IOC_MAGIC, 0xff, uint32_t), &ttl), ENOTTY);
+    close(fd);
+    fn_errno(ioctl(-1, FS_IOC_SET_TTL, &ttl), EBADF);
+}
+END_TEST
+
+START_TEST(rmtree_success) {
+    struct fs_ioc_rmtree req = { .name = "tree" };
+    struct stat st;
+    ck_assert_int_eq(mkdir(FS_PATH "rmtree", 0755), 0);
+    ck_assert_int_eq(mkdir(FS_PATH "rmtree/tree", 0755), 0);
+    ck_assert_int_eq(mkdir(FS_PATH "rmtree/tree/sub", 0755), 0);
+    ck_assert_int_eq(mkdir(FS_PATH "rmtree/tree/sub/deep", 0755), 0);
+    for (int ii = 0; ii < 100; ii++) {
+        char path[64];
+        sprintf(path, FS_PATH "rmtree/tree/sub/file%d.txt", ii);
+        int fd = open(path, O_RDWR | O_CREAT, DEF_FILE_MODE);
+        ck_assert_int_ge(fd, 2);
+        ck_assert_int_eq(write(fd, path, strlen(path)), strlen(path));
+        close(fd);
+    }
+    int fd = open(FS_PATH "rmtree/keep.txt", O_RDWR | O_CREAT, DEF_FILE_MODE);
+    ck_assert_int_ge(fd, 2);
+    close(fd);
+
+    int dfd = open(FS_PATH "rmtree", O_RDONLY);
+    ck_assert_int_ge(dfd, 2);
+    ck_assert_int_eq(ioctl(dfd, FS_IOC_RMTREE, &req), 0);
+    close(dfd);
+
+    test_readdirh(FS_PATH "rmtree", "keep.txt", NULL);
+    fn_errno(stat(FS_PATH "rmtree/tree", &st), ENOENT);
+
+    // the name can be reused right away
+    fd = open(FS_PATH "rmtree/tree", O_WRONLY | O_CREAT, DEF_FILE_MODE);
+    ck_assert_int_ge(fd, 2);
+    close(fd);
+    ck_assert_int_eq(unlink(FS_PATH "rmtree/tree"), 0);
+    ck_assert_int_eq(mkdir(FS_PATH "rmtree/tree", 0755), 0);
+    test_readdirh(FS_PATH "rmtree/tree", NULL);
+}
+END_TEST
+
+START_TEST(rmtree_errors) {
+    struct fs_ioc_rmtree req = { .name = "missing" };
+    int dfd = open(FS_PATH "rmtree", O_RDONLY);
+    ck_assert_int_ge(dfd, 2);
+    fn_errno(ioctl(dfd, FS_IOC_RMTREE, &req), ENOENT);
+    strcpy(req.name, "tree/sub");
+    fn_errno(ioctl(dfd, FS_IOC_RMTREE, &req), EINVAL);
+    strcpy(req.name, "..");
+    fn_errno(ioctl(dfd, FS_IOC_RMTREE, &req), EINVAL);
+    memset(req.name, 'a', sizeof(req.name));
+    fn_errno(ioctl(dfd, FS_IOC_RMTREE, &req), ENAMETOOLONG);
+    close(dfd);
+
+    strcpy(req.name, "tree");
+    int fd = open(FS_PATH "rmtree/keep.txt", O_RDONLY);
+    ck_assert_int_ge(fd, 2);
+    fn_errno(ioctl(fd, FS_IOC_RMTREE, &req), ENOTDIR);
+    close(fd);
+}
+END_TEST
+
+START_TEST(reserve_success) {
+    uint32_t count = 1000;
+    ck_assert_int_eq(mkdir(FS_PATH "reserve", 0755), 0);
+    int dfd = open(FS_PATH "reserve", O_RDONLY);
+    ck_assert_int_ge(dfd, 2);
+    ck_assert_int_eq(ioctl(dfd, FS_IOC_RESERVE, &count), 0);
+    close(dfd);
+
+    for (int ii = 0; ii < 1000; ii++) {
+        char path[64];
+        sprintf(path, FS_PATH "reserve/file%d.txt", ii);
+        int fd = open(path, O_RDWR | O_CREAT, DEF_FILE_MODE);
+        ck_assert_int_ge(fd, 2);
+        close(fd);
+    }
+    for (int ii = 1; ii < 1000; ii++) {
+        char path[64];
+        sprintf(path, FS_PATH "reserve/file%d.txt", ii);
+        ck_assert_int_eq(unlink(path), 0);
+    }
+    test_readdirh(FS_PATH "reserve", "file0.txt", NULL);
+}
+END_TEST
+
+static int count_items(const char* path) {
+    DIR* dh = opendir(path);
+    ck_assert_ptr_nonnull(dh);
+    int count = 0;
+    struct dirent* dent;
+    while ((dent = readdir(dh)) != NULL) {
+        if (strcmp(dent->d_name, ".") != 0 && strcmp(dent->d_name, "..") != 0)
+            count++;
+    }
+    closedir(dh);
+    return count;
+}
+
+START_TEST(reserve_resize) {
+    char path[64];
+    struct stat st;
+    // grows through several resizes whose items are moved over a few at a
+    // time, while new names are looked up
+    ck_assert_int_eq(mkdir(FS_PATH "resize", 0755), 0);
+    for (int ii = 0; ii < 5000; ii++) {
+        sprintf(path, FS_PATH "resize/file%d.txt", ii);
+        fn_errno(stat(path, &st), ENOENT);
+        int fd = open(path, O_RDWR | O_CREAT, DEF_FILE_MODE);
+        ck_assert_int_ge(fd, 2);
+        close(fd);
+        if (ii % 250 == 0)
+            ck_assert_int_eq(count_items(FS_PATH "resize"), ii + 1);
+    }
+
+    // and shrinks back down while the names are removed
+    for (int ii = 0; ii < 4990; ii++) {
+        sprintf(path, FS_PATH "resize/file%d.txt", ii);
+        ck_assert_int_eq(unlink(path), 0);
+        fn_errno(stat(path, &st), ENOENT);
+        if (ii % 250 == 0)
+            ck_assert_int_eq(count_items(FS_PATH "resize"), 5000 - ii - 1);
+    }
+    test_readdirh(FS_PATH "resize", "file4990.txt", "file4991.txt", "file4992.txt", "file4993.txt",
+        "file4994.txt", "file4995.txt", "file4996.txt", "file4997.txt", "file4998.txt", "file4999.txt", NULL);
+    for (int ii = 4990; ii < 5000; ii++) {
+        sprintf(path, FS_PATH "resize/file%d.txt", ii);
+        ck_assert_int_eq(stat(path, &st), 0);
+    }
+}
+END_TEST
+
+START_TEST(reserve_errors) {
+    uint32_t count = FS_IOC_RESERVE_MAX + 1;
+    int dfd = open(FS_PATH "reserve", O_RDONLY);
+    ck_assert_int_ge(dfd, 2);
+    fn_errno(ioctl(dfd, FS_IOC_RESERVE, &count), EINVAL);
+    close(dfd);
+
+    count = 10;
+    int fd = open(FS_PATH "reserve/file0.txt", O_RDONLY);
+    ck_assert_int_ge(fd, 2);
+    fn_errno(ioctl(fd, FS_IOC_RESERVE, &count), ENOTDIR);
+    close(fd);
+}
+END_TEST
+
+START_TEST(import_success) {
+    struct fs_ioc_archive req = { .fd = -1 };
+    struct stat st;
+    char buf[64];
+    ck_assert_int_eq(system("rm -rf /tmp/fs_import && mkdir -p /tmp/fs_import/src/sub/deep"
+                            " && echo foo > /tmp/fs_import/src/foo.txt"
+                            " && echo bar > /tmp/fs_import/src/sub/deep/bar.txt"
+                            " && tar cf /tmp/fs_import/src.tar -C /tmp/fs_import/src ."),
+        0);
+    ck_assert_int_eq(mkdir(FS_PATH "import", 0755), 0);
+    // the kernel caches the failed lookup until the import drops it
+    fn_errno(stat(FS_PATH "import/foo.txt", &st), ENOENT);
+
+    req.fd = open("/tmp/fs_import/src.tar", O_RDONLY);
+    ck_assert_int_ge(req.fd, 2);
+    int dfd = open(FS_PATH "import", O_RDONLY);
+    ck_assert_int_ge(dfd, 2);
+    ck_assert_int_eq(ioctl(dfd, FS_IOC_IMPORT, &req), 0);
+    ck_assert_int_eq(req.items, 4);
+    close(dfd);
+    close(req.fd);
+
+    test_readdirh(FS_PATH "import", "foo.txt", "sub", NULL);
+    test_readdirh(FS_PATH "import/sub/deep", "bar.txt", NULL);
+    ck_assert_int_eq(stat(FS_PATH "import/sub/deep/bar.txt", &st), 0);
+    ck_assert_int_eq(st.st_size, 4);
+    int fd = open(FS_PATH "import/foo.txt", O_RDONLY);
+    ck_assert_int_ge(fd, 2);
+    ck_assert_int_eq(read(fd, buf, sizeof(buf)), 4);
+    ck_assert_int_eq(memcmp(buf, "foo\n", 4), 0);
+    close(fd);
+}
+END_TEST
+
+START_TEST(import_replace) {
+    char buf[64];
+    // the later foo.txt of the archive wins, like with tar x
+    ck_assert_int_eq(system("mkdir -p /tmp/fs_import/new && echo new foo > /tmp/fs_import/new/foo.txt"
+                            " && cp /tmp/fs_import/src.tar /tmp/fs_import/dup.tar"
+                            " && tar rf /tmp/fs_import/dup.tar -C /tmp/fs_import/new foo.txt"),
+        0);
+    struct fs_ioc_archive req = { .fd = open("/tmp/fs_import/dup.tar", O_RDONLY) };
+    ck_assert_int_ge(req.fd, 2);
+    // the files are there from import_success and get replaced too
+    int dfd = open(FS_PATH "import", O_RDONLY);
+    ck_assert_int_ge(dfd, 2);
+    ck_assert_int_eq(ioctl(dfd, FS_IOC_IMPORT, &req), 0);
+    close(dfd);
+    close(req.fd);
+
+    test_readdirh(FS_PATH "import", "foo.txt", "sub", NULL);
+    test_readdirh(FS_PATH "import/sub/deep", "bar.txt", NULL);
+    int fd = open(FS_PATH "import/foo.txt", O_RDONLY);
+    ck_assert_int_ge(fd, 2);
+    ck_assert_int_eq(read(fd, buf, sizeof(buf)), 8);
+    ck_assert_int_eq(memcmp(buf, "new foo\n", 8), 0);
+    close(fd);
+}
+END_TEST
+
+START_TEST(import_errors) {
+    // a file can't replace a directory that has items
+    ck_assert_int_eq(system("mkdir -p /tmp/fs_import/file && echo sub > /tmp/fs_import/file/sub"
+                            " && tar cf /tmp/fs_import/file.tar -C /tmp/fs_import/file sub"),
+        0);
+    struct fs_ioc_archive req = { .fd = open("/tmp/fs_import/file.tar", O_RDONLY) };
+    ck_assert_int_ge(req.fd, 2);
+    int dfd = open(FS_PATH "import", O_RDONLY);
+    ck_assert_int_ge(dfd, 2);
+    fn_errno(ioctl(dfd, FS_IOC_IMPORT, &req), ENOTEMPTY);
+    close(dfd);
+    test_readdirh(FS_PATH "import/sub", "deep", NULL);
+
+    int fd = open(FS_PATH "import/foo.txt", O_RDONLY);
+    ck_assert_int_ge(fd, 2);
+    fn_errno(ioctl(fd, FS_IOC_IMPORT, &req), ENOTDIR);
+    close(fd);
+    close(req.fd);
+
+    // not an archive
+    req.fd = open("/tmp/fs_import/src/foo.txt", O_RDONLY);
+    ck_assert_int_ge(req.fd, 2);
+    ck_assert_int_eq(mkdir(FS_PATH "import/bad", 0755), 0);
+    dfd = open(FS_PATH "import/bad", O_RDONLY);
+    ck_assert_int_ge(dfd, 2);
+    fn_errno(ioctl(dfd, FS_IOC_IMPORT, &req), EINVAL);
+    close(dfd);
+    close(req.fd);
+}
+END_TEST
+
+START_TEST(export_success) {
+    struct fs_ioc_archive req = { .fd = open("/tmp/fs_import/out.tar", O_WRONLY | O_CREAT | O_TRUNC, 0644) };
+    ck_assert_int_ge(req.fd, 2);
+    int dfd = open(FS_PATH "import/sub", O_RDONLY);
+    ck_assert_int_ge(dfd, 2);
+    ck_assert_int_eq(ioctl(dfd, FS_IOC_EXPORT, &req), 0);
+    ck_assert_int_eq(req.items, 2);
+    close(dfd);
+    close(req.fd);
+
+    ck_assert_int_eq(system("mkdir -p /tmp/fs_import/out && tar xf /tmp/fs_import/out.tar -C /tmp/fs_import/out"
+                            " && diff -r /tmp/fs_import/src/sub /tmp/fs_import/out"),
+        0);
+}
+END_TEST
+
+START_TEST(export_errors) {
+    struct fs_ioc_archive req = { .fd = open("/tmp/fs_import/out.tar", O_WRONLY) };
+    ck_assert_int_ge(req.fd, 2);
+    int fd = open(FS_PATH "import/foo.txt", O_RDONLY);
+    ck_assert_int_ge(fd, 2);
+    fn_errno(ioctl(fd, FS_IOC_EXPORT, &req), ENOTDIR);
+    close(fd);
+    close(req.fd);
+
+    req.fd = -1;
+    int dfd = open(FS_PATH "import", O_RDONLY);
+    ck_assert_int_ge(dfd, 2);
+    fn_errno(ioctl(dfd, FS_IOC_EXPORT, &req), EBADF);
+
+    // the archive is written only through fds the caller can write to
+    req.fd = open("/tmp/fs_import/out.tar", O_RDONLY);
+    ck_assert_int_ge(req.fd, 2);
+    fn_errno(ioctl(dfd, FS_IOC_EXPORT, &req), EBADF);
+    close(req.fd);
+    req.fd = open("/tmp/fs_import/src.tar", O_WRONLY);
+    ck_assert_int_ge(req.fd, 2);
+    fn_errno(ioctl(dfd, FS_IOC_IMPORT, &req), EBADF);
+    close(req.fd);
+    close(dfd);
+}
+END_TEST
+
+START_TEST(scan_success) {
+    static char buf[4096];
+    struct fs_ioc_scan req = { .fd = open("/tmp/fs_import/scan", O_RDWR | O_CREAT | O_TRUNC, 0644) };
+    ck_assert_int_ge(req.fd, 2);
+    int dfd = open(FS_PATH "import", O_RDONLY);
+    ck_assert_int_ge(dfd, 2);
+    ck_assert_int_eq(ioctl(dfd, FS_IOC_SCAN, &req), 0);
+    // foo.txt, sub, sub/deep, sub/deep/bar.txt and bad from the import tests
+    ck_assert_int_eq(req.items, 5);
+    close(dfd);
+
+    ssize_t len = pread(req.fd, buf, sizeof(buf), 0);
+    close(req.fd);
+    ck_assert_int_ge(len, 1);
+    bool found = false;
+    uint64_t count = 0;
+    const struct fs_ioc_scan_record* rec = (const struct fs_ioc_scan_record*)buf;
+    for (; (const char*)rec < &buf[len]; rec = fs_ioc_scan_next(rec), count++) {
+        const char* path = (const char*)(rec + 1);
+        if (rec->path_len == strlen("sub/deep/bar.txt") && memcmp(path, "sub/deep/bar.txt", rec->path_len) == 0) {
+            ck_assert_int_eq(S_ISREG(rec->mode), true);
+            ck_assert_int_eq(rec->size, 4);
+            ck_assert_int_eq(rec->nlink, 1);
+            found = true;
+        }
+    }
+    ck_assert_int_eq((const char*)rec - buf, len);
+    ck_assert_int_eq(count, 5);
+    ck_assert_int_eq(found, true);
+}
+END_TEST
+
+START_TEST(scan_errors) {
+    struct fs_ioc_scan req = { .fd = open("/tmp/fs_import/scan", O_WRONLY) };
+    ck_assert_int_ge(req.fd, 2);
+    int fd = open(FS_PATH "import/foo.txt", O_RDONLY);
+    ck_assert_int_ge(fd, 2);
+    fn_errno(ioctl(fd, FS_IOC_SCAN, &req), ENOTDIR);
+    close(fd);
+    close(req.fd);
+
+    req.fd = -1;
+    int dfd = open(FS_PATH "import", O_RDONLY);
+    ck_assert_int_ge(dfd, 2);
+    fn_errno(ioctl(dfd, FS_IOC_SCAN, &req), EBADF);
+
+    req.fd = open("/tmp/fs_import/scan", O_RDONLY);
+    ck_assert_int_ge(req.fd, 2);
+    fn_errno(ioctl(dfd, FS_IOC_SCAN, &req), EBADF);
+    close(req.fd);
+    close(dfd);
+}
+END_TEST
+
+// cursor after everything recorded so far
+static uint64_t journal_end(int fd, struct fs_ioc_journal* req) {
+    req->cursor = 0;
+    do {
+        ck_assert_int_eq(ioctl(fd, FS_IOC_JOURNAL, req), 0);
+    } while (req->len != 0);
+    return req->cursor;
+}
+
+START_TEST(journal_success) {
+    static struct fs_ioc_journal req;
+    static const uint32_t ops[] = { FS_JOURNAL_CREATE, FS_JOURNAL_CREATE, FS_JOURNAL_WRITE, FS_JOURNAL_ATTR,
+        FS_JOURNAL_RENAME_FROM, FS_JOURNAL_RENAME_TO, FS_JOURNAL_REMOVE };
+    static const char* names[] = { "journal", "a", "a", "a", "a", "b", "b" };
+    int dfd = open(FS_PATH, O_RDONLY);
+    ck_assert_int_ge(dfd, 2);
+    uint64_t cursor = journal_end(dfd, &req);
+
+    ck_assert_int_eq(mkdir(FS_PATH "journal", 0755), 0);
+    int fd = open(FS_PATH "journal/a", O_WRONLY | O_CREAT, 0644);
+    ck_assert_int_ge(fd, 2);
+    // both writes are in one record
+    ck_assert_int_eq(write(fd, "foo", 3), 3);
+    ck_assert_int_eq(write(fd, "bar", 3), 3);
+    close(fd);
+    ck_assert_int_eq(chmod(FS_PATH "journal/a", 0600), 0);
+    ck_assert_int_eq(rename(FS_PATH "journal/a", FS_PATH "journal/b"), 0);
+    ck_assert_int_eq(unlink(FS_PATH "journal/b"), 0);
+
+    req.cursor = cursor;
+    ck_assert_int_eq(ioctl(dfd, FS_IOC_JOURNAL, &req), 0);
+    ck_assert_int_eq(req.lost, 0);
+    ck_assert_int_eq(req.cursor, cursor + 7);
+    const struct fs_ioc_journal_record* rec = (const struct fs_ioc_journal_record*)req.buf;
+    uint64_t dir_ino = rec->ino;
+    uint64_t file_ino = fs_ioc_journal_next(rec)->ino;
+    for (size_t ii = 0; ii < 7; ii++, rec = fs_ioc_journal_next(rec)) {
+        ck_assert_int_eq(rec->seq, cursor + ii);
+        ck_assert_int_eq(rec->op, ops[ii]);
+        ck_assert_int_eq(rec->ino, ii == 0 ? dir_ino : file_ino);
+        ck_assert_int_eq(rec->name_len, strlen(names[ii]));
+        ck_assert_int_eq(memcmp(rec + 1, names[ii], rec->name_len), 0);
+        if (ii != 0)
+            ck_assert_int_eq(rec->parent, dir_ino);
+    }
+    ck_assert_int_eq((const char*)rec - req.buf, req.len);
+    close(dfd);
+}
+END_TEST
+
+START_TEST(journal_errors) {
+    static struct fs_ioc_journal req;
+    int fd = open(FS_PATH "foo_file.txt", O_RDONLY);
+    ck_assert_int_ge(fd, 2);
+    uint64_t cursor = journal_end(fd, &req);
+    req.cursor = cursor + 1;
+    fn_errno(ioctl(fd, FS_IOC_JOURNAL, &req), EINVAL);
+
+    // changes of two items aren't folded and push the old records out
+    for (int ii = 0; ii < 4096; ii++) {
+        ck_assert_int_eq(chmod(FS_PATH "foo_file.txt", ii % 2 == 0 ? 0600 : 0644), 0);
+        ck_assert_int_eq(chmod(FS_PATH "foocreat_file.txt", ii % 2 == 0 ? 0600 : 0644), 0);
+    }
+    req.cursor = cursor;
+    ck_assert_int_eq(ioctl(fd, FS_IOC_JOURNAL, &req), 0);
+    ck_assert_int_eq(req.lost, 4096);
+    ck_assert_int_ge(req.len, 1);
+    ck_assert_int_eq(((const struct fs_ioc_journal_record*)req.buf)->seq, cursor + 4096);
+    close(fd);
+}
+END_TEST
+
+Suite* ttl_suite() {
+    Suite* s;
+    TCase* tc_core;
+
+    // first suite needs to have "\n " to make the output cleaner
+    s = suite_create("\n FS ioctl ttl");
+    tc_core = tcase_create("FS ioctl ttl Core");
+    // ttl tests need to wait for the items to expire
+    tcase_set_timeout(tc_core, 10);
+    tcase_add_test(tc_core, ttl_success);
+    tcase_add_test(tc_core, ttl_errors);
+    suite_add_tcase(s, tc_core);
+
+    return s;
+}
+
+Suite* rmtree_suite() {
+    Suite* s;
+    TCase* tc_core;
+
+    s = suite_create("FS ioctl rmtree");
+    tc_core = tcase_create("FS ioctl rmtree Core");
+    tcase_add_test(tc_core, rmtree_success);
+    tcase_add_test(tc_core, rmtree_errors);
+    suite_add_tcase(s, tc_core);
+
+    return s;
+}
+
+Suite* reserve_suite() {
+    Suite* s;
+    TCase* tc_core;
+
+    s = suite_create("FS ioctl reserve");
+    tc_core = tcase_create("FS ioctl reserve Core");
+    // the resize test creates and removes thousands of files
+    tcase_set_timeout(tc_core, 30);
+    tcase_add_test(tc_core, reserve_success);
+    tcase_add_test(tc_core, reserve_resize);
+    tcase_add_test(tc_core, reserve_errors);
+    suite_add_tcase(s, tc_core);
+
+    return s;
+}
+
+Suite* archive_suite() {
+    Suite* s;
+    TCase* tc_core;
+
+    s = suite_create("FS ioctl archives");
+    tc_core = tcase_create("FS ioctl archives Core");
+    tcase_add_test(tc_core, import_success);
+    tcase_add_test(tc_core, import_replace);
+    tcase_add_test(tc_core, import_errors);
+    tcase_add_test(tc_core, export_success);
+    tcase_add_test(tc_core, export_errors);
+    suite_add_tcase(s, tc_core);
+
+    return s;
+}
+
+Suite* scan_suite() {
+    Suite* s;
+    TCase* tc_core;
+
+    s = suite_create("FS ioctl scan");
+    tc_core = tcase_create("FS ioctl scan Core");
+    tcase_add_test(tc_core, scan_success);
+    tcase_add_test(tc_core, scan_errors);
+    suite_add_tcase(s, tc_core);
+
+    return s;
+}
+
+Suite* journal_suite() {
+    Suite* s;
+    TCase* tc_core;
+
+    s = suite_create("FS ioctl journal");
+    tc_core = tcase_create("FS ioctl journal Core");
+    tcase_add_test(tc_core, journal_success);
+    tcase_add_test(tc_core, journal_errors);
+    suite_add_tcase(s, tc_core);
+
+    return s;
+}
+
+int main() {
+    int number_failed;
+    Suite* s;
+    SRunner* sr;
+
+    s = ttl_suite();
+    sr = srunner_create(s);
+    srunner_add_suite(sr, rmtree_suite());
+    srunner_add_suite(sr, reserve_suite());
+    srunner_add_suite(sr, archive_suite());
+    srunner_add_suite(sr, scan_suite());
+    srunner_add_suite(sr, journal_suite());
+
+    srunner_run_all(sr, CK_NORMAL);
+    number_failed = srunner_ntests_failed(sr);
+    srunner_free(sr);
+    return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,422 @@
+// TEST_SYSCALLS:
+/**
+ * Tests for the mount options that keep the data outside of the tree. Each
+ * test mounts its own fs next to the one the other tests use.
+ */
+
+// for kill, nanosleep and utimensat, same as util.h
+#define _XOPEN_SOURCE 700
+#include <signal.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/wait.h>
+
+#include "../src/fs_ioctl.h"
+#include "test_util.h"
+
+#define OPTS_MOUNT "/tmp/fuse_test_opts"
+#define OPTS_PATH OPTS_MOUNT "/"
+#define STATE_DIR "/tmp/fs_state/"
+#define BEHIND_DIR "/tmp/fs_behind/"
+#define LOWER_DIR "/tmp/fs_lower/"
+
+/**
+ * Start the fs in the foreground with the option, if any. Returns the pid
+ * once the fs is mounted or -1 if it exited before that
+ */
+static pid_t mount_fs(const char* opt) {
+    struct stat parent;
+    struct stat mnt;
+    ck_assert_int_eq(system("mkdir -p " OPTS_MOUNT), 0);
+    ck_assert_int_eq(stat("/tmp", &parent), 0);
+
+    pid_t pid = fork();
+    ck_assert_int_ge(pid, 0);
+    if (pid == 0) {
+        if (opt != NULL)
+            execl("./fuse_mount", "fuse_mount", "-f", opt, OPTS_MOUNT, NULL);
+        else
+            execl("./fuse_mount", "fuse_mount", "-f", OPTS_MOUNT, NULL);
+        _exit(127);
+    }
+
+    struct timespec wait = { .tv_nsec = 10000000 };
+    for (int ii = 0; ii < 500; ii++) {
+        if (stat(OPTS_MOUNT, &mnt) == 0 && mnt.st_dev != parent.st_dev)
+            return pid;
+        if (waitpid(pid, NULL, WNOHANG) == pid)
+            return -1;
+        nanosleep(&wait, NULL);
+    }
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+    return -1;
+}
+
+/**
+ * Unmount the fs and wait for it to exit. Returns its exit status
+ */
+static int unmount_fs(pid_t pid) {
+    int status;
+    ck_assert_int_eq(system("fusermount -u " OPTS_MOUNT), 0);
+    ck_assert_int_eq(waitpid(pid, &status, 0), pid);
+    return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+static void write_file(const char* path, const char* data) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, DEF_FILE_MODE);
+    ck_assert_int_ge(fd, 2);
+    ck_assert_int_eq(write(fd, data, strlen(data)), strlen(data));
+    close(fd);
+}
+
+static uint32_t get_ttl(const char* path) {
+    uint32_t ttl;
+    int fd = open(path, O_RDONLY);
+    ck_assert_int_ge(fd, 2);
+    ck_assert_int_eq(ioctl(fd, FS_IOC_GET_TTL, &ttl), 0);
+    close(fd);
+    return ttl;
+}
+
+static void check_file(const char* path, const char* data) {
+    char buf[256];
+    int fd = open(path, O_RDONLY);
+    ck_assert_int_ge(fd, 2);
+    ck_assert_int_eq(read(fd, buf, sizeof(buf)), strlen(data));
+    ck_assert_int_eq(memcmp(buf, data, strlen(data)), 0);
+    close(fd);
+}
+
+START_TEST(state_restore) {
+    struct stat st;
+    ck_assert_int_eq(system("rm -rf " STATE_DIR " && mkdir -p " STATE_DIR), 0);
+    // nothing to restore on the first mount
+    pid_t pid = mount_fs("--state=" STATE_DIR "image");
+    ck_assert_int_gt(pid, 0);
+    ck_assert_int_eq(mkdir(OPTS_PATH "dir", 0700), 0);
+    write_file(OPTS_PATH "dir/foo.txt", "foo");
+    write_file(OPTS_PATH "bar.txt", "bar bar");
+    struct timespec times[2] = { { .tv_sec = 1000 }, { .tv_sec = 2000 } };
+    ck_assert_int_eq(utimensat(AT_FDCWD, OPTS_PATH "bar.txt", times, 0), 0);
+    ck_assert_int_eq(unmount_fs(pid), 0);
+    ck_assert_int_eq(stat(STATE_DIR "image", &st), 0);
+
+    pid = mount_fs("--state=" STATE_DIR "image");
+    ck_assert_int_gt(pid, 0);
+    test_readdirh(OPTS_PATH, "bar.txt", "dir", NULL);
+    check_file(OPTS_PATH "dir/foo.txt", "foo");
+    check_file(OPTS_PATH "bar.txt", "bar bar");
+    ck_assert_int_eq(stat(OPTS_PATH "dir", &st), 0);
+    ck_assert_int_eq(st.st_mode, S_IFDIR | 0700);
+    ck_assert_int_eq(stat(OPTS_PATH "bar.txt", &st), 0);
+    ck_assert_int_eq(st.st_mtime, 2000);
+    ck_assert_int_eq(unmount_fs(pid), 0);
+}
+END_TEST
+
+START_TEST(state_corrupt) {
+    struct stat st;
+    struct stat corrupt_st;
+    ck_assert_int_eq(system("rm -rf " STATE_DIR " && mkdir -p " STATE_DIR
+                            " && head -c 4096 /dev/urandom > " STATE_DIR "image"
+                            " && cp " STATE_DIR "image " STATE_DIR "copy"),
+        0);
+    ck_assert_int_eq(stat(STATE_DIR "image", &corrupt_st), 0);
+
+    // the mount fails and the image is left alone
+    ck_assert_int_eq(mount_fs("--state=" STATE_DIR "image"), -1);
+    ck_assert_int_eq(stat(STATE_DIR "image", &st), 0);
+    ck_assert_int_eq(st.st_mtime, corrupt_st.st_mtime);
+    ck_assert_int_eq(system("cmp -s " STATE_DIR "image " STATE_DIR "copy"), 0);
+    // no temporary image was left behind either
+    fn_errno(stat(STATE_DIR "image.tmp", &st), ENOENT);
+}
+END_TEST
+
+START_TEST(ttl_rule_nested) {
+    pid_t pid = mount_fs("--ttl=/scratch:3600");
+    ck_assert_int_gt(pid, 0);
+    // the rule directory keeps the ttl, the items under it expire with it
+    ck_assert_int_eq(mkdir(OPTS_PATH "scratch", 0755), 0);
+    ck_assert_int_eq(mkdir(OPTS_PATH "scratch/sub", 0755), 0);
+    write_file(OPTS_PATH "scratch/sub/foo.txt", "foo");
+    ck_assert_int_eq(get_ttl(OPTS_PATH "scratch"), 3600);
+    ck_assert_int_eq(get_ttl(OPTS_PATH "scratch/sub"), 3600);
+    ck_assert_int_eq(get_ttl(OPTS_PATH "scratch/sub/foo.txt"), 3600);
+
+    // a directory moved under the path has no ttl but its new items do
+    ck_assert_int_eq(mkdir(OPTS_PATH "moved", 0755), 0);
+    ck_assert_int_eq(rename(OPTS_PATH "moved", OPTS_PATH "scratch/moved"), 0);
+    ck_assert_int_eq(get_ttl(OPTS_PATH "scratch/moved"), 0);
+    write_file(OPTS_PATH "scratch/moved/bar.txt", "bar");
+    ck_assert_int_eq(get_ttl(OPTS_PATH "scratch/moved/bar.txt"), 3600);
+
+    // the prefix only matches whole names
+    ck_assert_int_eq(mkdir(OPTS_PATH "scratchpad", 0755), 0);
+    write_file(OPTS_PATH "scratchpad/foo.txt", "foo");
+    ck_assert_int_eq(get_ttl(OPTS_PATH "scratchpad"), 0);
+    ck_assert_int_eq(get_ttl(OPTS_PATH "scratchpad/foo.txt"), 0);
+    ck_assert_int_eq(unmount_fs(pid), 0);
+}
+END_TEST
+
+START_TEST(lower_read_through) {
+    struct stat st;
+    ck_assert_int_eq(system("rm -rf " LOWER_DIR " && mkdir -p " LOWER_DIR "dir/sub"
+                            " && printf foo > " LOWER_DIR "dir/foo.txt"
+                            " && printf baz > " LOWER_DIR "dir/sub/baz.txt"
+                            " && printf 'bar bar' > " LOWER_DIR "bar.txt"
+                            " && chmod 640 " LOWER_DIR "bar.txt"),
+        0);
+    pid_t pid = mount_fs("--lower=" LOWER_DIR);
+    ck_assert_int_gt(pid, 0);
+    test_readdirh(OPTS_PATH, "bar.txt", "dir", NULL);
+    test_readdirh(OPTS_PATH "dir", "foo.txt", "sub", NULL);
+    check_file(OPTS_PATH "dir/foo.txt", "foo");
+    check_file(OPTS_PATH "bar.txt", "bar bar");
+    ck_assert_int_eq(stat(OPTS_PATH "bar.txt", &st), 0);
+    ck_assert_int_eq(st.st_mode, S_IFREG | 0640);
+    ck_assert_int_eq(st.st_size, 7);
+    fn_errno(stat(OPTS_PATH "dir/nothing", &st), ENOENT);
+
+    // changes are made to the copy in memory, the directory keeps the old
+    int fd = open(OPTS_PATH "dir/foo.txt", O_WRONLY | O_APPEND);
+    ck_assert_int_ge(fd, 2);
+    ck_assert_int_eq(write(fd, " foo", 4), 4);
+    close(fd);
+    check_file(OPTS_PATH "dir/foo.txt", "foo foo");
+    ck_assert_int_eq(rename(OPTS_PATH "dir", OPTS_PATH "moved"), 0);
+    test_readdirh(OPTS_PATH "moved", "foo.txt", "sub", NULL);
+    check_file(OPTS_PATH "moved/foo.txt", "foo foo");
+    // files that weren't read yet are read from where they were
+    ck_assert_int_eq(rename(OPTS_PATH "moved/sub/baz.txt", OPTS_PATH "moved/baz.txt"), 0);
+    check_file(OPTS_PATH "moved/baz.txt", "baz");
+    ck_assert_int_eq(unlink(OPTS_PATH "bar.txt"), 0);
+    write_file(OPTS_PATH "new.txt", "new");
+    test_readdirh(OPTS_PATH, "moved", "new.txt", NULL);
+    ck_assert_int_eq(unmount_fs(pid), 0);
+
+    check_file(LOWER_DIR "dir/foo.txt", "foo");
+    check_file(LOWER_DIR "bar.txt", "bar bar");
+    fn_errno(stat(LOWER_DIR "moved", &st), ENOENT);
+    fn_errno(stat(LOWER_DIR "new.txt", &st), ENOENT);
+}
+END_TEST
+
+START_TEST(write_behind_contents) {
+    struct stat st;
+    ck_assert_int_eq(system("rm -rf " BEHIND_DIR " && mkdir -p " BEHIND_DIR), 0);
+    pid_t pid = mount_fs("--write-behind=" BEHIND_DIR);
+    ck_assert_int_gt(pid, 0);
+    ck_assert_int_eq(mkdir(OPTS_PATH "dir", 0700), 0);
+    write_file(OPTS_PATH "dir/foo.txt", "foo foo");
+    write_file(OPTS_PATH "bar.txt", "bar");
+    write_file(OPTS_PATH "gone.txt", "gone");
+    ck_assert_int_eq(truncate(OPTS_PATH "dir/foo.txt", 3), 0);
+    ck_assert_int_eq(rename(OPTS_PATH "dir", OPTS_PATH "moved"), 0);
+    ck_assert_int_eq(unlink(OPTS_PATH "gone.txt"), 0);
+
+    // single bytes far apart, the holes between them aren't written
+    int fd = open(OPTS_PATH "sparse", O_WRONLY | O_CREAT, DEF_FILE_MODE);
+    ck_assert_int_ge(fd, 2);
+    for (off_t off = 0; off <= (64 << 20); off += 1 << 20)
+        ck_assert_int_eq(pwrite(fd, "x", 1, off), 1);
+    close(fd);
+
+    // the queue is replayed before the fs exits
+    ck_assert_int_eq(unmount_fs(pid), 0);
+    check_file(BEHIND_DIR "moved/foo.txt", "foo");
+    check_file(BEHIND_DIR "bar.txt", "bar");
+    fn_errno(stat(BEHIND_DIR "dir", &st), ENOENT);
+    fn_errno(stat(BEHIND_DIR "gone.txt", &st), ENOENT);
+    ck_assert_int_eq(stat(BEHIND_DIR "moved", &st), 0);
+    ck_assert_int_eq(st.st_mode & 07777, 0700);
+    ck_assert_int_eq(stat(BEHIND_DIR "sparse", &st), 0);
+    ck_assert_int_eq(st.st_size, (64 << 20) + 1);
+    ck_assert_int_lt(st.st_blocks * 512, 8 << 20);
+}
+END_TEST
+
+START_TEST(write_behind_import) {
+    ck_assert_int_eq(system("rm -rf " BEHIND_DIR " /tmp/fs_behind_src && mkdir -p " BEHIND_DIR " /tmp/fs_behind_src/sub"
+                            " && echo foo > /tmp/fs_behind_src/foo.txt"
+                            " && echo bar > /tmp/fs_behind_src/sub/bar.txt"
+                            " && tar cf /tmp/fs_behind.tar -C /tmp/fs_behind_src ."),
+        0);
+    pid_t pid = mount_fs("--write-behind=" BEHIND_DIR);
+    ck_assert_int_gt(pid, 0);
+    ck_assert_int_eq(mkdir(OPTS_PATH "import", 0755), 0);
+    write_file(OPTS_PATH "import/foo.txt", "replaced by the import");
+
+    struct fs_ioc_archive req = { .fd = open("/tmp/fs_behind.tar", O_RDONLY) };
+    ck_assert_int_ge(req.fd, 2);
+    int dfd = open(OPTS_PATH "import", O_RDONLY);
+    ck_assert_int_ge(dfd, 2);
+    ck_assert_int_eq(ioctl(dfd, FS_IOC_IMPORT, &req), 0);
+    close(dfd);
+    close(req.fd);
+
+    // a write to part of an imported file keeps the rest of it
+    int fd = open(OPTS_PATH "import/sub/bar.txt", O_WRONLY);
+    ck_assert_int_ge(fd, 2);
+    ck_assert_int_eq(pwrite(fd, "B", 1, 0), 1);
+    close(fd);
+
+    ck_assert_int_eq(unmount_fs(pid), 0);
+    check_file(BEHIND_DIR "import/foo.txt", "foo\n");
+    check_file(BEHIND_DIR "import/sub/bar.txt", "Bar\n");
+}
+END_TEST
+
+START_TEST(memfd_data) {
+    static char buf[3 << 20];
+    struct stat st;
+    pid_t pid = mount_fs("--memfd");
+    ck_assert_int_gt(pid, 0);
+    write_file(OPTS_PATH "foo.txt", "foo bar");
+    check_file(OPTS_PATH "foo.txt", "foo bar");
+
+    // writes past the end leave a hole of zeros, bigger than a fuse request
+    int fd = open(OPTS_PATH "big", O_RDWR | O_CREAT, DEF_FILE_MODE);
+    ck_assert_int_ge(fd, 2);
+    ck_assert_int_eq(pwrite(fd, "end", 3, sizeof(buf) - 3), 3);
+    ck_assert_int_eq(pread(fd, buf, sizeof(buf), 0), sizeof(buf));
+    ck_assert_int_eq(buf[0], 0);
+    ck_assert_int_eq(buf[sizeof(buf) / 2], 0);
+    ck_assert_int_eq(memcmp(buf + sizeof(buf) - 3, "end", 3), 0);
+
+    // cut and grown again, the cut data doesn't come back
+    ck_assert_int_eq(ftruncate(fd, 1), 0);
+    ck_assert_int_eq(ftruncate(fd, 4096), 0);
+    ck_assert_int_eq(fstat(fd, &st), 0);
+    ck_assert_int_eq(st.st_size, 4096);
+    ck_assert_int_eq(pread(fd, buf, sizeof(buf), 0), 4096);
+    for (size_t ii = 0; ii < 4096; ii++)
+        ck_assert_int_eq(buf[ii], 0);
+
+    // the data stays readable through the open file after the unlink
+    ck_assert_int_eq(pwrite(fd, "abc", 3, 0), 3);
+    ck_assert_int_eq(unlink(OPTS_PATH "big"), 0);
+    ck_assert_int_eq(pread(fd, buf, 3, 0), 3);
+    ck_assert_int_eq(memcmp(buf, "abc", 3), 0);
+    close(fd);
+    ck_assert_int_eq(unmount_fs(pid), 0);
+}
+END_TEST
+
+START_TEST(journal_disabled) {
+    static struct fs_ioc_journal req;
+    pid_t pid = mount_fs(NULL);
+    ck_assert_int_gt(pid, 0);
+    int fd = open(OPTS_MOUNT, O_RDONLY | O_DIRECTORY);
+    ck_assert_int_ge(fd, 2);
+    fn_errno(ioctl(fd, FS_IOC_JOURNAL, &req), ENOTSUP);
+    close(fd);
+    ck_assert_int_eq(unmount_fs(pid), 0);
+
+    // sizes out of range fail the mount
+    ck_assert_int_eq(mount_fs("--journal=0"), -1);
+    ck_assert_int_eq(mount_fs("--journal=99999999"), -1);
+}
+END_TEST
+
+Suite* state_suite() {
+    Suite* s;
+    TCase* tc_core;
+
+    // first suite needs to have "\n " to make the output cleaner
+    s = suite_create("\n FS mount state");
+    tc_core = tcase_create("FS mount state Core");
+    tcase_set_timeout(tc_core, 30);
+    tcase_add_test(tc_core, state_restore);
+    tcase_add_test(tc_core, state_corrupt);
+    suite_add_tcase(s, tc_core);
+
+    return s;
+}
+
+Suite* ttl_rule_suite() {
+    Suite* s;
+    TCase* tc_core;
+
+    s = suite_create("FS mount ttl rules");
+    tc_core = tcase_create("FS mount ttl rules Core");
+    tcase_set_timeout(tc_core, 30);
+    tcase_add_test(tc_core, ttl_rule_nested);
+    suite_add_tcase(s, tc_core);
+
+    return s;
+}
+
+Suite* lower_suite() {
+    Suite* s;
+    TCase* tc_core;
+
+    s = suite_create("FS mount lower");
+    tc_core = tcase_create("FS mount lower Core");
+    tcase_set_timeout(tc_core, 30);
+    tcase_add_test(tc_core, lower_read_through);
+    suite_add_tcase(s, tc_core);
+
+    return s;
+}
+
+Suite* write_behind_suite() {
+    Suite* s;
+    TCase* tc_core;
+
+    s = suite_create("FS mount write-behind");
+    tc_core = tcase_create("FS mount write-behind Core");
+    tcase_set_timeout(tc_core, 30);
+    tcase_add_test(tc_core, write_behind_contents);
+    tcase_add_test(tc_core, write_behind_import);
+    suite_add_tcase(s, tc_core);
+
+    return s;
+}
+
+Suite* memfd_suite() {
+    Suite* s;
+    TCase* tc_core;
+
+    s = suite_create("FS mount memfd");
+    tc_core = tcase_create("FS mount memfd Core");
+    tcase_set_timeout(tc_core, 30);
+    tcase_add_test(tc_core, memfd_data);
+    suite_add_tcase(s, tc_core);
+
+    return s;
+}
+
+Suite* journal_suite() {
+    Suite* s;
+    TCase* tc_core;
+
+    s = suite_create("FS mount journal");
+    tc_core = tcase_create("FS mount journal Core");
+    tcase_set_timeout(tc_core, 30);
+    tcase_add_test(tc_core, journal_disabled);
+    suite_add_tcase(s, tc_core);
+
+    return s;
+}
+
+int main() {
+    int number_failed;
+    Suite* s;
+    SRunner* sr;
+
+    s = state_suite();
+    sr = srunner_create(s);
+    srunner_add_suite(sr, ttl_rule_suite());
+    srunner_add_suite(sr, lower_suite());
+    srunner_add_suite(sr, write_behind_suite());
+    srunner_add_suite(sr, journal_suite());
+    srunner_add_suite(sr, memfd_suite());
+
+    srunner_run_all(sr, CK_NORMAL);
+    number_failed = srunner_ntests_failed(sr);
+    srunner_free(sr);
+    return (number_failed == 0) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -16,6 +16,26 @@ START_TEST(unlink_success) {
 }
 END_TEST
 
+START_TEST(unlink_open) {
+    char buf[16];
+    struct stat st;
+    int fd = open(FS_PATH "unlink_open.txt", O_RDWR | O_CREAT, DEF_FILE_MODE);
+    ck_assert_int_ge(fd, 2);
+    ck_assert_int_eq(write(fd, "FOO", 3), 3);
+    ck_assert_int_eq(unlink(FS_PATH "unlink_open.txt"), 0);
+    fn_errno(stat(FS_PATH "unlink_open.txt", &st), ENOENT);
+    // the file stays usable until it is closed
+    ck_assert_int_eq(write(fd, "BAR", 3), 3);
+    ck_assert_int_eq(lseek(fd, 0, SEEK_SET), 0);
+    ck_assert_int_eq(read(fd, buf, sizeof(buf)), 6);
+    buf[6] = '\0';
+    ck_assert_str_eq(buf, "FOOBAR");
+    ck_assert_int_eq(fstat(fd, &st), 0);
+    ck_assert_int_eq(st.st_size, 6);
+    close(fd);
+}
+END_TEST
+
 START_TEST(unlink_errors) {
     // TODO: EACCESS
     // TODO: cd to FS_PATH and try to rm "." and ".."
@@ -105,6 +125,7 @@ Suite* unlink_suite() {
     s = suite_create("\n POSIX unlink");
     tc_core = tcase_create("POSIX unlink Core");
     tcase_add_test(tc_core, unlink_success);
+    tcase_add_test(tc_core, unlink_open);
     tcase_add_test(tc_core, unlink_errors);
     suite_add_tcase(s, tc_core);
 
@@ -41,6 +41,22 @@ START_TEST(write_success) {
 }
 END_TEST
 
+START_TEST(write_past_end) {
+    char buf[16];
+    int fd = open(FS_PATH "write_test_hole.txt", O_RDWR | O_CREAT, DEF_FILE_MODE);
+    ck_assert_int_eq(pwrite(fd, "FOO", 3, 0), 3);
+    // the gap is read back as zeros
+    ck_assert_int_eq(pwrite(fd, "BAR", 3, 8), 3);
+    ck_assert_int_eq(pread(fd, buf, sizeof(buf), 0), 11);
+    ck_assert_mem_eq(buf, "FOO\0\0\0\0\0BAR", 11);
+    ck_assert_int_eq(ftruncate(fd, 2), 0);
+    ck_assert_int_eq(ftruncate(fd, 6), 0);
+    ck_assert_int_eq(pread(fd, buf, sizeof(buf), 0), 6);
+    ck_assert_mem_eq(buf, "FO\0\0\0\0", 6);
+    close(fd);
+}
+END_TEST
+
 START_TEST(write_errors) {
     // TODO: EAGAIN
     char err[1] = { 'A' };
@@ -72,6 +88,7 @@ Suite* write_suite() {
     s = suite_create("\n POSIX write");
     tc_core = tcase_create("POSIX write Core");
     tcase_add_test(tc_core, write_success);
+    tcase_add_test(tc_core, write_past_end);
     tcase_add_test(tc_core, write_errors);
     suite_add_tcase(s, tc_core);
 